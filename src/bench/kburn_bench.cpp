@@ -0,0 +1,551 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <random>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <CLI/CLI.hpp>
+
+#include <kburn.h>
+#include <crc32.h>
+#include <sha256.h>
+#include <kdimage.h>
+#include <usb_transport.h>
+#include <k230/kburn_k230.h>
+#include <k230/kburn_k230_emulator.h>
+
+using namespace std;
+using namespace std::chrono;
+
+using namespace Kendryte_Burning_Tool;
+
+struct bench_options {
+    size_t chunk_size = 4 * 1024 * 1024;
+    size_t chunks = 8;
+    int rounds = 5;
+    uint32_t seed = 1;
+
+    uint64_t image_size = 64 * 1024 * 1024;
+    size_t parts = 8;
+    size_t stream_chunk = 1024 * 1024;
+
+    string work_dir;
+    string json;
+};
+
+struct bench_result {
+    string name;
+    uint64_t bytes;     // 0 for benchmarks reported per operation
+    uint64_t ops;
+    double seconds;     // best of all rounds
+    double allocs;      // per round
+    double alloc_bytes;
+};
+
+static vector<bench_result> results;
+static bool failed = false;
+
+///////////////////////////////////////////////////////////////////////////////
+// every operator new of the process is counted, libkburn's included where the
+// platform resolves it across shared objects (ELF does, Windows DLLs do not)
+static atomic<uint64_t> alloc_count{0};
+static atomic<uint64_t> alloc_bytes{0};
+
+void *operator new(size_t size) {
+    alloc_count.fetch_add(1, memory_order_relaxed);
+    alloc_bytes.fetch_add(size, memory_order_relaxed);
+
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+template <typename Setup, typename Fn>
+static void run_bench(const bench_options &opt, const string &name, uint64_t bytes, uint64_t ops, Setup &&setup, Fn &&fn) {
+    double best = 1e30;
+    uint64_t count = 0, size = 0;
+
+    for (int i = 0; i < opt.rounds; i++) {
+        setup(i);
+
+        uint64_t count_start = alloc_count.load(), size_start = alloc_bytes.load();
+        auto start = steady_clock::now();
+        fn();
+        best = std::min(best, duration<double>(steady_clock::now() - start).count());
+
+        count += alloc_count.load() - count_start;
+        size += alloc_bytes.load() - size_start;
+    }
+
+    results.push_back({name, bytes, ops, best, double(count) / opt.rounds, double(size) / opt.rounds});
+
+    if (bytes) {
+        printf("%-32s %10.1f MiB/s", name.c_str(), bytes / best / (1024.0 * 1024.0));
+    } else {
+        printf("%-32s %10.1f ns/op ", name.c_str(), best * 1e9 / ops);
+    }
+    printf(" %10.1f allocs %12.0f bytes\n", double(count) / opt.rounds, double(size) / opt.rounds);
+}
+
+template <typename Fn>
+static void run_bench(const bench_options &opt, const string &name, uint64_t bytes, Fn &&fn) {
+    run_bench(opt, name, bytes, 1, [](int) {}, fn);
+}
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        printf("MISMATCH: %s\n", what.c_str());
+        failed = true;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void bench_sha256(const bench_options &opt, const vector<vector<uint8_t>> &chunks) {
+    uint64_t bytes = opt.chunk_size * chunks.size();
+    vector<array<uint8_t, KBURN_SHA256_DIGEST_SIZE>> expect(chunks.size());
+    enum kburn_sha256_backend active = kburn_sha256_get_backend();
+
+    kburn_sha256_set_backend(KBURN_SHA256_PICOSHA2);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        KBurnSha256 sha256;
+
+        sha256.update(chunks[i].data(), chunks[i].size());
+        sha256.final(expect[i].data());
+    }
+
+    for (int b = 0; b < KBURN_SHA256_BACKEND_MAX; b++) {
+        enum kburn_sha256_backend backend = static_cast<enum kburn_sha256_backend>(b);
+
+        if (!kburn_sha256_set_backend(backend)) {
+            printf("%-32s %16s\n", (string("sha256/") + kburn_sha256_backend_name(backend)).c_str(), "unsupported");
+            continue;
+        }
+
+        vector<array<uint8_t, KBURN_SHA256_DIGEST_SIZE>> digest(chunks.size());
+
+        run_bench(opt, string("sha256/") + kburn_sha256_backend_name(backend), bytes, [&]() {
+            for (size_t i = 0; i < chunks.size(); i++) {
+                KBurnSha256 sha256;
+
+                sha256.update(chunks[i].data(), chunks[i].size());
+                sha256.final(digest[i].data());
+            }
+        });
+
+        check(digest == expect, string("sha256/") + kburn_sha256_backend_name(backend));
+    }
+
+    kburn_sha256_set_backend(active);
+
+    if (kburn_sha256_multi_supported()) {
+        vector<const uint8_t *> data;
+        vector<size_t> size;
+        vector<array<uint8_t, KBURN_SHA256_DIGEST_SIZE>> digest(chunks.size());
+
+        for (auto &c : chunks) {
+            data.push_back(c.data());
+            size.push_back(c.size());
+        }
+
+        run_bench(opt, "sha256/multi-buffer", bytes, [&]() {
+            kburn_sha256_multi(data.data(), size.data(), chunks.size(),
+                               reinterpret_cast<uint8_t (*)[KBURN_SHA256_DIGEST_SIZE]>(digest.data()));
+        });
+
+        check(digest == expect, "sha256/multi-buffer");
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void bench_crc32(const bench_options &opt, const vector<vector<uint8_t>> &chunks) {
+    uint64_t bytes = opt.chunk_size * chunks.size();
+
+    for (int b = 0; b < KBURN_CRC32_BACKEND_MAX; b++) {
+        enum kburn_crc32_backend backend = static_cast<enum kburn_crc32_backend>(b);
+        string name = string("crc32/") + kburn_crc32_backend_name(backend);
+
+        if (!kburn_crc32_backend_supported(backend)) {
+            printf("%-32s %16s\n", name.c_str(), "unsupported");
+            continue;
+        }
+
+        // equivalence with the table is checked by kburn_crc32_test
+        uint32_t crc = 0;
+        run_bench(opt, name, bytes, [&]() {
+            for (auto &c : chunks) {
+                crc = kburn_crc32_with(backend, crc, c.data(), c.size());
+            }
+        });
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+struct synthetic_image {
+    string path;
+    uint64_t content_bytes = 0;     // sum of the part contents
+    uint64_t table_bytes = 0;       // header and part table
+};
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// a valid .kdimg of `parts` random parts, none of them block aligned
+static bool make_kdimage(const bench_options &opt, const filesystem::path &path, synthetic_image &image) {
+    mt19937 rng(opt.seed);
+    vector<kd_img_part_t> table(opt.parts);
+    struct kd_img_hdr_t header;
+
+    memset(&header, 0, sizeof(header));
+    memset(table.data(), 0, table.size() * sizeof(kd_img_part_t));
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        printf("can not create %s\n", path.string().c_str());
+        return false;
+    }
+
+    uint64_t part_bytes = std::max<uint64_t>(opt.image_size / opt.parts, 8192);
+    uint64_t file_offset = align_up(sizeof(header) + table.size() * sizeof(kd_img_part_t), 4096);
+    uint64_t medium_offset = 0;
+    vector<uint32_t> content;
+
+    image.content_bytes = 0;
+
+    for (size_t i = 0; i < table.size(); i++) {
+        kd_img_part_t &part = table[i];
+        uint64_t size = part_bytes - (i * 523 + 1) % 4096;
+
+        content.resize((size + 3) / 4);
+        for (auto &word : content) {
+            word = rng();
+        }
+
+        KBurnSha256 sha256;
+        sha256.update(content.data(), size);
+        sha256.final(part.part_content_sha256);
+
+        part.part_magic = KDIMG_PART_MAGIC;
+        part.part_offset = static_cast<uint32_t>(medium_offset);
+        part.part_size = static_cast<uint32_t>(align_up(size, 4096));
+        part.part_erase_size = part.part_size;
+        part.part_max_size = static_cast<uint32_t>(align_up(size, 1024 * 1024));
+        part.part_content_offset = static_cast<uint32_t>(file_offset);
+        part.part_content_size = static_cast<uint32_t>(size);
+        part.part_comp_type = KBURN_COMPRESSION_NONE;
+        snprintf(part.part_name, sizeof(part.part_name), "part%zu", i);
+
+        out.seekp(file_offset);
+        out.write(reinterpret_cast<const char *>(content.data()), size);
+
+        file_offset = align_up(file_offset + size, 4096);
+        medium_offset += part.part_max_size;
+        image.content_bytes += size;
+    }
+
+    header.img_hdr_magic = KDIMG_HADER_MAGIC;
+    header.img_hdr_version = KDIMG_VERSION_COMPRESSION;
+    header.part_tbl_num = static_cast<uint32_t>(table.size());
+    header.part_tbl_crc32 = kburn_crc32(0, table.data(), table.size() * sizeof(kd_img_part_t));
+    snprintf(header.image_info, sizeof(header.image_info), "kburn_bench");
+    snprintf(header.chip_info, sizeof(header.chip_info), "k230");
+    snprintf(header.board_info, sizeof(header.board_info), "synthetic");
+    header.img_hdr_crc32 = kburn_crc32(0, &header, sizeof(header));
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(kd_img_part_t));
+    out.close();
+
+    image.path = path.string();
+    image.table_bytes = sizeof(header) + table.size() * sizeof(kd_img_part_t);
+
+    return !out.fail();
+}
+
+static void bench_kdimage(const bench_options &opt, const synthetic_image &image, const filesystem::path &work) {
+    error_code ec;
+    bool ok = true;
+
+    run_bench(opt, "kdimage/parse", image.table_bytes, [&]() {
+        KburnKdImage kdimage(image.path);
+
+        ok = ok && (nullptr != kdimage.items(false));
+    });
+    check(ok, "kdimage/parse");
+
+    // a new cache every round, each part is copied and hashed
+    filesystem::path cold = work / "cache-cold";
+
+    run_bench(opt, "kdimage/extract-cold", image.content_bytes, 1, [&](int) {
+        filesystem::remove_all(cold, ec);
+    }, [&]() {
+        KburnKdImage kdimage(image.path);
+
+        kdimage.set_cache(cold.string(), 0);
+        ok = ok && (nullptr != kdimage.items(true));
+    });
+    check(ok, "kdimage/extract-cold");
+
+    // every part already cached, only the lookups are left
+    run_bench(opt, "kdimage/extract-warm", image.content_bytes, [&]() {
+        KburnKdImage kdimage(image.path);
+
+        kdimage.set_cache(cold.string(), 0);
+        ok = ok && (nullptr != kdimage.items(true));
+    });
+    check(ok, "kdimage/extract-warm");
+
+    filesystem::remove_all(cold, ec);
+
+    KburnKdImage kdimage(image.path);
+    check(nullptr != kdimage.items(false), "kdimage/max_offset");
+
+    const uint64_t calls = 100000;
+    volatile size_t sink = 0;
+
+    run_bench(opt, "kdimage/max_offset", 0, calls, [](int) {}, [&]() {
+        for (uint64_t i = 0; i < calls; i++) {
+            sink = kdimage.max_offset();
+        }
+    });
+    (void)sink;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// the same source without its mapping, streamed through the read-ahead ring
+class unmapped_source : public KBurnImageSource {
+public:
+    explicit unmapped_source(KBurnImageSource &source) : source_(source) {}
+
+    uint64_t size() const override { return source_.size(); }
+    size_t read(uint64_t offset, void *buffer, size_t length) override { return source_.read(offset, buffer, length); }
+
+    bool digests(void) const override { return source_.digests(); }
+    void digest(uint64_t offset, const void *data, size_t length) override { source_.digest(offset, data, length); }
+    bool verify(void) override { return source_.verify(); }
+
+private:
+    KBurnImageSource &source_;
+};
+
+#define BENCH_EMULATOR_PATH     "bench"
+#define BENCH_EMULATOR_WAIT_MS  (15 * 1000)
+
+// the loader of an emulated board that takes everything at once, nullptr when it does not come up
+static K230::K230UBOOTBurner *boot_emulated_loader(const bench_options &opt, uint64_t capacity, const filesystem::path &backing) {
+    struct K230::k230_emulator_config config = K230::k230_emulator_default_config(KBURN_MEDIUM_EMMC);
+
+    config.backing_file = backing.string();
+
+    string options = "instant,capacity=" + to_string(capacity) + ",out_chunk=" + to_string(opt.stream_chunk);
+    if (!K230::k230_emulator_parse_options(options, config)) {
+        return nullptr;
+    }
+
+    auto emulator = make_shared<K230::K230Emulator>(config);
+    if (!emulator->is_valid() || !kburn_add_emulated_device(BENCH_EMULATOR_PATH, 0x29f1, 0x0230, emulator)) {
+        return nullptr;
+    }
+
+    struct kburn_usb_dev_info dev;
+
+    if (!wait_usb_device_with_vid_pid(dev, BENCH_EMULATOR_PATH, KBURN_USB_DEV_BROM, BENCH_EMULATOR_WAIT_MS)) {
+        return nullptr;
+    }
+
+    struct K230::K230BROMBurner::boot_options boot;
+    string error;
+
+    boot.medium_type = KBURN_MEDIUM_EMMC;
+    boot.reenumerate_timeout_ms = BENCH_EMULATOR_WAIT_MS;
+
+    unique_ptr<K230::K230UBOOTBurner> uboot = K230::K230BROMBurner::boot_loader(dev, boot, error);
+
+    if (!uboot) {
+        return nullptr;
+    }
+    uboot->set_medium_type(KBURN_MEDIUM_EMMC);
+
+    if (!uboot->probe() || (nullptr == uboot->get_medium_info())) {
+        return nullptr;
+    }
+
+    return uboot.release();
+}
+
+// the real K230UBOOTBurner::write_stream, into an emulated board with no timing, so only the host side counts
+static void bench_write_stream(const bench_options &opt, const synthetic_image &image, const filesystem::path &work) {
+    KburnKdImage kdimage(image.path);
+    KburnImageItemList *items = kdimage.items(false);
+    uint64_t bytes = 0;
+
+    if (nullptr == items) {
+        check(false, "write_stream");
+        return;
+    }
+
+    for (auto &item : *items) {
+        bytes += align_up(item.fileSize, 512);
+    }
+
+    int log_level = spdlog_get_log_level();
+    filesystem::path backing = work / "emulated.img";
+    error_code ec;
+
+    // the loader logs every session, that is not what is measured
+    spdlog_set_log_level(spdlog::level::warn);
+    kburn_initialize();
+
+    unique_ptr<K230::K230UBOOTBurner> uboot(boot_emulated_loader(opt, bytes, backing));
+
+    if (!uboot) {
+        check(false, "write_stream, emulated board");
+    } else {
+        uboot->register_progress_fn([](void *, size_t, size_t) {}, nullptr);
+
+        for (bool mapped : {true, false}) {
+            string name = string("write_stream/") + (mapped ? "mapped" : "read-ahead");
+            bool ok = true;
+
+            run_bench(opt, name, bytes, [&]() {
+                uint64_t address = 0;
+
+                for (auto &item : *items) {
+                    KBurnKdImagePartSource part(item);
+                    unmapped_source copy(part);
+                    uint64_t size = align_up(item.fileSize, 512);
+
+                    ok = ok && part.is_open() &&
+                         uboot->write_stream(mapped ? static_cast<KBurnImageSource &>(part) : copy, item.fileSize, address, size, 0);
+                    address += size;
+                }
+            });
+            check(ok, name);
+        }
+    }
+
+    uboot.reset();
+    kburn_remove_emulated_devices();
+    kburn_deinitialize();
+    spdlog_set_log_level(log_level);
+
+    filesystem::remove(backing, ec);
+}
+
+static bool write_json(const bench_options &opt, const string &path) {
+    FILE *out = fopen(path.c_str(), "w");
+
+    if (nullptr == out) {
+        printf("can not create %s\n", path.c_str());
+        return false;
+    }
+
+    fprintf(out, "{\n  \"config\": {\"chunk_size\": %zu, \"chunks\": %zu, \"rounds\": %d, \"seed\": %u, "
+                 "\"image_size\": %llu, \"parts\": %zu, \"stream_chunk\": %zu},\n",
+            opt.chunk_size, opt.chunks, opt.rounds, opt.seed, static_cast<unsigned long long>(opt.image_size), opt.parts,
+            opt.stream_chunk);
+    fprintf(out, "  \"failed\": %s,\n  \"results\": [\n", failed ? "true" : "false");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result &r = results[i];
+
+        fprintf(out, "    {\"name\": \"%s\", \"bytes\": %llu, \"ops\": %llu, \"seconds\": %.9f, "
+                     "\"mib_per_sec\": %.3f, \"ns_per_op\": %.3f, \"allocs\": %.1f, \"alloc_bytes\": %.0f}%s\n",
+                r.name.c_str(), static_cast<unsigned long long>(r.bytes), static_cast<unsigned long long>(r.ops), r.seconds,
+                r.bytes / r.seconds / (1024.0 * 1024.0), r.seconds * 1e9 / r.ops, r.allocs, r.alloc_bytes,
+                (i + 1 < results.size()) ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+
+    return 0 == fclose(out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv) {
+    CLI::App app{"Host side benchmarks for libkburn"};
+    bench_options opt;
+    size_t chunk_kib = opt.chunk_size / 1024;
+
+    app.add_option("--chunk-size", chunk_kib, "Chunk size in KiB")->check(CLI::PositiveNumber);
+    app.add_option("--chunks", opt.chunks, "Chunks per round")->check(CLI::PositiveNumber);
+    app.add_option("--rounds", opt.rounds, "Rounds per benchmark, the best one is reported")->check(CLI::PositiveNumber);
+    app.add_option("--seed", opt.seed, "Seed for the generated data");
+
+    uint64_t image_mib = opt.image_size / (1024 * 1024);
+    size_t stream_chunk_kib = opt.stream_chunk / 1024;
+
+    app.add_option("--image-size", image_mib, "Size of the generated kdimg in MiB")->check(CLI::PositiveNumber);
+    app.add_option("--parts", opt.parts, "Partitions in the generated kdimg")->check(CLI::PositiveNumber);
+    app.add_option("--stream-chunk", stream_chunk_kib, "write_stream chunk size in KiB")->check(CLI::PositiveNumber);
+    app.add_option("--work-dir", opt.work_dir, "Where the kdimg and its cache are generated, both are removed afterwards");
+    app.add_option("--json", opt.json, "Also write the results to this file as JSON");
+
+    CLI11_PARSE(app, argc, argv);
+
+    opt.chunk_size = chunk_kib * 1024;
+    opt.image_size = image_mib * 1024 * 1024;
+    opt.stream_chunk = stream_chunk_kib * 1024;
+
+    // same data every run for the same seed
+    mt19937 rng(opt.seed);
+    vector<vector<uint8_t>> chunks(opt.chunks, vector<uint8_t>(opt.chunk_size));
+
+    for (auto &c : chunks) {
+        for (auto &byte : c) {
+            byte = static_cast<uint8_t>(rng());
+        }
+    }
+
+    printf("%zu x %zu KiB, best of %d rounds\n\n", opt.chunks, opt.chunk_size / 1024, opt.rounds);
+
+    bench_crc32(opt, chunks);
+    bench_sha256(opt, chunks);
+
+    chunks.clear();
+
+    error_code ec;
+    filesystem::path work = opt.work_dir.empty() ? filesystem::temp_directory_path(ec) / "kburn_bench" : filesystem::path(opt.work_dir);
+    synthetic_image image;
+
+    filesystem::create_directories(work, ec);
+
+    printf("\n%zu parts, %llu MiB kdimg in %s\n\n", opt.parts,
+           static_cast<unsigned long long>(opt.image_size / (1024 * 1024)), work.string().c_str());
+
+    if (make_kdimage(opt, work / "synthetic.kdimg", image)) {
+        bench_kdimage(opt, image, work);
+        bench_write_stream(opt, image, work);
+    } else {
+        check(false, "kdimage generation");
+    }
+
+    filesystem::remove(work / "synthetic.kdimg", ec);
+    filesystem::remove(work, ec);   // only when nothing else is in there
+
+    if (!opt.json.empty() && !write_json(opt, opt.json)) {
+        return 1;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -5,17 +5,34 @@
 #include <iostream>
 #include <chrono>
 #include <iomanip>
+#include <algorithm>
 
 #include <stdexcept>
 
 #include <cstdio>
+#include <cstdarg>
 #include <cctype>    // for std::tolower
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <CLI/CLI.hpp>
 
 #include <kburn.h>
 #include <kdimage.h>
+#include <flash_plan.h>
+#include <image_sink.h>
+#include <image_source.h>
+#include <sparse_image.h>
 #include <k230/kburn_k230.h>
+#include <k230/kburn_k230_emulator.h>
+#include <usb_transport.h>
 
 using namespace std;
 using namespace std::chrono;
@@ -101,105 +118,628 @@ bool hasSuffixCaseInsensitive(std::string filename, std::string suffix) {
     return false;
 }
 
-struct kburn_usb_dev_info open_device(const std::string& path = "", bool checkisUboot = false) {
-    KBurnUSBDeviceList * device_list = list_usb_device_with_vid_pid();
-    
-    // Check if a specific path is provided
-    if (!path.empty()) {
-        for (auto it = device_list->begin(); it != device_list->end(); ++it) {
-            const auto& dev = *it;
-            if (dev.path == path) {
-                if (checkisUboot && dev.type != KBURN_USB_DEV_UBOOT) {
-                    throw std::invalid_argument("Device found, but it's not of type UBOOT");
-                }
-                return dev; // Device found and matches criteria
+// One progress line per device. A single device keeps the classic in-place bar,
+// several devices on a terminal get a board redrawn below the log messages.
+class ProgressBoard {
+public:
+    explicit ProgressBoard(bool multi_device) : multi_device_(multi_device), tty_(stdout_is_tty()) {}
+
+    size_t add(const std::string &label) {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        lines_.push_back({label, "waiting", steady_clock::now(), -1});
+
+        return lines_.size() - 1;
+    }
+
+    void update(size_t line, size_t iteration, size_t total) {
+        std::lock_guard<std::mutex> guard(lock_);
+        struct bar_line &bar = lines_[line];
+
+        if (iteration == 0) {
+            // Set the start time when iteration is 0
+            bar.start = steady_clock::now();
+        }
+
+        // Calculate percentage completion
+        double percent = total ? (double)iteration / total * 100 : 100;
+
+        // Create the progress bar (50 characters wide)
+        int bar_width = 50;
+        int filled_length = std::min(bar_width, static_cast<int>(percent / 2));
+        string text(filled_length, '=');
+        text += string(bar_width - filled_length, '-');
+
+        // Calculate speed in iterations per second (converted to KB/s)
+        duration<double> elapsed_time = duration_cast<duration<double>>(steady_clock::now() - bar.start);
+        double speed = elapsed_time.count() > 0 ? (iteration / 1024.0) / elapsed_time.count() : 0;
+
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "|%s| %.2f%% Complete - Speed: %.2f KB/s", text.c_str(), percent, speed);
+        bar.text = buffer;
+
+        if (!multi_device_) {
+            printf("\r%s", bar.text.c_str());
+
+            // Check if the iteration is complete
+            if (iteration >= total) {
+                printf("\n");
+            }
+        } else {
+            // redraw on every 0.1%, without a terminal print every 10%
+            int step = tty_ ? static_cast<int>(percent * 10) : static_cast<int>(percent / 10);
+
+            if (step == bar.last_step) {
+                return;
+            }
+            bar.last_step = step;
+
+            if (tty_) {
+                redraw_locked();
+            } else {
+                printf("[%s] %s\n", bar.label.c_str(), bar.text.c_str());
             }
         }
-        throw std::runtime_error("No devices available to open.");
-        // throw std::invalid_argument("No device found at path: " + path);
+
+        fflush(stdout);  // Flush the output to update the terminal
     }
 
-    // If no path is provided, open the first available device
-    for (auto it = device_list->begin(); it != device_list->end(); ++it) {
-        const auto& dev = *it;
-        if (checkisUboot) {
-            if (dev.type == KBURN_USB_DEV_UBOOT) {
-                return dev; // Return the first UBOOT type device
-            }
+    void print(size_t line, const char *fmt, ...) {
+        char buffer[512];
+        va_list args;
+
+        va_start(args, fmt);
+        vsnprintf(buffer, sizeof(buffer), fmt, args);
+        va_end(args);
+
+        std::lock_guard<std::mutex> guard(lock_);
+
+        if (!multi_device_) {
+            printf("%s\n", buffer);
+        } else if (tty_) {
+            erase_locked();
+            printf("[%s] %s\n", lines_[line].label.c_str(), buffer);
+            redraw_locked();
         } else {
-            return dev; // Return the first available device
+            printf("[%s] %s\n", lines_[line].label.c_str(), buffer);
+        }
+
+        fflush(stdout);
+    }
+
+private:
+    struct bar_line {
+        std::string label;
+        std::string text;
+        steady_clock::time_point start;
+        int last_step;
+    };
+
+    std::mutex lock_;
+    std::vector<struct bar_line> lines_;
+
+    bool multi_device_;
+    bool tty_;
+    size_t drawn_ = 0;
+
+    static bool stdout_is_tty(void) {
+#if defined(_WIN32)
+        return 0 != _isatty(_fileno(stdout));
+#else
+        return 0 != isatty(fileno(stdout));
+#endif
+    }
+
+    void erase_locked(void) {
+        if (drawn_) {
+            // back to the first bar and clear everything below
+            printf("\033[%zuA\r\033[J", drawn_);
+            drawn_ = 0;
         }
     }
 
-    throw std::runtime_error("No devices available to open.");
+    void redraw_locked(void) {
+        erase_locked();
+
+        for (const auto &bar : lines_) {
+            printf("%-8s %s\n", bar.label.c_str(), bar.text.c_str());
+        }
+        drawn_ = lines_.size();
+    }
+};
+
+struct kburn_usb_dev_info poll_and_open_device(ProgressBoard &board, size_t line, const std::string& path = "", enum kburn_usb_dev_type type = KBURN_USB_DEV_INVALID, int timeout = -1) {
+    struct kburn_usb_dev_info device;
+
+    board.print(line, "Waiting for %s device%s%s...", (KBURN_USB_DEV_INVALID == type) ? "a" : dev_type_str(type), path.empty() ? "" : " on ", path.c_str());
+
+    // wakes on hotplug arrival, only probes the port we are waiting for when a path is given
+    if (!wait_usb_device_with_vid_pid(device, path.empty() ? nullptr : path.c_str(), type, (timeout > 0) ? timeout * 1000 : -1)) {
+        throw std::runtime_error("Timeout reached while polling for device");
+    }
+
+    board.print(line, "Device found and opened: %s, type: %s", device.path, dev_type_str(device.type));
+
+    return device;
 }
 
-struct kburn_usb_dev_info poll_and_open_device(const std::string& path = "", bool checkisUboot = false, int poll_interval = 2, int timeout = -1) {
-    auto start_time = std::chrono::steady_clock::now();
+// the bytes of an item, read in place from the .kdimg unless it was extracted
+static std::unique_ptr<KBurnImageSource> open_item_source(const struct KburnImageItem_t &item) {
+    if (item.fromImage) {
+        auto source = std::make_unique<KBurnKdImagePartSource>(item);
+
+        return source->is_open() ? std::move(source) : nullptr;
+    }
+
+    auto source = std::make_unique<KBurnFileImageSource>(item.fileName);
+
+    return source->is_open() ? std::move(source) : nullptr;
+}
+
+static std::string item_name(const struct KburnImageItem_t &item) {
+    return item.fromImage ? (item.partName + "@" + item.fileName) : item.fileName;
+}
+
+char* readItem(const struct KburnImageItem_t &item, size_t& size) {
+    auto source = open_item_source(item);
+
+    if (!source) {
+        printf("Could not open %s\n", item_name(item).c_str());
+        return nullptr;
+    }
+
+    size = static_cast<size_t>(source->size());
+
+    char* buffer = new char[size];
+
+    if ((source->read(0, buffer, size) != size) || !source->verify()) {
+        delete[] buffer;
+
+        printf("Failed to read %s\n", item_name(item).c_str());
+
+        return nullptr;
+    }
+
+    return buffer;
+}
 
-    while (true) {
-        try {
-            auto device = open_device(path, checkisUboot);
+// sizes as they land on the medium, sparse images keep a session of their own
+static bool plan_items(KburnImageItemList &items, enum KBurnMediumType medium_type, uint64_t max_gap,
+    std::vector<struct kburn_plan_item> &plan, std::vector<struct kburn_write_session> &sessions) {
+    for (auto it = items.begin(); it != items.end(); ++it) {
+        const struct KburnImageItem_t &item = *it;
 
-            printf("Device found and opened: %s, type: %s\n", device.path, dev_type_str(device.type));
-            return device;
-        } catch (const std::invalid_argument& e) {
-            printf("Error: %s\n", e.what());
-        } catch (const std::runtime_error& e) {
-            printf("No devices found. Polling...\n");
+        auto source = open_item_source(item);
+        if (!source) {
+            printf("Could not open %s\n", item_name(item).c_str());
+            return false;
         }
 
-        if (timeout > 0) {
-            auto now = std::chrono::steady_clock::now();
-            if (std::chrono::duration_cast<std::chrono::seconds>(now - start_time).count() > timeout) {
-                throw std::runtime_error("Timeout reached while polling for device");
+        struct kburn_plan_item entry = {item.partOffset, source->size(), item.partSize, item.partFlag, true, item.partEraseSize};
+
+        if (KBurnSparseImage::probe(*source)) {
+            KBurnSparseImage sparse(*source);
+
+            if (!sparse.is_valid()) {
+                printf("Invalid sparse image %s\n", item_name(item).c_str());
+                return false;
             }
+
+            entry.size = sparse.size();
+            entry.mergeable = false;
         }
 
-        do_sleep(poll_interval);
+        plan.push_back(entry);
     }
+
+    sessions = kburn_plan_write_sessions(plan, medium_type, max_gap);
+
+    return true;
 }
 
-// Global variable to store start time
-steady_clock::time_point progress_start_time;
+static void print_plan(KburnImageItemList &items, enum KBurnMediumType medium_type,
+    const std::vector<struct kburn_plan_item> &plan, const std::vector<struct kburn_write_session> &sessions) {
+    unsigned int fill = kburn_medium_erased_byte(medium_type);
+    const struct KburnImageItem_t *list = items.begin().operator->();
 
-KBurner::progress_fn_t progress = [](void* ctx, size_t iteration, size_t total) {
-    if (iteration == 0) {
-        // Set the start time when iteration is 0
-        progress_start_time = steady_clock::now();
+    printf("Write plan, %zu parts in %zu sessions:\n", plan.size(), sessions.size());
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const struct kburn_write_session &session = sessions[i];
+        uint64_t pos = session.offset;
+
+        printf("  session %zu: 0x%08llX - 0x%08llX, %zu parts%s\n", i, (unsigned long long)session.offset,
+            (unsigned long long)(session.offset + session.size), session.items.size(), session.flag ? ", flagged" : "");
+
+        for (size_t index : session.items) {
+            const struct kburn_plan_item &entry = plan[index];
+
+            if (pos < entry.offset) {
+                printf("    0x%08llX - 0x%08llX  gap, filled with 0x%02X\n", (unsigned long long)pos, (unsigned long long)entry.offset, fill);
+            }
+            printf("    0x%08llX - 0x%08llX  %s%s\n", (unsigned long long)entry.offset, (unsigned long long)(entry.offset + entry.size),
+                item_name(list[index]).c_str(), entry.mergeable ? "" : ", sparse");
+
+            pos = entry.offset + entry.size;
+        }
     }
+}
+
+// everything a device worker needs, filled once from the command line
+struct flash_options {
+    enum KBurnMediumType medium_type;
+
+    bool custom_loader;
+    const char *loader_data;
+    size_t loader_size;
+    unsigned long load_address;
+
+    unsigned int usb_queue_depth;
+    bool probe_loader_pages;
+    bool incremental;
+    bool auto_reboot;
+    bool multi_device;    /* workers run concurrently and share the libusb context */
+
+    bool read_data;
+    unsigned long read_data_address;
+    unsigned long read_data_size;
+    std::string read_data_file;
+
+    bool erase_medium;
+    unsigned long erase_medium_address;
+    unsigned long erase_medium_size;
+
+    size_t file_offset_max;
+    KburnImageItemList *items;
+    std::vector<struct kburn_plan_item> plan;
+    std::vector<struct kburn_write_session> sessions;
+};
+
+struct flash_report {
+    std::string path;
+    bool ok = false;
+    double elapsed = 0;
+    std::string error;
+    std::string timings;
+};
+
+// the steps from a board in BROM mode to done, each ends on something the device did
+enum flash_state {
+    FLASH_STATE_WAIT_DEVICE = 0,
+    FLASH_STATE_UPLOAD_LOADER,
+    FLASH_STATE_BOOT_LOADER,
+    FLASH_STATE_REENUMERATE,
+    FLASH_STATE_LOADER_READY,
+    FLASH_STATE_PROBE,
+    FLASH_STATE_MEDIUM_INFO,
+    FLASH_STATE_OPERATE,
+    FLASH_STATE_DONE,
+    FLASH_STATE_MAX,
+};
 
-    // Calculate percentage completion
-    double percent = (double)iteration / total * 100;
+/* a rebooted chip has this long to come back as the loader */
+#define FLASH_REENUMERATE_TIMEOUT_SEC  (15)
 
-    // Create the progress bar (50 characters wide)
-    int bar_width = 50;
-    int filled_length = static_cast<int>(percent / 2);
-    string bar(filled_length, '=');
-    bar += string(bar_width - filled_length, '-');
+// records how long the flow spent in each state
+class FlashSession {
+public:
+    FlashSession() : since_(steady_clock::now()) {}
 
-    // Calculate elapsed time
-    steady_clock::time_point current_time = steady_clock::now();
-    duration<double> elapsed_time = duration_cast<duration<double>>(current_time - progress_start_time);
+    enum flash_state state() const { return state_; }
 
-    // Calculate speed in iterations per second (converted to KB/s)
-    double speed = (iteration / 1024.0) / elapsed_time.count();
+    void enter(enum flash_state next) {
+        auto now = steady_clock::now();
 
-    // Display the progress bar, percent complete, and speed using printf
-    printf("\r|%s| %.2f%% Complete - Speed: %.2f KB/s", bar.c_str(), percent, speed);
+        spent_[state_] += duration_cast<duration<double>>(now - since_).count();
+        since_ = now;
 
-    // Check if the iteration is complete
-    if (iteration >= total) {
-        printf("\n");
+        spdlog::debug("flash session, {} -> {}", state_name(state_), state_name(next));
+        state_ = next;
     }
 
-    fflush(stdout);  // Flush the output to update the terminal
+    std::string timings() const {
+        std::string text;
+        char buffer[64];
+
+        for (int i = 0; i < FLASH_STATE_DONE; i++) {
+            if (0 < spent_[i]) {
+                snprintf(buffer, sizeof(buffer), "%s%s %.2f sec", text.empty() ? "" : ", ", state_name(static_cast<enum flash_state>(i)), spent_[i]);
+                text += buffer;
+            }
+        }
+
+        return text;
+    }
+
+    static const char *state_name(enum flash_state state) {
+        const char *names[] = {"wait device", "upload loader", "boot loader", "re-enumerate", "loader ready", "probe", "medium info", "operate", "done"};
+
+        return (state < FLASH_STATE_MAX) ? names[state] : "unknown";
+    }
+
+private:
+    enum flash_state state_ = FLASH_STATE_WAIT_DEVICE;
+    steady_clock::time_point since_;
+    double spent_[FLASH_STATE_MAX] = {};
+};
+
+struct progress_slot {
+    ProgressBoard *board;
+    size_t line;
+};
+
+KBurner::progress_fn_t progress = [](void* ctx, size_t iteration, size_t total) {
+    struct progress_slot *slot = reinterpret_cast<struct progress_slot *>(ctx);
+
+    slot->board->update(slot->line, iteration, total);
 };
 
+// BROM loader upload, then read, erase or write through the uboot loader
+static bool run_device(std::string path, const struct flash_options &opt, ProgressBoard &board, size_t line, struct flash_report &report, FlashSession &session) {
+    struct progress_slot slot = {&board, line};
+    struct kburn_usb_dev_info dev;
+
+    try {
+        dev = poll_and_open_device(board, line, path);
+    } catch (const std::exception& e) {
+        report.error = e.what();
+        return false;
+    }
+    report.path = dev.path;
+
+    board.print(line, "use device %04X:%04X, path %s, type %s", dev.vid, dev.pid, dev.path, dev_type_str(dev.type));
+
+    struct K230::K230BROMBurner::boot_options boot;
+
+    boot.medium_type = opt.medium_type;
+    if(opt.custom_loader) {
+        boot.loader = opt.loader_data;
+        boot.loader_size = opt.loader_size;
+    }
+    boot.address = opt.load_address;
+    boot.page_probe = opt.probe_loader_pages;
+    boot.reenumerate_timeout_ms = FLASH_REENUMERATE_TIMEOUT_SEC * 1000;
+    boot.progress_fn = progress;
+    boot.ctx = &slot;
+    boot.step_fn = [&](void *, enum K230::K230BROMBurner::boot_step step, const struct kburn_usb_dev_info &at) {
+        switch(step) {
+            case K230::K230BROMBurner::BOOT_STEP_UPLOAD: {
+                session.enter(FLASH_STATE_UPLOAD_LOADER);
+            } break;
+            case K230::K230BROMBurner::BOOT_STEP_BOOT: {
+                session.enter(FLASH_STATE_BOOT_LOADER);
+            } break;
+            case K230::K230BROMBurner::BOOT_STEP_REENUMERATE: {
+                session.enter(FLASH_STATE_REENUMERATE);
+
+#ifdef __ANDROID__
+                // restarting libusb pulls the context from under the other workers, they rely on polling alone
+                if(!opt.multi_device) {
+                    kburn_deinitialize();
+                    do_sleep(1000);
+                    kburn_initialize();
+                }
+#endif
+
+                board.print(line, "Waiting for UBOOT device on %s...", at.path);
+            } break;
+            case K230::K230BROMBurner::BOOT_STEP_LOADER_READY: {
+                if(FLASH_STATE_REENUMERATE == session.state()) {
+                    board.print(line, "use device %04X:%04X, path %s, type %s.", at.vid, at.pid, at.path, dev_type_str(at.type));
+                }
+                session.enter(FLASH_STATE_LOADER_READY);
+            } break;
+            case K230::K230BROMBurner::BOOT_STEP_RETRY: {
+                board.print(line, "the loader did not come up, waiting for BROM device on %s to retry with smaller pages...", at.path);
+            } break;
+        }
+    };
+
+    std::string failure;
+    std::unique_ptr<K230::K230UBOOTBurner> uboot_burner = K230::K230BROMBurner::boot_loader(dev, boot, failure);
+
+    if (uboot_burner == nullptr) {
+        report.error = failure;
+        return false;
+    }
+
+    uboot_burner->register_progress_fn(progress, &slot);
+
+    uboot_burner->set_medium_type(opt.medium_type);
+    uboot_burner->set_out_queue_depth(opt.usb_queue_depth);
+    uboot_burner->set_in_queue_depth(opt.usb_queue_depth);
+
+    session.enter(FLASH_STATE_PROBE);
+
+    if(false == uboot_burner->probe()) {
+        report.error = "can't probe medium as configure";
+        return false;
+    }
+
+    session.enter(FLASH_STATE_MEDIUM_INFO);
+
+    struct K230::kburn_medium_info *medium_info = uboot_burner->get_medium_info();
+
+    session.enter(FLASH_STATE_OPERATE);
+
+    if (opt.read_data) {
+        // Ensure the read size is within the medium's capacity
+        if (opt.read_data_size > medium_info->capacity) {
+            report.error = "the requested data size exceeds the capacity of the medium";
+            return false;
+        }
+
+        KBurnFileImageSink sink(opt.read_data_file);
+        if (!sink.is_open()) {
+            report.error = "failed to open " + opt.read_data_file + " for writing";
+            return false;
+        }
+
+        board.print(line, "Reading %lu bytes from 0x%08lX and saving to %s.", opt.read_data_size, opt.read_data_address, opt.read_data_file.c_str());
+
+        // Perform the read operation, chunks go straight to the file
+        if (!uboot_burner->read_stream(sink, opt.read_data_size, opt.read_data_address)) {
+            report.error = "read failed";
+            return false;
+        }
+
+        if (!sink.close()) {
+            report.error = "failed to write all data to " + opt.read_data_file;
+            return false;
+        }
+
+        // Successfully saved the data
+        board.print(line, "Successfully read and saved %lu bytes to %s.", opt.read_data_size, opt.read_data_file.c_str());
+    } else if(opt.erase_medium) {
+        if(0x00 != opt.erase_medium_size) {
+            unsigned long erase_end = opt.erase_medium_address + opt.erase_medium_size;
+
+            board.print(line, "Erase 0x%08lX to 0x%08lX start.", opt.erase_medium_address, erase_end);
+
+            // Get the start time point
+            auto start = std::chrono::high_resolution_clock::now();
+
+            if(false == uboot_burner->erase(opt.erase_medium_address, opt.erase_medium_size)) {
+                report.error = "erase failed";
+                return false;
+            }
+            // Calculate the duration
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+            board.print(line, "Erase 0x%08lX to 0x%08lX done, use %.2f sec.", opt.erase_medium_address, erase_end, elapsed.count());
+        } else {
+            board.print(line, "Erase size is 0.");
+        }
+    } else {
+        if(opt.file_offset_max > medium_info->capacity) {
+            report.error = "files exceed the capacity of meidum";
+            return false;
+        }
+
+        const struct KburnImageItem_t *list = opt.items->begin().operator->();
+        size_t erase_parts = std::count_if(opt.plan.begin(), opt.plan.end(),
+            [](const struct kburn_plan_item &entry) { return entry.erase > entry.size; });
+
+        if (0x00 != erase_parts) {
+            if (0x00 == medium_info->erase_size) {
+                report.error = "unable to get medium erase size";
+                return false;
+            }
+
+            // a sparse session leaves its DONT_CARE holes alone, only its data ranges count as written
+            auto ranges = kburn_plan_part_erases(opt.plan, opt.sessions, medium_info->erase_size, KBURN_MEDIUM_OTP != opt.medium_type,
+                [&](const struct kburn_write_session &session, std::vector<struct kburn_image_range> &written) {
+                    auto source = open_item_source(list[session.items.front()]);
+
+                    if (!source || !KBurnSparseImage::probe(*source)) {
+                        return false;
+                    }
+
+                    KBurnSparseImage sparse(*source);
+
+                    written = uboot_burner->sparse_write_ranges(sparse, session.flag);
+                    return true;
+                });
+
+            board.print(line, "Erasing remaining space of %zu parts in %zu ranges.", erase_parts, ranges.size());
+
+            for (const auto &range : ranges) {
+                board.print(line, "Erasing 0x%08llX to 0x%08llX, Size: %llu.", (unsigned long long)range.offset,
+                    (unsigned long long)(range.offset + range.size), (unsigned long long)range.size);
+
+                if (!uboot_burner->erase(range.offset, range.size)) {
+                    report.error = "erase remaining space failed";
+                    return false;
+                }
+            }
+        }
+
+        for (const auto &session : opt.sessions) {
+            const struct KburnImageItem_t &first = list[session.items.front()];
+            std::string name = item_name(first);
+            std::unique_ptr<KBurnImageSource> source;
+            std::vector<std::unique_ptr<KBurnImageSource>> pieces;
+            bool write_ok;
+
+            if (1 < session.items.size()) {
+                // neighbouring parts go out as one, with the erased byte between them
+                auto joined = std::make_unique<KBurnJoinedImageSource>(session.size, kburn_medium_erased_byte(opt.medium_type));
+
+                for (size_t index : session.items) {
+                    const struct KburnImageItem_t &item = list[index];
+
+                    pieces.push_back(open_item_source(item));
+                    if (!pieces.back() || !joined->add(item.partOffset - session.offset, *pieces.back())) {
+                        report.error = "failed to open " + item_name(item);
+                        return false;
+                    }
+                }
+
+                name = std::to_string(session.items.size()) + " parts from " + first.partName;
+                source = std::move(joined);
+            } else {
+                source = open_item_source(first);
+                if (!source) {
+                    report.error = "failed to open " + name;
+                    return false;
+                }
+            }
+
+            size_t file_size = static_cast<size_t>(session.size);
+
+            if ((1 == session.items.size()) && KBurnSparseImage::probe(*source)) {
+                KBurnSparseImage sparse(*source);
+
+                board.print(line, "Write sparse %s to 0x%08X, Size: %zd, Data: %lu.", name.c_str(), first.partOffset, file_size, sparse.data_size());
+
+                write_ok = uboot_burner->write_sparse(sparse, session.offset, session.max, session.flag);
+            } else if (opt.incremental) {
+                board.print(line, "Write %s to 0x%08X incrementally, Size: %zd.", name.c_str(), first.partOffset, file_size);
+
+                write_ok = uboot_burner->write_incremental(*source, file_size, session.offset, session.max, session.flag);
+            } else {
+                board.print(line, "Write %s to 0x%08X, Size: %zd.", name.c_str(), first.partOffset, file_size);
+
+                write_ok = uboot_burner->write_stream(*source, file_size, session.offset, session.max, session.flag);
+            }
+
+            if (false == write_ok) {
+                report.error = "write " + name + " failed";
+                if (0x00 != uboot_burner->get_error_msg()[0]) {
+                    report.error += std::string(", ") + uboot_burner->get_error_msg();
+                }
+                return false;
+            }
+
+            // parts from a .kdimg were hashed while they were written, this only checks what was skipped
+            if (false == source->verify()) {
+                report.error = "SHA-256 of " + name + " does not match, the written data is corrupt";
+                return false;
+            }
+
+            const struct kburn_stream_stats &stream_stats = uboot_burner->get_stream_stats();
+            if (stream_stats.active) {
+                board.print(line, "Reader stalled %.2f sec, USB stalled %.2f sec, hash stalled %.2f sec.", stream_stats.reader_stall_sec, stream_stats.sender_stall_sec, stream_stats.digest_stall_sec);
+            }
+        }
+    }
+
+    if(opt.auto_reboot) {
+        board.print(line, "Auto reset board after write.");
+        uboot_burner->reboot();
+    }
+
+    session.enter(FLASH_STATE_DONE);
+
+    return true;
+}
+
 int main(int argc, char **argv) {
     size_t file_offset_max = 0;
-    struct kburn_usb_dev_info dev;
-    KburnImageItemList *kdimg_items;
+    KburnImageItemList *kdimg_items = nullptr;
+    const struct KburnImageItem_t *loader_item = nullptr;
+    struct flash_options opt = {};
+    int exit_code = 0;
 
     CLI::App app{"Kendryte Burning Tool"};
 
@@ -209,9 +749,12 @@ int main(int argc, char **argv) {
     bool list_device = false;
     app.add_flag("-l,--list-device", list_device, "List connected devices");
 
-    std::string device_address;
-    app.add_option("-d,--device-address", device_address, "Device address (format: 1-1 or 3-1), which is the result from '--list-device'")
-        ->default_str("");
+    std::vector<std::string> device_addresses;
+    app.add_option("-d,--device-address", device_addresses, "Device address (format: 1-1 or 3-1), which is the result from '--list-device', comma separated to flash several devices at once")
+        ->delimiter(',');
+
+    bool all_devices = false;
+    app.add_flag("--all-devices", all_devices, "Flash every connected device at the same time");
 
     enum KBurnMediumType medium_type = KBURN_MEDIUM_EMMC;
     std::map<std::string, KBurnMediumType> medium_map = {
@@ -247,6 +790,36 @@ int main(int argc, char **argv) {
     std::string write_file;
     app.add_option("-f,--file", write_file, "The path of data write to medium");
 
+    unsigned int usb_queue_depth = 4;
+    app.add_option("--usb-queue-depth", usb_queue_depth, "Number of USB transfers kept in flight while writing or reading")
+        ->check(CLI::Range(1, 64))
+        ->default_val(usb_queue_depth);
+
+    bool probe_loader_pages = false;
+    app.add_flag("--probe-loader-pages", probe_loader_pages, "Upload the loader in pages larger than 1000 bytes on chips not seen before, a loader that hangs is retried with smaller ones");
+
+    bool incremental = false;
+    app.add_flag("--incremental", incremental, "Read the target back first and only rewrite erase blocks that changed");
+
+    bool extract_kdimg = false;
+    app.add_flag("--extract-kdimg", extract_kdimg, "Extract *.kdimg parts to the part cache before writing, instead of reading them in place");
+
+    std::string kdimg_cache_dir;
+    app.add_option("--kdimg-cache-dir", kdimg_cache_dir, "Directory of the part cache used by --extract-kdimg, shared by all images and processes");
+
+    unsigned long kdimg_cache_size = KBURN_PART_CACHE_DEFAULT_SIZE / (1024 * 1024);
+    app.add_option("--kdimg-cache-size", kdimg_cache_size, "Size of the part cache in MiB, least recently used parts are dropped beyond it, 0 for no limit")
+        ->check(CLI::NonNegativeNumber)
+        ->default_val(kdimg_cache_size);
+
+    unsigned long merge_gap = 1024;
+    app.add_option("--merge-gap", merge_gap, "Write neighbouring parts in one session when the gap between them is at most this many KiB and inside the earlier part, 0 merges only adjacent parts")
+        ->check(CLI::NonNegativeNumber)
+        ->default_val(merge_gap);
+
+    bool dry_run = false;
+    app.add_flag("--dry-run", dry_run, "Print the write sessions planned for the image and exit without touching a device");
+
     // loader
     auto *loader_group = app.add_option_group("Custom Loader Options", "Options related to the custom loader");
 
@@ -297,6 +870,15 @@ int main(int argc, char **argv) {
         ->check(CLI::Number)
         ->default_str("0x00");
 
+    // emulator
+    auto *emulator_group = app.add_option_group("Emulator Options", "Flash an emulated K230 instead of a board, for tests and throughput runs");
+
+    std::string emulator_file;
+    emulator_group->add_option("--emulator", emulator_file, "Emulate a board in BROM mode whose medium is this sparse file, created when missing");
+
+    std::string emulator_options;
+    emulator_group->add_option("--emulator-options", emulator_options, "Emulated board timing and faults, key=value,... e.g. write_mibps=20,in_timeout_every=100 or instant; *_mibps bandwidths are in MiB/s");
+
     CLI11_PARSE(app, argc, argv);
 
     printf("K230 Flash Start.\n");
@@ -304,8 +886,36 @@ int main(int argc, char **argv) {
     kburn_initialize();
     spdlog_set_log_level(static_cast<int>(log_level));
 
+    if(!emulator_file.empty()) {
+        struct K230::k230_emulator_config config = K230::k230_emulator_default_config(medium_type);
+
+        config.backing_file = emulator_file;
+
+        if(!K230::k230_emulator_parse_options(emulator_options, config)) {
+            printf("Invalid --emulator-options %s\n", emulator_options.c_str());
+            goto _exit;
+        }
+
+        auto emulator = std::make_shared<K230::K230Emulator>(config);
+
+        if(!emulator->is_valid() || !kburn_add_emulated_device("emu-1", 0x29f1, 0x0230, emulator)) {
+            printf("Can not set up the emulator on %s\n", emulator_file.c_str());
+            goto _exit;
+        }
+
+        // the emulated board is the one flashed unless boards were named
+        if(device_addresses.empty() && !all_devices) {
+            device_addresses.push_back("emu-1");
+        }
+    }
+
     if(list_device) {
-        KBurnUSBDeviceList * device_list = list_usb_device_with_vid_pid();
+        auto device_list = list_usb_device_with_vid_pid();
+
+        if (!device_list) {
+            printf("Can not get usb device list.\n");
+            goto _exit;
+        }
 
         printf("Available Device: %zd\n", device_list->size());
 
@@ -330,7 +940,9 @@ int main(int argc, char **argv) {
         file_offset_max = std::filesystem::file_size(write_file);
 
         if(hasSuffixCaseInsensitive(write_file, std::string(".kdimg"))) {
-            kdimg_items = get_kdimage_items(write_file);
+            set_kdimage_cache(kdimg_cache_dir, static_cast<uint64_t>(kdimg_cache_size) * 1024 * 1024);
+
+            kdimg_items = get_kdimage_items(write_file, extract_kdimg);
 
             if(!kdimg_items) {
                 printf("Parse *.kdimg failed.\n");
@@ -344,13 +956,25 @@ int main(int argc, char **argv) {
 
                 if(item.partName == std::string("loader")) {
                     custom_loader = true;
-                    loader_file = item.fileName;
+                    loader_item = &(*it);
                     load_address = 0x80360000;
                 }
             }
         } else {
             struct KburnImageItem_t item;
 
+            // sparse images take the space of what they expand to
+            KBurnFileImageSource source(write_file);
+            if (source.is_open() && KBurnSparseImage::probe(source)) {
+                KBurnSparseImage sparse(source);
+
+                if (!sparse.is_valid()) {
+                    printf("Parse sparse image %s failed.\n", write_file.c_str());
+                    goto _exit;
+                }
+                file_offset_max = sparse.size();
+            }
+
             item.partName = std::string("image");
             item.partOffset = 0x00;
             item.partSize = file_offset_max;
@@ -362,259 +986,145 @@ int main(int argc, char **argv) {
             kdimg_items = new KburnImageItemList();
             kdimg_items->push(item);
         }
-    }
 
-    if(custom_loader) {
-        if(!fileExists(loader_file)) {
-            printf("--loader-file is required when --custom-loader is set.\n");
+        if(!plan_items(*kdimg_items, medium_type, static_cast<uint64_t>(merge_gap) * 1024, opt.plan, opt.sessions)) {
             goto _exit;
         }
-    }
-
-    dev = poll_and_open_device(device_address);
 
-    printf("use device %04X:%04X, path %s, type %s\n", dev.vid, dev.pid, dev.path, dev_type_str(dev.type));
-
-    if(KBURN_USB_DEV_BROM == dev.type) {
-        auto burner = request_burner_with_info(dev);
-        if (burner == nullptr) {
-            printf("fatal error, request brom burner failed.\n");
+        if(dry_run) {
+            print_plan(*kdimg_items, medium_type, opt.plan, opt.sessions);
             goto _exit;
         }
+    } else if(dry_run) {
+        printf("--dry-run plans writes only.\n");
+        goto _exit;
+    }
 
-        K230::K230BROMBurner *brom_burner = reinterpret_cast<K230::K230BROMBurner *>(burner);
-
-        brom_burner->register_progress_fn(progress, NULL);
-
-        brom_burner->set_medium_type(medium_type);
-
-        const char *loader_data;
-        size_t loader_size;
-
-        if(custom_loader) {
-            loader_data = readFile(loader_file, loader_size);
+    if(custom_loader) {
+        if(loader_item) {
+            // the loader that ships in the *.kdimg
+            opt.loader_data = readItem(*loader_item, opt.loader_size);
         } else {
-            brom_burner->get_loader(&loader_data, &loader_size);
-        }
-
-        if(nullptr == loader_data || 0x00 == loader_size) {
-            printf("fatal error, get loader failed.\n");
+            if(!fileExists(loader_file)) {
+                printf("--loader-file is required when --custom-loader is set.\n");
+                goto _exit;
+            }
 
-            delete brom_burner;
-            goto _exit;
+            opt.loader_data = readFile(loader_file, opt.loader_size);
         }
 
-        if(false == brom_burner->write(loader_data, loader_size, load_address)) {
-            printf("fatal error, write loader failed.\n");
-
-            delete brom_burner;
+        if(nullptr == opt.loader_data) {
             goto _exit;
         }
+    }
 
-        if(false == brom_burner->boot_from(load_address)) {
-            printf("fatal error, boot loader failed.\n");
+    if(all_devices) {
+        auto device_list = list_usb_device_with_vid_pid();
 
-            delete brom_burner;
-            goto _exit;
+        if(device_list) {
+            for (auto it = device_list->begin(); it != device_list->end(); ++it) {
+                device_addresses.push_back((*it).path);
+            }
         }
 
-        delete brom_burner;
-
-        do_sleep(1000);
-
-#ifdef __ANDROID__
-        kburn_deinitialize();
-        do_sleep(1000);
-        kburn_initialize();
-#endif
-
-        try {
-            dev = poll_and_open_device(dev.path, true);
-        } catch (const std::invalid_argument& e) {
-            printf("Error: %s\n", e.what());
-            goto _exit;
-        } catch (const std::runtime_error& e) {
-            printf("No devices found. Polling...\n");
+        if(device_addresses.empty()) {
+            printf("No devices found.\n");
             goto _exit;
         }
-
-        do_sleep(100);
-
-        printf("use device %04X:%04X, path %s, type %s.\n", dev.vid, dev.pid, dev.path, dev_type_str(dev.type));
     }
 
-    if(KBURN_USB_DEV_UBOOT == dev.type) {
-        auto burner = request_burner_with_info(dev);
-        if (burner == nullptr) {
-            printf("fatal error, request uboot burner failed.\n");
-            goto _exit;
-        }
-
-        K230::K230UBOOTBurner *uboot_burner = reinterpret_cast<K230::K230UBOOTBurner *>(burner);
-
-        uboot_burner->register_progress_fn(progress, NULL);
-
-        uboot_burner->set_medium_type(medium_type);
-
-        if(false == uboot_burner->probe()) {
-            printf("Can't probe medium as configure.\n");
-
-            delete uboot_burner;
-            goto _exit;
-        }
-
-        struct K230::kburn_medium_info *medium_info = uboot_burner->get_medium_info();
-
-        if (read_data) {
-            // Ensure the read size is within the medium's capacity
-            if (read_data_size > medium_info->capacity) {
-                printf("The requested data size exceeds the capacity of the medium.\n");
-                delete uboot_burner;
-                goto _exit;
-            }
-
-            // TODO: read data with chunk buffer.
-            // Allocate buffer for reading data
-            std::vector<uint8_t> file_data;
-
-            printf("Reading %lu bytes from 0x%08lX and saving to %s.\n", read_data_size, read_data_address, read_data_file.c_str());
-
-            file_data.resize(read_data_size, 0);
-
-            // Perform the read operation
-            if (!uboot_burner->read(file_data.data(), read_data_size, read_data_address)) {
-                printf("Failed to read %lu bytes from 0x%08lX.\n", read_data_size, read_data_address);
-
-                delete uboot_burner;
-                goto _exit;
-            }
-
-            // Save the read data to the specified file
-            FILE *file = fopen(read_data_file.c_str(), "wb");
-            if (file == NULL) {
-                printf("Failed to open file %s for writing.\n", read_data_file.c_str());
-                delete uboot_burner;
-                goto _exit;
-            }
-
-            size_t written_size = fwrite(file_data.data(), 1, read_data_size, file);
-            if (written_size != read_data_size) {
-                printf("Error: Failed to write all data to %s. Written %zu bytes.\n", read_data_file.c_str(), written_size);
-                fclose(file);
-                delete uboot_burner;
-                goto _exit;
-            }
-
-            // Successfully saved the data
-            printf("Successfully read and saved %lu bytes to %s.\n", read_data_size, read_data_file.c_str());
-
-            // Clean up resources
-            fclose(file);
-        } else if(erase_medium) {
-            if(0x00 != erase_medium_size) {
-                printf("Erase 0x%08lX to 0x%08lX start.\n", erase_medium_address, erase_medium_address + erase_medium_size);
-
-                // Get the start time point
-                auto start = std::chrono::high_resolution_clock::now();
+    // without a device list the first device that shows up is used
+    if(device_addresses.empty()) {
+        device_addresses.push_back("");
+    }
 
-                if(false == uboot_burner->erase(erase_medium_address, erase_medium_size)) {
-                    printf("Erase 0x%08lX to 0x%08lX failed.\n", erase_medium_address, erase_medium_address + erase_medium_size);
+    if((device_addresses.size() > 1) && read_data) {
+        printf("--read-data works on a single device.\n");
+        goto _exit;
+    }
 
-                    delete uboot_burner;
-                    goto _exit;
+    opt.medium_type = medium_type;
+    opt.custom_loader = custom_loader;
+    opt.load_address = load_address;
+    opt.usb_queue_depth = usb_queue_depth;
+    opt.probe_loader_pages = probe_loader_pages;
+    opt.incremental = incremental;
+    opt.auto_reboot = auto_reboot;
+    opt.read_data = read_data;
+    opt.read_data_address = read_data_address;
+    opt.read_data_size = read_data_size;
+    opt.read_data_file = read_data_file;
+    opt.erase_medium = erase_medium;
+    opt.erase_medium_address = erase_medium_address;
+    opt.erase_medium_size = erase_medium_size;
+    opt.file_offset_max = file_offset_max;
+    opt.items = kdimg_items;
+
+    opt.multi_device = device_addresses.size() > 1;
+
+    {
+        bool multi_device = opt.multi_device;
+        ProgressBoard board(multi_device);
+        std::vector<struct flash_report> reports(device_addresses.size());
+        std::vector<std::thread> workers;
+
+        // every device runs the whole flow on its own worker, sharing the parsed image
+        for (size_t i = 0; i < device_addresses.size(); i++) {
+            size_t line = board.add(device_addresses[i].empty() ? std::string("auto") : device_addresses[i]);
+
+            reports[i].path = device_addresses[i];
+
+            auto worker = [&, i, line]() {
+                auto start = steady_clock::now();
+
+                FlashSession session;
+
+                reports[i].ok = run_device(device_addresses[i], opt, board, line, reports[i], session);
+                reports[i].elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+
+                if(!reports[i].ok) {
+                    board.print(line, "fatal error in %s, %s.", FlashSession::state_name(session.state()), reports[i].error.c_str());
                 }
-                // Get the end time point
-                auto end = std::chrono::high_resolution_clock::now();
 
-                // Calculate the duration
-                std::chrono::duration<double> elapsed = end - start;
+                // closes the timing of the state it stopped in
+                session.enter(FLASH_STATE_DONE);
+                reports[i].timings = session.timings();
+                board.print(line, "Time spent: %s.", reports[i].timings.c_str());
+            };
 
-                printf("Erase 0x%08lX to 0x%08lX done, use %.2f sec.\n", erase_medium_address, erase_medium_address + erase_medium_size, elapsed.count());
+            if(multi_device) {
+                workers.emplace_back(worker);
             } else {
-                printf("Erase size is 0.\n");
-            }
-        }else {
-            if(file_offset_max > medium_info->capacity) {
-                printf("Files exceed the capacity of meidum.\n");
-
-                delete uboot_burner;
-                goto _exit;
+                worker();
             }
+        }
 
-            for (auto it = kdimg_items->begin(); it != kdimg_items->end(); ++it) {
-                const struct KburnImageItem_t item = *it;
-
-                std::ifstream file(item.fileName, std::ios::binary);
-                if (!file.is_open()) {
-                    printf("Failed to open %s\n", item.fileName.c_str());
-                    delete uboot_burner;
-                    goto _exit;
-                }
-
-                file.seekg(0, std::ios::end);
-                size_t file_size = static_cast<size_t>(file.tellg());
-                file.seekg(0, std::ios::beg);
-
-                printf("Write %s to 0x%08lX, Size: %zd.\n", item.fileName.c_str(), item.partOffset, file_size);
-
-                if (false == uboot_burner->write_stream(file, file_size, item.partOffset, item.partSize, item.partFlag)) {
-                    printf("Write %s to 0x%08lX failed.\n", item.fileName.c_str(), item.partOffset);
-                    delete uboot_burner;
-                    goto _exit;
-                }
-                file.close();
-
-                // Erase remaining space if partEraseSize is specified
-                if (item.partEraseSize > 0) {
-                    uint64_t _medium_erase_size = medium_info->erase_size;
-                    if (_medium_erase_size == 0) {
-                        printf("Error: Unable to get medium erase size.\n");
-                        goto _exit;
-                    }
-
-                    // Calculate the remaining space to erase
-                    uint64_t _erase_start = item.partOffset + file_size;
-                    uint64_t _erase_end = item.partOffset + item.partEraseSize;
-
-                    // Align erase start to medium erase size (round up)
-                    if (_erase_start % _medium_erase_size != 0) {
-                        _erase_start = ((_erase_start + _medium_erase_size - 1) / _medium_erase_size) * _medium_erase_size;
-                    }
-
-                    // Align erase end to medium erase size (round down)
-                    if (_erase_end % _medium_erase_size != 0) {
-                        _erase_end = (_erase_end / _medium_erase_size) * _medium_erase_size;
-                    }
-
-                    // Calculate the erase size
-                    uint64_t _erase_size = (_erase_end > _erase_start) ? (_erase_end - _erase_start) : 0;
+        for (auto &worker : workers) {
+            worker.join();
+        }
 
-                    if (_erase_size > 0) {
-                        printf("Erasing remaining space from 0x%08lX to 0x%08lX, Size: %lu.\n", _erase_start, _erase_end, _erase_size);
+        if(multi_device) {
+            size_t passed = 0;
 
-                        if (uboot_burner->erase(_erase_start, _erase_size)) {
-                            printf("Erase successful.\n");
-                        } else {
-                            printf("Erase failed.\n");
-                            goto _exit;
-                        }
-                    } else {
-                        printf("No remaining space to erase.\n");
-                    }
-                }
+            printf("\nSummary:\n");
+            for (const auto &report : reports) {
+                printf("\t%-8s %s  %.2f sec  %s\n", report.path.c_str(), report.ok ? "PASS" : "FAIL", report.elapsed, report.error.c_str());
+                passed += report.ok ? 1 : 0;
             }
+            printf("%zu of %zu devices passed.\n", passed, reports.size());
         }
 
-        if(auto_reboot) {
-            printf("Auto reset board after write.\n");
-            uboot_burner->reboot();
+        // scripts and production lines go by the exit code, a single failed device fails the run
+        for (const auto &report : reports) {
+            if(!report.ok) {
+                exit_code = 1;
+            }
         }
-
-        delete uboot_burner;
     }
 
 _exit:
+    kburn_remove_emulated_devices();
     kburn_deinitialize();
 
-    return 0;
+    return exit_code;
 }
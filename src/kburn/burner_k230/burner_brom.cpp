@@ -1,11 +1,23 @@
 #include "k230/kburn_k230.h"
-
+#include "decompress_source.h"
+#include "part_cache.h"
+#include "usb_async.h"
+#include "usb_transport.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <mutex>
 
 extern "C" {
-  #include <generated.k230_loader_mmc.h>
-  #include <generated.k230_loader_spi_nand.h>
-  #include <generated.k230_loader_spi_nor.h>
+  /* k230_loaders.S, generated from loader/loaders.S.in */
+  extern const char k230_loaders[];
+  extern const size_t k230_loaders_size;
 }
 
 namespace Kendryte_Burning_Tool {
@@ -17,67 +29,147 @@ bool K230BROMBurner::boot_from(uint64_t address) {
 
   uint32_t addr = static_cast<uint32_t>(address);
 
-  int r = libusb_control_transfer(/* dev_handle    */   dev_node->handle,
-                                    /* bmRequestType */ (uint8_t)(LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE),
-                                    /* bRequest      */ EP0_PROG_START,
-                                    /* wValue        */ U32_HIGH_U16(addr),
-                                    /* wIndex        */ U32_LOW_U16(addr),
-                                    /* Data          */ 0,
-                                    /* wLength       */ 0,
-                                    /* timeout       */ USB_TIMEOUT);
+  int r = kburn_usb_control_transfer(/* node          */ dev_node,
+                                     /* bmRequestType */ (uint8_t)(LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE),
+                                     /* bRequest      */ EP0_PROG_START,
+                                     /* wValue        */ U32_HIGH_U16(addr),
+                                     /* wIndex        */ U32_LOW_U16(addr),
+                                     /* Data          */ 0,
+                                     /* wLength       */ 0,
+                                     /* timeout       */ USB_TIMEOUT);
 
   if(LIBUSB_SUCCESS != r) {
     spdlog::error("usb control boot from address failed, {}({})", r, libusb_error_name(r));
 
+    // a bus error says nothing about the page size, only a loader that does not answer does
     return false;
   }
 
   return true;
 }
 
+#define K230_LOADER_TAR_BLOCK   (512)
+
+/* the member of the embedded tar named `name`, decompressed on the way when it is compressed */
+static bool k230_unpack_loader(const char *name, std::vector<char> &loader) {
+  KBurnMemoryImageSource blob(k230_loaders, k230_loaders_size);
+
+#if defined(KBURN_LOADERS_COMPRESSED)
+  KBurnDecompressSource archive(blob, KBURN_COMPRESSION_ZSTD, UINT64_MAX);
+#else
+  KBurnImageSource &archive = blob;
+#endif
+
+  uint8_t header[K230_LOADER_TAR_BLOCK];
+  uint64_t offset = 0;
+
+  // members are walked in order, the ones in front are decoded and dropped
+  while (sizeof(header) == archive.read(offset, header, sizeof(header))) {
+    char member[101] = {}, size_field[13] = {};
+
+    memcpy(member, &header[0], 100);
+    memcpy(size_field, &header[124], 12);
+
+    if (0x00 == member[0]) {
+      break;
+    }
+
+    uint64_t member_size = strtoull(size_field, nullptr, 8);
+    char type = static_cast<char>(header[156]);
+
+    offset += sizeof(header);
+
+    if ((('0' == type) || (0x00 == type)) && (0x00 == strcmp(member, name))) {
+      loader.resize(static_cast<size_t>(member_size));
+
+      if (loader.size() != archive.read(offset, loader.data(), loader.size())) {
+        spdlog::error("loader {} is truncated", name);
+        loader.clear();
+      }
+
+      return !loader.empty();
+    }
+
+    offset += (member_size + K230_LOADER_TAR_BLOCK - 1) / K230_LOADER_TAR_BLOCK * K230_LOADER_TAR_BLOCK;
+  }
+
+  spdlog::error("loader {} is not built in", name);
+
+  return false;
+}
+
 bool K230BROMBurner::get_loader(const char **loader, size_t *size) {
-  size_t loader_size = 0;
-  const char *loader_buffer = NULL;
+  struct builtin_loader {
+    const char *name;
+    std::once_flag once;
+    std::vector<char> data;
+  };
+
+  // only the loader of the medium in use is ever unpacked, once per process
+  static struct builtin_loader loaders[] = {
+    {"loader_mmc.bin", {}, {}},
+    {"loader_spi_nand.bin", {}, {}},
+    {"loader_spi_nor.bin", {}, {}},
+  };
+
+  struct builtin_loader *selected = NULL;
 
   switch(_medium_type) {
     case KBURN_MEDIUM_EMMC:
     case KBURN_MEDIUM_SDCARD: {
-      loader_buffer = k230_loader_mmc;
-      loader_size = k230_loader_mmc_size;
+      selected = &loaders[0];
     } break;
     case KBURN_MEDIUM_SPI_NAND: {
-      loader_buffer = k230_loader_spi_nand;
-      loader_size = k230_loader_spi_nand_size;
+      selected = &loaders[1];
     } break;
     case KBURN_MEDIUM_OTP:
     case KBURN_MEDIUM_SPI_NOR: {
-      loader_buffer = k230_loader_spi_nor;
-      loader_size = k230_loader_spi_nor_size;
+      selected = &loaders[2];
     } break;
     case KBURN_MEDIUM_INVAILD: {
-      loader_buffer = NULL;
-      loader_size = 0;
+      selected = NULL;
     } break;
   }
 
-  *loader = loader_buffer;
-  *size = loader_size;
+  *loader = NULL;
+  *size = 0;
+
+  if (NULL == selected) {
+    return false;
+  }
+
+  std::call_once(selected->once, [selected]() {
+    auto start = std::chrono::steady_clock::now();
+
+    if (k230_unpack_loader(selected->name, selected->data)) {
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+      spdlog::debug("unpacked {}, {} bytes in {:.3f} sec", selected->name, selected->data.size(), elapsed.count());
+    }
+  });
+
+  if (selected->data.empty()) {
+    return false;
+  }
+
+  *loader = selected->data.data();
+  *size = selected->data.size();
 
-  return 0x00 != loader_size;
+  return true;
 }
 
 bool K230BROMBurner::k230_brom_set_data_addr(uint64_t address)
 {
   uint32_t addr = static_cast<uint32_t>(address);
 
-  int r = libusb_control_transfer(/* dev_handle    */ dev_node->handle,
-                                  /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-                                  /* bRequest      */ EP0_SET_DATA_ADDRESS,
-                                  /* wValue        */ U32_HIGH_U16(addr),
-                                  /* wIndex        */ U32_LOW_U16(addr),
-                                  /* Data          */ 0,
-                                  /* wLength       */ 0,
-                                  /* timeout       */ USB_TIMEOUT);
+  int r = kburn_usb_control_transfer(/* node          */ dev_node,
+                                     /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+                                     /* bRequest      */ EP0_SET_DATA_ADDRESS,
+                                     /* wValue        */ U32_HIGH_U16(addr),
+                                     /* wIndex        */ U32_LOW_U16(addr),
+                                     /* Data          */ 0,
+                                     /* wLength       */ 0,
+                                     /* timeout       */ USB_TIMEOUT);
 
   if(LIBUSB_SUCCESS != r) {
     spdlog::error("usb control set data address failed, {}({})", r, libusb_error_name(r));
@@ -88,69 +180,394 @@ bool K230BROMBurner::k230_brom_set_data_addr(uint64_t address)
   return true;
 }
 
-bool K230BROMBurner::k230_brom_write_data_chunk(const uint8_t *data, size_t size)
-{
-  int r, transferred_size, completed_transfer_size;
+/*
+ * Page sizes tried for the loader upload, largest first. Every page ends in a
+ * short packet, that is how the BootROM tells the pages apart, so none is a
+ * multiple of the 512 byte max packet size. 1000 is what every revision takes.
+ */
+static const size_t k230_brom_page_sizes[] = {63000, 31000, 15000, 7000, 3000, 1000};
+
+#define K230_BROM_SAFE_PAGE_SIZE    (1000)
+
+#define K230_BROM_MAX_PACKET_SIZE   (512)
+#define K230_BROM_QUEUE_DEPTH       (4)
+
+namespace {
+
+/*
+ * The largest page each chip revision took, so only the first board of a
+ * revision pays for the probe. Kept for the process and in a file next to the
+ * part cache for the processes after it.
+ */
+class brom_page_table {
+public:
+  static brom_page_table &get() {
+    static brom_page_table table;
+    return table;
+  }
 
-  transferred_size = static_cast<int>(size);
+  size_t lookup(const std::string &key) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = pages_.find(key);
 
-  r = libusb_bulk_transfer(/* dev_handle       */  dev_node->handle,
-                            /* endpoint         */ KENDRYTE_OUT_ENDPOINT,
-                            /* bulk data        */ const_cast<uint8_t *>(data),
-                            /* bulk data length */ transferred_size,
-                            /* transferred      */ &completed_transfer_size,
-                            /* timeout          */ USB_TIMEOUT);
+    return (it == pages_.end()) ? 0 : it->second;
+  }
 
-  if((LIBUSB_SUCCESS != r) || (completed_transfer_size != transferred_size)) {
-    spdlog::error("usb bulk write data failed, {}({}), or {} != {}", \
-      r, libusb_error_name(r), completed_transfer_size, transferred_size);
+  void remember(const std::string &key, size_t page_size) {
+    std::lock_guard<std::mutex> guard(lock_);
 
-    return false;
+    if (pages_[key] == page_size) {
+      return;
+    }
+    pages_[key] = page_size;
+
+    save_locked();
   }
 
-  return true;
-}
+  // an empty `dir` is the default, next to the part cache
+  void set_dir(const std::string &dir) {
+    std::lock_guard<std::mutex> guard(lock_);
 
-bool K230BROMBurner::write(const void *data, size_t size, uint64_t address) {
-#define K230_SRAM_PAGE_SIZE         (1000)
+    path_ = (dir.empty() ? KBurnPartCache::default_dir() : std::filesystem::path(dir)) / "k230_brom_pages";
+    load_locked();
+  }
 
-  uint32_t chunk_addr, chunk_size = K230_SRAM_PAGE_SIZE;
-  uint8_t chunk_data[K230_SRAM_PAGE_SIZE];
+private:
+  std::mutex lock_;
+  std::map<std::string, size_t> pages_;
+  std::filesystem::path path_;
 
-  const uint8_t *buffer = static_cast<const uint8_t *>(data);
-  const uint32_t pages = (size + K230_SRAM_PAGE_SIZE - 1) / K230_SRAM_PAGE_SIZE;
+  brom_page_table() : path_(KBurnPartCache::default_dir() / "k230_brom_pages") {
+    load_locked();
+  }
+
+  void load_locked(void) {
+    std::ifstream in(path_);
+    std::string key;
+    size_t page_size;
+
+    pages_.clear();
+
+    while (in >> key >> page_size) {
+      pages_[key] = page_size;
+    }
+  }
+
+  void save_locked(void) {
+    std::error_code ec;
+    std::filesystem::path temp = KBurnPartCache::private_path(path_);
 
-  spdlog::info("write {} to {:#x}, size {}", data, address, size);
+    std::filesystem::create_directories(path_.parent_path(), ec);
+
+    {
+      std::ofstream out(temp);
+
+      for (const auto &page : pages_) {
+        out << page.first << " " << page.second << "\n";
+      }
+      if (out.fail()) {
+        spdlog::debug("brom page table, can not write {}", temp.string());
+        return;
+      }
+    }
+
+    std::filesystem::rename(temp, path_, ec);
+    if (ec) {
+      std::filesystem::remove(temp, ec);
+    }
+  }
+};
+
+}; // namespace
+
+/* chip info plus bcdDevice, what tells BootROM revisions apart */
+std::string K230BROMBurner::chip_key(void) {
+  uint16_t bcd_device;
+  char info[33] = {};
+  int size = k230_get_chip_info(dev_node, info);
+
+  if (0 > size) {
+    return std::string();
+  }
+
+  std::string key(info, static_cast<size_t>(size));
+
+  for (auto &c : key) {
+    if (!isalnum(static_cast<unsigned char>(c))) {
+      c = '_';
+    }
+  }
+
+  if (kburn_usb_bcd_device(dev_node, bcd_device)) {
+    char revision[8];
+
+    snprintf(revision, sizeof(revision), "-%04x", bcd_device);
+    key += revision;
+  }
+
+  return key;
+}
+
+/*
+ * The loader straight from the caller's buffer, `page_size` bytes per
+ * transfer with several queued. The first page goes out alone, so a BootROM
+ * that does not take pages this large is found out early; any page failing
+ * sends the caller to a smaller size.
+ */
+enum K230BROMBurner::upload_result K230BROMBurner::upload(const uint8_t *data, size_t size, uint64_t address,
+                                                          size_t page_size) {
+  std::unique_ptr<KBurnBulkPipe> pipe = kburn_usb_bulk_pipe(dev_node);
+  KBurnBulkOutQueue queue(pipe.get(), KENDRYTE_OUT_ENDPOINT, K230_BROM_MAX_PACKET_SIZE, K230_BROM_QUEUE_DEPTH, USB_TIMEOUT,
+                          false);
 
   if (false == k230_brom_set_data_addr(address)) {
-    return false;
+    return UPLOAD_FAILED;
   }
 
-  for (uint32_t page = 0; page < pages; page++) {
-    uint32_t offset = page * K230_SRAM_PAGE_SIZE;
+  size_t offset = 0;
+
+  log_progress(0, size);
+
+  while (offset < size) {
+    size_t length = std::min(page_size, size - offset);
+
+    // a last page of whole packets would not end the transfer, its final byte goes on its own
+    if ((0x00 == (length % K230_BROM_MAX_PACKET_SIZE)) && (1 < length)) {
+      length -= 1;
+    }
 
-    chunk_addr = static_cast<uint32_t>(address) + offset;
+    if (false == queue.submit(data + offset, length, offset)) {
+      break;
+    }
+    offset += length;
 
-    if (offset + K230_SRAM_PAGE_SIZE > size) {
-      chunk_size = size % K230_SRAM_PAGE_SIZE;
-    } else {
-      chunk_size = K230_SRAM_PAGE_SIZE;
+    if ((1 == queue.submitted_chunks()) && (false == queue.wait_completed(1))) {
+      break;
     }
 
-    memcpy(chunk_data, buffer + offset, chunk_size);
+    log_progress(queue.completed_bytes(), size);
+  }
+
+  if (!queue.failed() && queue.drain()) {
+    log_progress(size, size);
+    return UPLOAD_OK;
+  }
+
+  bool gone = (LIBUSB_ERROR_NO_DEVICE == queue.failed_result());
 
-    if (false == k230_brom_write_data_chunk(chunk_data, chunk_size)) {
+  queue.abort();
+  kburn_usb_clear_halt(dev_node, KENDRYTE_OUT_ENDPOINT);
+
+  spdlog::error("brom upload with {} byte pages failed @ {}, {}({})", page_size, queue.failed_tag(),
+                queue.failed_result(), libusb_error_name(queue.failed_result()));
+
+  return gone ? UPLOAD_FAILED : UPLOAD_PAGE_REJECTED;
+}
+
+bool K230BROMBurner::write(const void *data, size_t size, uint64_t address) {
+  const uint8_t *buffer = static_cast<const uint8_t *>(data);
+  brom_page_table &table = brom_page_table::get();
+
+  std::string key = chip_key();
+  size_t known = key.empty() ? 0 : table.lookup(key);
+
+  // a chip not seen before may take large pages on the bus and still hang, it gets them only when asked to
+  bool probing = (0x00 != known) || (page_probe_ && !key.empty());
+  size_t start = known ? known : (probing ? k230_brom_page_sizes[0] : K230_BROM_SAFE_PAGE_SIZE);
+
+  spdlog::info("write {} to {:#x}, size {}, chip {}, known page size {}", data, address, size, key, known);
+
+  upload_ = upload_info();
+
+  for (size_t page_size : k230_brom_page_sizes) {
+    // what worked on this revision before is where the search starts
+    if (page_size > start) {
+      continue;
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+    enum upload_result result = upload(buffer, size, address, page_size);
+
+    if (UPLOAD_OK == result) {
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+      spdlog::info("brom upload, {} bytes in {} byte pages, {:.3f} sec", size, page_size, elapsed.count());
+
+      // kept only once the loader answers, see confirm_upload(); the safe size without a probe says nothing
+      upload_.chip_key = probing ? key : std::string();
+      upload_.page_size = page_size;
+      return true;
+    }
+
+    if (UPLOAD_FAILED == result) {
       return false;
     }
 
-    log_progress(offset, size);
+    // a size that failed is not where the next board of this revision starts
+    if (probing && next_page_size(page_size)) {
+      table.remember(key, next_page_size(page_size));
+    }
   }
 
-  log_progress(size, size);
+  return false;
+}
+
+size_t K230BROMBurner::next_page_size(size_t page_size) {
+  for (size_t smaller : k230_brom_page_sizes) {
+    if (smaller < page_size) {
+      return smaller;
+    }
+  }
+
+  return 0;
+}
+
+void K230BROMBurner::set_page_table_dir(const std::string &dir) {
+  brom_page_table::get().set_dir(dir);
+}
+
+void K230BROMBurner::confirm_upload(const struct upload_info &upload, bool loader_answered) {
+  brom_page_table &table = brom_page_table::get();
+
+  if (upload.chip_key.empty() || (0x00 == upload.page_size)) {
+    return;
+  }
+
+  // a revision may take large pages on the bus and still store them wrong, what did not boot is its ceiling
+  if (loader_answered) {
+    table.remember(upload.chip_key, upload.page_size);
+  } else if (next_page_size(upload.page_size)) {
+    table.remember(upload.chip_key, next_page_size(upload.page_size));
+  }
+}
+
+static void report_step(const struct K230BROMBurner::boot_options &options, enum K230BROMBurner::boot_step step,
+                        const struct kburn_usb_dev_info &dev) {
+  if (options.step_fn) {
+    options.step_fn(options.ctx, step, dev);
+  }
+}
+
+/* one upload and boot, the loader's device in `dev` once it is up */
+static bool upload_and_boot(struct kburn_usb_dev_info &dev, const struct K230BROMBurner::boot_options &options,
+                            struct K230BROMBurner::upload_info &upload, std::string &error) {
+  report_step(options, K230BROMBurner::BOOT_STEP_UPLOAD, dev);
+
+  std::unique_ptr<K230BROMBurner> brom(reinterpret_cast<K230BROMBurner *>(request_burner_with_info(dev)));
+  if (nullptr == brom) {
+    error = "request brom burner failed";
+    return false;
+  }
+
+  if (options.progress_fn) {
+    brom->register_progress_fn(options.progress_fn, options.ctx);
+  }
+  brom->set_medium_type(options.medium_type);
+  brom->set_page_probe(options.page_probe);
+
+  const char *loader = options.loader;
+  size_t loader_size = options.loader_size;
+
+  if (nullptr == loader) {
+    brom->get_loader(&loader, &loader_size);
+  }
+
+  if ((nullptr == loader) || (0x00 == loader_size)) {
+    error = "get loader failed";
+    return false;
+  }
+
+  if (false == brom->write(loader, loader_size, options.address)) {
+    error = "write loader failed";
+    return false;
+  }
+
+  report_step(options, K230BROMBurner::BOOT_STEP_BOOT, dev);
+
+  if (false == brom->boot_from(options.address)) {
+    error = "boot loader failed";
+    return false;
+  }
+
+  upload = brom->get_upload_info();
+  brom.reset();
+
+  report_step(options, K230BROMBurner::BOOT_STEP_REENUMERATE, dev);
+
+  // the loader comes back on the same port; the BROM device stays known as such until it is gone
+  if (!wait_usb_device_with_vid_pid(dev, dev.path, KBURN_USB_DEV_UBOOT, options.reenumerate_timeout_ms)) {
+    error = "the loader did not come up";
+    return false;
+  }
 
   return true;
 }
 
+std::unique_ptr<K230UBOOTBurner> K230BROMBurner::boot_loader(struct kburn_usb_dev_info &dev,
+                                                             const struct boot_options &options, std::string &error,
+                                                             struct upload_info *loaded) {
+  // the page size of the last upload, what a retry has to go below
+  struct upload_info upload;
+
+  for (;;) {
+    std::unique_ptr<K230UBOOTBurner> uboot;
+    bool uploaded = false;
+
+    error.clear();
+
+    if (KBURN_USB_DEV_BROM == dev.type) {
+      struct upload_info attempt;
+
+      // nothing that went up in smaller pages would get past a failure before the boot
+      if ((false == upload_and_boot(dev, options, attempt, error)) && (0x00 == attempt.page_size)) {
+        return nullptr;
+      }
+
+      upload = attempt;
+      uploaded = true;
+    } else if (KBURN_USB_DEV_UBOOT != dev.type) {
+      error = "device is not in loader mode";
+      return nullptr;
+    }
+
+    if (error.empty()) {
+      report_step(options, BOOT_STEP_LOADER_READY, dev);
+
+      uboot.reset(reinterpret_cast<K230UBOOTBurner *>(request_burner_with_info(dev)));
+      if (nullptr == uboot) {
+        error = "request uboot burner failed";
+      } else if (!uboot->is_ready()) {
+        error = "the loader does not answer";
+        uboot.reset();
+      }
+    }
+
+    if (uploaded) {
+      confirm_upload(upload, error.empty());
+    }
+
+    if (error.empty()) {
+      if (nullptr != loaded) {
+        *loaded = upload;
+      }
+      return uboot;
+    }
+
+    if (0x00 == next_page_size(upload.page_size)) {
+      return nullptr;
+    }
+
+    spdlog::warn("{}, retry with loader pages below {} bytes", error, upload.page_size);
+    report_step(options, BOOT_STEP_RETRY, dev);
+
+    // the chip resets into the BootROM once the loader hung, a loader still on the bus is not what is waited for
+    if (!wait_usb_device_with_vid_pid(dev, dev.path, KBURN_USB_DEV_BROM, options.reenumerate_timeout_ms)) {
+      error += ", and the board did not come back";
+      return nullptr;
+    }
+  }
+}
+
 } // namespace K230
 
 }; // namespace Kendryte_Burning_Tool
@@ -1,57 +1,30 @@
 #include "k230/kburn_k230.h"
+#include "kburn_protocol.h"
+#include "read_ahead.h"
+#include "usb_async.h"
+#include "usb_transport.h"
+
+#include <algorithm>
+#include <chrono>
 #include <memory>
+#include <mutex>
 
 namespace Kendryte_Burning_Tool {
 
 namespace K230 {
 
-#define CMD_FLAG_DEV_TO_HOST (0x8000)
-
-enum kburn_pkt_cmd {
-  KBURN_CMD_NONE = 0,
-  KBURN_CMD_REBOOT = 0x01,
-
-  KBURN_CMD_DEV_PROBE = 0x10,
-  KBURN_CMD_DEV_GET_INFO = 0x11,
-
-	KBURN_CMD_ERASE_LBA = 0x20,
-
-	KBURN_CMD_WRITE_LBA = 0x21,
-	KBURN_CMD_WRITE_LBA_CHUNK = 0x22,
-
-	KBURN_CMD_READ_LBA = 0x23,
-	KBURN_CMD_READ_LBA_CHUNK = 0x24,
-
-  KBURN_CMD_MAX,
-};
-
-enum kburn_pkt_result {
-  KBURN_RESULT_NONE = 0,
-
-  KBURN_RESULT_OK = 1,
-  KBURN_RESULT_ERROR = 2,
+/* holes between written ranges shorter than this are written anyway, a new session costs more */
+#define KBURN_WRITE_MERGE_GAP (1 * 1024 * 1024)
 
-  KBURN_RESULT_ERROR_MSG = 0xFF,
+/* how often a long command is looked at while the device works on it */
+#define KBURN_POLL_INTERVAL_MIN_MS (20)
+#define KBURN_POLL_INTERVAL_MAX_MS (500)
 
-  KBURN_RESULT_MAX,
-};
-
-#define KBUNR_USB_PKT_SIZE (60)
-
-#pragma pack(push, 1)
-
-struct kburn_usb_pkt {
-  uint16_t cmd;
-  uint16_t result; /* only valid in csw */
-  uint16_t data_size;
-};
+/* a loader that just enumerated has this long to answer its first command */
+#define KBURN_LOADER_READY_TIMEOUT_MS (3000)
 
-struct kburn_usb_pkt_wrap {
-  struct kburn_usb_pkt hdr;
-  uint8_t data[KBUNR_USB_PKT_SIZE - sizeof(struct kburn_usb_pkt)];
-};
-
-#pragma pack(pop)
+/* an erase fails once it takes this much longer than the slowest expected medium */
+#define KBURN_ERASE_DEADLINE_SLACK_MS (30 * 1000)
 
 uint64_t round_down(uint64_t value, uint64_t multiple) {
     return value - (value % multiple);
@@ -70,6 +43,12 @@ static int __get_endpoint(kburn_t *kburn) {
   struct libusb_device *udev;
   uint8_t trans, dir;
 
+  if (kburn->node->transport) {
+    kburn->node->transport->bulk_endpoints(kburn->ep_in, kburn->ep_in_mps, kburn->ep_out, kburn->ep_out_mps);
+
+    return LIBUSB_SUCCESS;
+  }
+
   udev = libusb_get_device(kburn->node->handle);
 
   if (LIBUSB_SUCCESS != (ret = libusb_get_active_config_descriptor(udev, &config))) {
@@ -93,6 +72,7 @@ static int __get_endpoint(kburn_t *kburn) {
         dir = (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK);
         if (dir == LIBUSB_ENDPOINT_IN) {
           kburn->ep_in = ep->bEndpointAddress;
+          kburn->ep_in_mps = ep->wMaxPacketSize;
         } else {
           kburn->ep_out = ep->bEndpointAddress;
           kburn->ep_out_mps = ep->wMaxPacketSize;
@@ -111,8 +91,8 @@ static int kburn_probe_loader_version(kburn_t *kburn)
   int rc = -1;
   uint32_t version = 0;
 
-  rc = libusb_control_transfer(
-    /* dev_handle    */ kburn->node->handle,
+  rc = kburn_usb_control_transfer(
+    /* node          */ kburn->node,
     /* bmRequestType */ (uint8_t)(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE),
     /* bRequest      */ 0,
     /* wValue        */ (uint16_t)(0x0001),
@@ -131,20 +111,29 @@ static int kburn_probe_loader_version(kburn_t *kburn)
   return version;
 }
 
-static bool kburn_write_data(kburn_t *kburn, void *data, int length) {
+static bool kburn_write_data_timeout(kburn_t *kburn, void *data, int length,
+                                     unsigned int timeout_ms, int *is_timeout) {
   int rc = -1, size = 0;
 
   // if(length <= 64) {
   //     print_buffer(KBURN_LOG_ERROR, "usb write", data, length);
   // }
 
-  rc = libusb_bulk_transfer(
-      /* dev_handle       */ kburn->node->handle,
+  rc = kburn_usb_bulk_transfer(
+      /* node             */ kburn->node,
       /* endpoint         */ kburn->ep_out,
       /* bulk data        */ reinterpret_cast<uint8_t *>(data),
       /* bulk data length */ length,
       /* transferred      */ &size,
-      /* timeout          */ kburn->medium_info.timeout_ms);
+      /* timeout          */ timeout_ms);
+
+  if (is_timeout && (LIBUSB_ERROR_TIMEOUT == rc) && (0x00 == size)) {
+    *is_timeout = rc;
+
+    spdlog::trace("usb bulk write data, not taken in {} ms", timeout_ms);
+
+    return false;
+  }
 
   if ((rc != LIBUSB_SUCCESS) || (size != length)) {
     spdlog::error("usb bulk write data failed, {}({}), or {} != {}", rc,
@@ -154,7 +143,7 @@ static bool kburn_write_data(kburn_t *kburn, void *data, int length) {
   }
 
   if(0x00 == (length % kburn->ep_out_mps)) {
-    if(LIBUSB_SUCCESS != (rc = libusb_bulk_transfer(kburn->node->handle, kburn->ep_out, reinterpret_cast<uint8_t *>(data), 0, &size, kburn->medium_info.timeout_ms))) {
+    if(LIBUSB_SUCCESS != (rc = kburn_usb_bulk_transfer(kburn->node, kburn->ep_out, reinterpret_cast<uint8_t *>(data), 0, &size, timeout_ms))) {
       spdlog::error("usb bulk write ZLP failed, {}({})", rc, libusb_error_name(rc));
       return false;
     }
@@ -163,29 +152,53 @@ static bool kburn_write_data(kburn_t *kburn, void *data, int length) {
   return true;
 }
 
-static bool kburn_read_data(kburn_t *kburn, void *data, int length,
-                            int *is_timeout) {
-  int rc = -1, size = 0;
+static bool kburn_write_data(kburn_t *kburn, void *data, int length) {
+  return kburn_write_data_timeout(kburn, data, length, kburn->medium_info.timeout_ms, NULL);
+}
+
+static bool kburn_read_data_timeout(kburn_t *kburn, void *data, int length,
+                                    unsigned int timeout_ms, int *is_timeout) {
+  int rc = -1, size = 0, received = 0;
 
   if(NULL == data) {
       spdlog::error("invalid buffer");
   }
 
-  rc = libusb_bulk_transfer(
-      /* dev_handle       */ kburn->node->handle,
-      /* endpoint         */ kburn->ep_in,
-      /* bulk data        */ reinterpret_cast<uint8_t *>(data),
-      /* bulk data length */ length,
-      /* transferred      */ &size,
-      /* timeout          */ kburn->medium_info.timeout_ms);
+  for (;;) {
+    rc = kburn_usb_bulk_transfer(
+        /* node             */ kburn->node,
+        /* endpoint         */ kburn->ep_in,
+        /* bulk data        */ reinterpret_cast<uint8_t *>(data) + received,
+        /* bulk data length */ length - received,
+        /* transferred      */ &size,
+        /* timeout          */ timeout_ms);
+
+    received += size;
+
+    // a packet that arrived as the wait ran out is kept, whatever is missing of it still comes
+    if ((LIBUSB_ERROR_TIMEOUT == rc) && (0 < size) && (received < length)) {
+      spdlog::debug("usb bulk read data, {} of {} bytes in {} ms, read on", received, length, timeout_ms);
+      continue;
+    }
+
+    if ((LIBUSB_ERROR_TIMEOUT == rc) && (received == length)) {
+      rc = LIBUSB_SUCCESS;
+    }
+    break;
+  }
 
-  if (is_timeout && (LIBUSB_ERROR_TIMEOUT == rc)) {
+  if (is_timeout && (LIBUSB_ERROR_TIMEOUT == rc) && (0x00 == received)) {
     *is_timeout = rc;
+
+    // the caller polls, a timeout is only the end of one wait
+    spdlog::trace("usb bulk read data, no response in {} ms", timeout_ms);
+
+    return false;
   }
 
-  if ((rc != LIBUSB_SUCCESS) || (size != length)) {
+  if ((rc != LIBUSB_SUCCESS) || (received != length)) {
     spdlog::error("usb bulk read data failed, {}({}), or {} != {}", rc,
-                  libusb_error_name(rc), size, length);
+                  libusb_error_name(rc), received, length);
 
     return false;
   }
@@ -197,6 +210,101 @@ static bool kburn_read_data(kburn_t *kburn, void *data, int length,
   return true;
 }
 
+static bool kburn_read_data(kburn_t *kburn, void *data, int length,
+                            int *is_timeout) {
+  return kburn_read_data_timeout(kburn, data, length, kburn->medium_info.timeout_ms, is_timeout);
+}
+
+/* a wait that overran its deadline by this much cancels its transfer */
+#define KBURN_WAIT_RESP_CANCEL_SLACK_MS (1000)
+
+/*
+ * Wait up to `deadline_ms` for one response with a single IN transfer that
+ * stays submitted the whole time, so a response is never lost between two
+ * short reads. `wait_fn`, when given, runs every `interval_ms` meanwhile.
+ * LIBUSB_SUCCESS once the response is in `csw`, else the transfer's error.
+ */
+static int kburn_wait_resp(kburn_t *kburn, struct kburn_usb_pkt_wrap *csw, uint64_t deadline_ms, unsigned int interval_ms,
+                           const std::function<void(uint64_t elapsed_ms)> &wait_fn) {
+  std::unique_ptr<KBurnBulkPipe> pipe = kburn_usb_bulk_pipe(kburn->node);
+  struct kburn_bulk_xfer xfer;
+  auto start = std::chrono::steady_clock::now();
+  bool cancelled = false;
+
+  xfer.endpoint = kburn->ep_in;
+  xfer.buffer = reinterpret_cast<uint8_t *>(csw);
+  xfer.length = sizeof(*csw);
+  xfer.timeout_ms = static_cast<unsigned int>(std::min<uint64_t>(std::max<uint64_t>(deadline_ms, 1), UINT32_MAX));
+
+  int rc = pipe->submit(&xfer);
+  if (LIBUSB_SUCCESS != rc) {
+    spdlog::error("usb bulk read response, submit failed, {}({})", rc, libusb_error_name(rc));
+    return rc;
+  }
+
+  while (false == xfer.completed.load(std::memory_order_acquire)) {
+    pipe->handle_events(static_cast<int>(interval_ms), &xfer);
+
+    if (xfer.completed.load(std::memory_order_acquire)) {
+      break;
+    }
+
+    uint64_t elapsed_ms = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+    // the transfer times out on its own, this only guards against a pipe that never completes it
+    if (!cancelled && (elapsed_ms >= (deadline_ms + KBURN_WAIT_RESP_CANCEL_SLACK_MS))) {
+      pipe->cancel(&xfer);
+      cancelled = true;
+    }
+
+    if (wait_fn && !cancelled) {
+      wait_fn(elapsed_ms);
+    }
+  }
+
+  // a response that completed as the transfer timed out or was cancelled is still a response
+  if (xfer.actual_length == xfer.length) {
+    return LIBUSB_SUCCESS;
+  }
+
+  if (LIBUSB_SUCCESS == xfer.result) {
+    spdlog::error("usb bulk read response, short packet {} != {}", xfer.actual_length, xfer.length);
+    return LIBUSB_ERROR_IO;
+  }
+
+  return xfer.result;
+}
+
+/*
+ * Wait for the response of a command the device takes long on. The response
+ * is taken as soon as it is there, the interval only sets how often `wait_fn`
+ * reports progress.
+ */
+static bool kburn_poll_resp(kburn_t *kburn, struct kburn_usb_pkt_wrap *csw, uint64_t expected_ms,
+                            uint64_t deadline_ms, const std::function<void(uint64_t elapsed_ms)> &wait_fn) {
+  auto start = std::chrono::steady_clock::now();
+  unsigned int interval_ms = static_cast<unsigned int>(
+      std::min<uint64_t>(std::max<uint64_t>(expected_ms / 50, KBURN_POLL_INTERVAL_MIN_MS), KBURN_POLL_INTERVAL_MAX_MS));
+
+  int rc = kburn_wait_resp(kburn, csw, deadline_ms, interval_ms, wait_fn);
+
+  if (LIBUSB_ERROR_TIMEOUT == rc) {
+    uint64_t elapsed_ms = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+    spdlog::error("no response in {} ms, {} ms expected", elapsed_ms, expected_ms);
+    return false;
+  }
+
+  if (LIBUSB_SUCCESS != rc) {
+    spdlog::error("usb bulk read response failed, {}({})", rc, libusb_error_name(rc));
+    return false;
+  }
+
+  return true;
+}
+
 static bool kburn_parse_resp(struct kburn_usb_pkt_wrap *csw, kburn_t *kburn,
                              enum kburn_pkt_cmd cmd, void *result,
                              int *result_size) {
@@ -281,25 +389,69 @@ static bool kburn_send_cmd(kburn_t *kburn, enum kburn_pkt_cmd cmd, void *data,
   return kburn_parse_resp(&csw, kburn, cmd, result, result_size);
 }
 
-void kburn_nop(struct kburn_t *kburn) {
-  uint32_t timeout_ms = kburn->medium_info.timeout_ms;
+/*
+ * One KBURN_CMD_NONE round trip, which also clears the device error status.
+ * Responses the host never read are still queued in front of ours, they are
+ * read and dropped until the answer to this command shows up. A device that
+ * does not take the command holds such a response back, one is read before
+ * the command is sent again.
+ */
+bool kburn_sync(struct kburn_t *kburn, uint64_t deadline_ms) {
+  struct kburn_usb_pkt_wrap cbw, csw;
+  auto start = std::chrono::steady_clock::now();
 
-  spdlog::debug("issue a nop command, clear device error status");
+  auto expired = [&]() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
 
-  // issue a command, clear device state
-  spdlog::level::level_enum old_level = spdlog::get_level();
+    return static_cast<uint64_t>(elapsed.count()) >= deadline_ms;
+  };
 
-  spdlog::set_level(spdlog::level::level_enum::off);
+  memset(&cbw, 0, sizeof(cbw));
+  cbw.hdr.cmd = KBURN_CMD_NONE;
 
-  /* read last packet */
-  struct kburn_usb_pkt_wrap csw;
-  kburn->medium_info.timeout_ms = 50;
-  kburn_read_data(kburn, &csw, sizeof(csw), NULL);
-  kburn->medium_info.timeout_ms = timeout_ms;
+  spdlog::debug("sync with the loader, clear device error status");
+
+  for (;;) {
+    int is_timeout = 0;
+
+    if (kburn_write_data_timeout(kburn, &cbw, sizeof(cbw), KBURN_POLL_INTERVAL_MIN_MS, &is_timeout)) {
+      break;
+    }
+
+    if ((LIBUSB_ERROR_TIMEOUT != is_timeout) || expired()) {
+      spdlog::error("sync with the loader, command not taken");
+      return false;
+    }
+
+    is_timeout = 0;
+    if (kburn_read_data_timeout(kburn, &csw, sizeof(csw), KBURN_POLL_INTERVAL_MIN_MS, &is_timeout)) {
+      spdlog::debug("sync with the loader, drop stale response {:#06x}", csw.hdr.cmd);
+    }
+  }
 
-  kburn_send_cmd(kburn, KBURN_CMD_NONE, NULL, 0, NULL, NULL);
+  // each wait keeps its transfer for the rest of the deadline, an answer arriving late is not lost
+  for (;;) {
+    uint64_t elapsed_ms = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+    uint64_t remaining_ms = (elapsed_ms < deadline_ms) ? (deadline_ms - elapsed_ms) : 0;
+
+    int rc = kburn_wait_resp(kburn, &csw, std::max<uint64_t>(remaining_ms, KBURN_POLL_INTERVAL_MIN_MS),
+                             KBURN_POLL_INTERVAL_MIN_MS, nullptr);
+
+    if (LIBUSB_SUCCESS == rc) {
+      if (csw.hdr.cmd == (KBURN_CMD_NONE | CMD_FLAG_DEV_TO_HOST)) {
+        return true;
+      }
+
+      spdlog::debug("sync with the loader, drop stale response {:#06x}", csw.hdr.cmd);
+      continue;
+    }
 
-  spdlog::set_level(old_level);
+    if ((LIBUSB_ERROR_TIMEOUT != rc) || expired()) {
+      spdlog::error("sync with the loader, no response, {}({})", rc, libusb_error_name(rc));
+      return false;
+    }
+  }
 }
 
 bool kburn_parse_erase_config(struct kburn_t *kburn, uint64_t *offset,
@@ -325,8 +477,6 @@ bool kburn_parse_erase_config(struct kburn_t *kburn, uint64_t *offset,
 char *kburn_get_error_msg(kburn_t *kburn) { return kburn->error_msg; }
 
 void kburn_reset_chip(kburn_t *kburn) {
-#define REBOOT_MARK (0x52626F74)
-
   struct kburn_usb_pkt_wrap cbw;
   const uint64_t reboot_mark = REBOOT_MARK;
 
@@ -402,11 +552,9 @@ uint64_t kburn_get_capacity(kburn_t *kburn) {
   return info.capacity;
 }
 
-bool kburn_erase(struct kburn_t *kburn, uint64_t offset, uint64_t size,
-                 int max_retry) {
+bool kburn_erase(struct kburn_t *kburn, uint64_t offset, uint64_t size, uint64_t expected_ms,
+                 uint64_t deadline_ms, const std::function<void(uint64_t elapsed_ms)> &wait_fn) {
   struct kburn_usb_pkt_wrap cbw, csw;
-  int retry_times = 0;
-  int is_timeout = 0;
 
   uint64_t cfg[2] = {offset, size};
 
@@ -445,22 +593,13 @@ bool kburn_erase(struct kburn_t *kburn, uint64_t offset, uint64_t size,
     return false;
   }
 
-  do {
-    is_timeout = 0;
-
-    if (true == kburn_read_data(kburn, &csw, sizeof(cbw), &is_timeout)) {
-      break;
-    }
+  if (false == kburn_poll_resp(kburn, &csw, expected_ms, deadline_ms, wait_fn)) {
+    spdlog::error("kburn erase medium read resp failed");
 
-    if (LIBUSB_ERROR_TIMEOUT != is_timeout) {
-      spdlog::info("kburn erase medium read resp failed");
+    strncpy(kburn->error_msg, "erase resp timeout", sizeof(kburn->error_msg));
 
-      return false;
-    }
-
-    do_sleep(3000);
-
-  } while ((retry_times++) < max_retry);
+    return false;
+  }
 
   return true == kburn_parse_resp(&csw, kburn, KBURN_CMD_ERASE_LBA, NULL, NULL);
 }
@@ -508,17 +647,9 @@ bool kburn_write_start(struct kburn_t *kburn, uint64_t offset, uint64_t size, ui
   return true;
 }
 
-bool kburn_write_chunk(struct kburn_t *kburn, const void *data, uint64_t size) {
+static bool kburn_recv_chunk_error_msg(struct kburn_t *kburn) {
   struct kburn_usb_pkt_wrap csw;
 
-  spdlog::debug("write chunk {}", size);
-
-  if (true == kburn_write_data(kburn, const_cast<void *>(data), size)) {
-    return true;
-  }
-
-  spdlog::error("kburn write medium chunk failed,");
-
   if (false == kburn_read_data(kburn, &csw, sizeof(csw), NULL)) {
     spdlog::error(
         "kburn write medium chunk failed, recv error msg failed too.");
@@ -533,6 +664,20 @@ bool kburn_write_chunk(struct kburn_t *kburn, const void *data, uint64_t size) {
     strncpy(kburn->error_msg, reinterpret_cast<char *>(csw.data), sizeof(kburn->error_msg));
   }
 
+  return true;
+}
+
+bool kburn_write_chunk(struct kburn_t *kburn, const void *data, uint64_t size) {
+  spdlog::debug("write chunk {}", size);
+
+  if (true == kburn_write_data(kburn, const_cast<void *>(data), size)) {
+    return true;
+  }
+
+  spdlog::error("kburn write medium chunk failed,");
+
+  kburn_recv_chunk_error_msg(kburn);
+
   return false;
 }
 
@@ -572,7 +717,12 @@ bool kbrun_write_end(struct kburn_t *kburn) {
 
   spdlog::info("write end, resp msg {}", reinterpret_cast<char *>(csw.data));
 
-  kburn_nop(kburn);
+  // the next command goes out on a clean pipe, or not at all
+  if (false == kburn_sync(kburn, kburn->medium_info.timeout_ms)) {
+    strncpy(kburn->error_msg, "kburn write medium end, sync with the loader failed", sizeof(kburn->error_msg));
+
+    return false;
+  }
 
   return true;
 }
@@ -599,53 +749,19 @@ bool kburn_read_start(struct kburn_t *kburn, uint64_t offset, uint64_t size) {
   return true;
 }
 
-bool kburn_read_chunk(struct kburn_t *kburn, void *data, uint64_t size) {
-  int is_timeout;
-  int retry_times = 0;
-  int max_retry = 3;
-
-  struct kburn_usb_pkt_wrap *pkt = NULL;
-
-  int read_buffer_size = sizeof(struct kburn_usb_pkt) + 4096 + size;
-
-  spdlog::debug("read chunk {}", size);
-
-  if(read_buffer_size > kburn->rd_buffer.size()) {
-    kburn->rd_buffer.resize(read_buffer_size, 0);
-  }
-
-  do {
-    is_timeout = 0;
-
-    if (true == kburn_read_data(kburn, kburn->rd_buffer.data(), size + sizeof(struct kburn_usb_pkt), &is_timeout)) {
-      break;
-    }
-
-    if (LIBUSB_ERROR_TIMEOUT != is_timeout) {
-      spdlog::info("kburn erase medium read resp failed");
-
-      return false;
-    }
-
-    do_sleep(1000);
-  } while ((retry_times++) < max_retry);
-
-  pkt = reinterpret_cast<struct kburn_usb_pkt_wrap *>(kburn->rd_buffer.data());
-
-  if (((KBURN_CMD_READ_LBA_CHUNK | CMD_FLAG_DEV_TO_HOST) != pkt->hdr.cmd) || \
-      (KBURN_RESULT_OK != pkt->hdr.result))
+static bool kburn_check_read_chunk(const struct kburn_usb_pkt *hdr, uint64_t size) {
+  if (((KBURN_CMD_READ_LBA_CHUNK | CMD_FLAG_DEV_TO_HOST) != hdr->cmd) || \
+      (KBURN_RESULT_OK != hdr->result))
   {
-    spdlog::error("kburn read medium chunk failed, result cmd {:04x}, status {:04x}", pkt->hdr.cmd, pkt->hdr.result);
+    spdlog::error("kburn read medium chunk failed, result cmd {:04x}, status {:04x}", hdr->cmd, hdr->result);
     return false;
   }
 
-  if(pkt->hdr.data_size != size) {
-    spdlog::error("kburn read medium chunk failed, read data size mismatch {} != {}", size, pkt->hdr.data_size);
+  if(hdr->data_size != size) {
+    spdlog::error("kburn read medium chunk failed, read data size mismatch {} != {}", size, hdr->data_size);
     return false;
   }
 
-  memcpy(data, pkt->data, pkt->hdr.data_size);
-
   return true;
 }
 
@@ -690,19 +806,17 @@ bool kbrun_read_end(struct kburn_t *kburn) {
 ///////////////////////////////////////////////////////////////////////////////
 K230UBOOTBurner::K230UBOOTBurner(struct kburn_usb_node *node) : KBurner(node) {
   kburn_.node = node;
-  kburn_.medium_info.timeout_ms = 10;
+  kburn_.medium_info.timeout_ms = 10000; // set a longer timeout for probe medium info
 
   if (LIBUSB_SUCCESS != __get_endpoint(&kburn_)) {
     spdlog::error("kburn get ep failed");
   }
   spdlog::debug("device ep_in {:#02x}, ep_out {:#02x}", kburn_.ep_in, kburn_.ep_out);
 
-  kburn_.loader_version = kburn_probe_loader_version(&kburn_);
-
-  /* clear error status */
-  kburn_nop(&kburn_);
+  /* a freshly booted loader is ready once it answers, this also clears error status */
+  ready_ = kburn_sync(&kburn_, KBURN_LOADER_READY_TIMEOUT_MS);
 
-  kburn_.medium_info.timeout_ms = 10000; // set a longer timeout for probe medium info
+  kburn_.loader_version = kburn_probe_loader_version(&kburn_);
 }
 
 bool K230UBOOTBurner::probe(void) {
@@ -727,7 +841,7 @@ bool K230UBOOTBurner::reboot(void) {
   return true;
 }
 
-bool K230UBOOTBurner::write_stream(std::ifstream& file_stream, size_t size, uint64_t address, uint64_t max, uint64_t flag) {
+bool K230UBOOTBurner::write_stream(KBurnImageSource &source, size_t size, uint64_t address, uint64_t max, uint64_t flag) {
   uint64_t bytes_per_send, bytes_sent = 0, total_size = 0;
 
   size_t blk_size = kburn_.medium_info.blk_size;
@@ -753,49 +867,336 @@ bool K230UBOOTBurner::write_stream(std::ifstream& file_stream, size_t size, uint
       spdlog::warn("uboot burner, aligned write size from {} to {}", size, aligned_size);
   }
 
+  kburn_.error_msg[0] = '\0';
+  stream_stats_ = {};
+
   if (!kburn_write_start(&kburn_, address, aligned_size, max, flag)) {
       spdlog::error("uboot burner, start write failed");
       return false;
   }
 
-  do_sleep(100);
+  // no pause for the loader here, it holds the first chunk off until it is ready to take it
 
   bytes_sent = 0;
   total_size = aligned_size;
 
   log_progress(0, total_size);
 
-  std::vector<uint8_t> buffer(chunk_size, 0);
+  uint64_t source_size = std::min<uint64_t>(source.size(), total_size);
 
-  while (bytes_sent < total_size) {
-      bytes_per_send = std::min(chunk_size, total_size - bytes_sent);
-      file_stream.read(reinterpret_cast<char*>(buffer.data()), bytes_per_send);
+  // mapped sources are sent in place, only chunks past the end of the data get a buffer
+  const uint8_t *mapped = source_size ? source.view(0, source_size) : nullptr;
+  std::vector<uint8_t> tail_buffer, zero_buffer;
+
+  // the ring holds every chunk queued on the bus plus the ones read ahead
+  unsigned int ring_depth = out_queue_depth + read_ahead_chunks;
+
+  KBurnReadAhead read_ahead(chunk_size, total_size, ring_depth,
+                            [&source](uint8_t *buffer, size_t size, uint64_t offset) {
+      size_t read_count = source.read(offset, buffer, size);
 
-      std::streamsize read_count = file_stream.gcount();
-      if (read_count < static_cast<std::streamsize>(bytes_per_send)) {
+      if (read_count < size) {
           // Pad with zeroes if not enough data (end of file)
-          std::fill(buffer.begin() + read_count, buffer.begin() + bytes_per_send, 0);
+          std::fill(buffer + read_count, buffer + size, 0);
+      }
+
+      return true;
+  });
+
+  // mapped chunks are not copied, their pages are faulted in ahead of the bus instead
+  KBurnPrefetch prefetch(mapped, mapped ? source_size : 0, static_cast<uint64_t>(ring_depth) * chunk_size);
+
+  std::unique_ptr<KBurnBulkPipe> pipe = kburn_usb_bulk_pipe(kburn_.node);
+  KBurnBulkOutQueue queue(pipe.get(), kburn_.ep_out, kburn_.ep_out_mps, out_queue_depth,
+                          kburn_.medium_info.timeout_ms);
+
+  // sources with a checksum are hashed on a helper thread while their chunks are on the bus
+  KBurnDigestStage digest(source);
+
+  struct kburn_chunk chunk;
+  uint64_t chunk_index = 0, released = 0;
+
+  if (mapped) {
+      prefetch.start();
+  } else {
+      read_ahead.start();
+  }
+
+  while (bytes_sent < total_size) {
+      const uint8_t *chunk_data = nullptr;
+
+      if (mapped) {
+          bytes_per_send = std::min<uint64_t>(chunk_size, total_size - bytes_sent);
+
+          prefetch.consumed(queue.completed_bytes());
+          prefetch.wait_ready(bytes_sent + bytes_per_send);
+
+          if ((bytes_sent + bytes_per_send) <= source_size) {
+              chunk_data = mapped + bytes_sent;
+          } else if (bytes_sent < source_size) {
+              tail_buffer.assign(bytes_per_send, 0);
+              memcpy(tail_buffer.data(), mapped + bytes_sent, source_size - bytes_sent);
+
+              chunk_data = tail_buffer.data();
+          } else {
+              if (zero_buffer.empty()) {
+                  zero_buffer.assign(chunk_size, 0);
+              }
+
+              chunk_data = zero_buffer.data();
+          }
+      } else {
+          // the reader can only fill chunk n once chunk n - ring_depth is off the bus and hashed
+          if (chunk_index >= ring_depth) {
+              if (false == queue.wait_completed(chunk_index - ring_depth + 1)) {
+                  break;
+              }
+              digest.wait_completed(chunk_index - ring_depth + 1);
+          }
+
+          for (uint64_t reusable = std::min(queue.completed_chunks(), digest.completed_chunks()); released < reusable; released++) {
+              read_ahead.release();
+          }
+
+          if (false == read_ahead.acquire(chunk)) {
+              spdlog::error("uboot burner, read image failed @ {}", bytes_sent);
+              queue.abort();
+
+              return false;
+          }
+          bytes_per_send = chunk.size;
+          chunk_data = chunk.data;
       }
 
-      if (!kburn_write_chunk(&kburn_, buffer.data(), bytes_per_send)) {
-          spdlog::error("write failed @ {}", bytes_sent);
-          return false;
+      size_t digest_size = (bytes_sent < source_size) ? static_cast<size_t>(std::min<uint64_t>(bytes_per_send, source_size - bytes_sent)) : 0;
+      digest.push(chunk_data, digest_size, bytes_sent);
+
+      spdlog::debug("write chunk {}", bytes_per_send);
+
+      if (false == queue.submit(chunk_data, bytes_per_send, bytes_sent)) {
+          break;
       }
+      chunk_index++;
 
       bytes_sent += bytes_per_send;
-      log_progress(bytes_sent, total_size);
+      if (queue.completed_bytes() < total_size) {
+          log_progress(queue.completed_bytes(), total_size);
+      }
+  }
+
+  if (false == queue.drain()) {
+      read_ahead.cancel();
+      prefetch.cancel();
+      digest.cancel();
+
+      spdlog::error("kburn write medium chunk failed,");
+      spdlog::error("write failed @ {}", queue.failed_tag());
+
+      kburn_recv_chunk_error_msg(&kburn_);
+
+      return false;
   }
+  log_progress(total_size, total_size);
+
+  stream_stats_ = mapped ? prefetch.stats() : read_ahead.stats();
+  stream_stats_.digest_stall_sec = digest.stall_sec();
+  spdlog::info("write stream{}, reader busy {:.3f}s, reader stalled {:.3f}s, usb stalled {:.3f}s, hash stalled {:.3f}s", mapped ? " (mapped)" : "",
+               stream_stats_.reader_busy_sec, stream_stats_.reader_stall_sec, stream_stats_.sender_stall_sec,
+               stream_stats_.digest_stall_sec);
 
   if (!kbrun_write_end(&kburn_)) {
       spdlog::error("uboot burner, finish write failed");
+      digest.cancel();
+      return false;
+  }
+
+  // the medium stores chunks as they arrive, a bad checksum can only fail the partition once it is written
+  if (false == digest.finish()) {
+      spdlog::error("uboot burner, image checksum mismatch, the written data is corrupt");
+      strncpy(kburn_.error_msg, "image checksum mismatch", sizeof(kburn_.error_msg));
+
+      return false;
+  }
+
+  return true;
+}
+
+/* nand skips bad blocks inside a session, holes would shift the data after them */
+static bool sparse_written_in_full(uint64_t medium_type, uint64_t flag) {
+  return (KBURN_MEDIUM_SPI_NAND == medium_type) || (KBURN_FLAG_SPI_NAND_WRITE_WITH_OOB == KBURN_FLAG_FLAG(flag));
+}
+
+std::vector<struct kburn_image_range> K230UBOOTBurner::sparse_write_ranges(KBurnSparseImage &image, uint64_t flag) {
+  if (sparse_written_in_full(kburn_.medium_info.type, flag)) {
+    return {{0, image.size()}};
+  }
+
+  uint64_t align = kburn_.medium_info.erase_size ? kburn_.medium_info.erase_size : kburn_.medium_info.blk_size;
+
+  return image.data_ranges(align, KBURN_WRITE_MERGE_GAP);
+}
+
+bool K230UBOOTBurner::write_sparse(KBurnSparseImage &image, uint64_t address, uint64_t max, uint64_t flag) {
+  stream_stats_ = {};
+
+  if (false == image.is_valid()) {
+    spdlog::error("uboot burner, invalid sparse image");
+    return false;
+  }
+
+  if (sparse_written_in_full(kburn_.medium_info.type, flag)) {
+    spdlog::info("uboot burner, sparse image written in full on this medium");
+
+    return write_stream(image, image.size(), address, max, flag);
+  }
+
+  auto ranges = sparse_write_ranges(image, flag);
+
+  spdlog::info("uboot burner, sparse image {} bytes, {} ranges of data", image.size(), ranges.size());
+
+  for (const auto &range : ranges) {
+    KBurnSubImageSource segment(image, range.offset, range.size);
+    uint64_t segment_max = (max > range.offset) ? (max - range.offset) : 0;
+
+    spdlog::info("uboot burner, sparse range {:#x}, size {:#x}", address + range.offset, range.size);
+
+    if (false == write_stream(segment, range.size, address + range.offset, segment_max, flag)) {
+      spdlog::error("uboot burner, sparse range @ {:#x} failed", address + range.offset);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool K230UBOOTBurner::write_incremental(KBurnImageSource &source, size_t size, uint64_t address, uint64_t max, uint64_t flag) {
+  stream_stats_ = {};
+
+  // the read back has no oob, nand sessions can not start mid partition either
+  if (KBURN_FLAG_SPI_NAND_WRITE_WITH_OOB == KBURN_FLAG_FLAG(flag)) {
+    spdlog::info("uboot burner, incremental write not possible with oob, write in full");
+
+    return write_stream(source, size, address, max, flag);
+  }
+
+  size_t blk_size = kburn_.medium_info.blk_size;
+  uint64_t block_size = kburn_.medium_info.erase_size ? kburn_.medium_info.erase_size : blk_size;
+  uint64_t compare_size = (size + blk_size - 1) / blk_size * blk_size;
+  uint64_t total_blocks = (compare_size + block_size - 1) / block_size;
+
+  std::vector<bool> dirty(total_blocks, false);
+  std::vector<uint8_t> expect;
+
+  uint64_t source_size = std::min<uint64_t>(source.size(), size);
+
+  // the medium holds the image zero padded to blk_size, as write_stream leaves it
+  auto compare = [&](const uint8_t *data, size_t length, uint64_t offset) {
+    while (length) {
+      uint64_t block = offset / block_size;
+      size_t count = static_cast<size_t>(std::min<uint64_t>(length, (block + 1) * block_size - offset));
+
+      if (false == dirty[block]) {
+        const uint8_t *want = (offset + count <= source_size) ? source.view(offset, count) : nullptr;
+
+        if (nullptr == want) {
+          expect.assign(count, 0);
+          if (offset < source_size) {
+            size_t avail = static_cast<size_t>(std::min<uint64_t>(count, source_size - offset));
+
+            if (avail != source.read(offset, expect.data(), avail)) {
+              spdlog::error("uboot burner, read image @ {} failed", offset);
+              return false;
+            }
+          }
+          want = expect.data();
+        }
+
+        dirty[block] = (0x00 != memcmp(data, want, count));
+      }
+
+      data += count;
+      offset += count;
+      length -= count;
+    }
+
+    return true;
+  };
+
+  spdlog::info("uboot burner, incremental compare {} bytes @ {:#x} in {} blocks", compare_size, address, total_blocks);
+
+  if (false == read_stream(compare, compare_size, address)) {
+    spdlog::error("uboot burner, incremental read back failed");
+    return false;
+  }
+
+  uint64_t dirty_blocks = std::count(dirty.begin(), dirty.end(), true);
+  uint64_t merge_blocks = KBURN_WRITE_MERGE_GAP / block_size;
+
+  spdlog::info("uboot burner, incremental {} of {} blocks changed", dirty_blocks, total_blocks);
+
+  if ((0x00 != dirty_blocks) && (KBURN_MEDIUM_SPI_NAND == kburn_.medium_info.type)) {
+    // bad blocks are skipped per session, keep the partition layout the loader expects
+    return write_stream(source, size, address, max, flag);
+  }
+
+  for (uint64_t block = 0; block < total_blocks;) {
+    if (false == dirty[block]) {
+      block++;
+      continue;
+    }
+
+    // extend the run over clean gaps too short to be worth a new session
+    uint64_t end = block + 1, clean = 0;
+
+    for (uint64_t next = end; (next < total_blocks) && (clean <= merge_blocks); next++) {
+      if (dirty[next]) {
+        end = next + 1;
+        clean = 0;
+      } else {
+        clean++;
+      }
+    }
+
+    uint64_t offset = block * block_size;
+    uint64_t length = std::min<uint64_t>(end * block_size, compare_size) - offset;
+
+    KBurnSubImageSource run(source, offset, length);
+
+    spdlog::info("uboot burner, rewrite {:#x}, size {:#x}", address + offset, length);
+
+    if (false == write_stream(run, length, address + offset, (max > offset) ? (max - offset) : 0, flag)) {
+      spdlog::error("uboot burner, rewrite @ {:#x} failed", address + offset);
       return false;
+    }
+
+    block = end;
   }
 
   return true;
 }
 
 bool K230UBOOTBurner::read(void *data, size_t size, uint64_t address) {
-  uint64_t bytes_per_read, bytes_read = 0, total_size = 0;
+  uint8_t *buffer = reinterpret_cast<uint8_t *>(data);
+
+  return read_stream([buffer](const uint8_t *chunk, size_t length, uint64_t offset) {
+    memcpy(buffer + offset, chunk, length);
+    return true;
+  }, size, address);
+}
+
+bool K230UBOOTBurner::read_stream(KBurnImageSink &sink, size_t size, uint64_t address) {
+  return read_stream([&sink](const uint8_t *chunk, size_t length, uint64_t offset) {
+    return sink.write(offset, chunk, length);
+  }, size, address);
+}
+
+bool K230UBOOTBurner::read_stream(sink_fn_t sink, size_t size, uint64_t address) {
+  const int max_retry = 3;
+  const size_t hdr_size = sizeof(struct kburn_usb_pkt);
+
+  uint64_t bytes_read = 0, total_size = 0, total_chunks = 0;
+  uint64_t chunks_done = 0, chunks_queued = 0;
+  bool ok = true;
 
   size_t blk_size = kburn_.medium_info.blk_size;
   size_t aligned_size = (size + blk_size - 1) / blk_size * blk_size;
@@ -805,29 +1206,99 @@ bool K230UBOOTBurner::read(void *data, size_t size, uint64_t address) {
     return false;
   }
 
-  bytes_read = 0;
   total_size = aligned_size;
+  total_chunks = (total_size + in_chunk_size - 1) / in_chunk_size;
+
+  // Every transfer asks for a whole chunk and relies on the short packet that
+  // ends it (header + block aligned payload is never a multiple of the packet
+  // size), so a transfer that timed out can be queued again behind the others
+  // and chunks are numbered in completion order.
+  unsigned int depth = in_queue_depth;
+  int xfer_length = static_cast<int>(hdr_size + std::min<uint64_t>(in_chunk_size, total_size));
+
+  if ((0x00 == kburn_.ep_in_mps) || (0x00 == (xfer_length % kburn_.ep_in_mps))) {
+    depth = 1;
+  }
+
+  std::unique_ptr<KBurnBulkPipe> pipe = kburn_usb_bulk_pipe(kburn_.node);
+  KBurnBulkInQueue queue(pipe.get(), kburn_.ep_in, depth, xfer_length,
+                         kburn_.medium_info.timeout_ms);
+
+  // the device may go quiet for max_retry more read timeouts between two chunks,
+  // however many reads are queued and time out together meanwhile
+  auto stall_limit = std::chrono::milliseconds(static_cast<uint64_t>(kburn_.medium_info.timeout_ms) * (max_retry + 1));
+  auto last_chunk_at = std::chrono::steady_clock::now();
 
   log_progress(0, total_size);
 
-  do {
-    if ((total_size - bytes_read) > in_chunk_size) {
-      bytes_per_read = in_chunk_size;
-    } else {
-      bytes_per_read = (total_size - bytes_read);
+  while (chunks_done < total_chunks) {
+    // never queue more reads than chunks left, the end CSW must not land in one
+    while ((false == queue.full()) && (chunks_queued < total_chunks)) {
+      uint64_t remain = total_size - (chunks_queued * in_chunk_size);
+      int length = (1 == depth) ? static_cast<int>(hdr_size + std::min<uint64_t>(in_chunk_size, remain)) : xfer_length;
+
+      if (false == queue.submit(length, chunks_queued)) {
+        ok = false;
+        break;
+      }
+      chunks_queued++;
     }
 
-    if (false ==
-        kburn_read_chunk(&kburn_, reinterpret_cast<uint8_t *>(data) + bytes_read, bytes_per_read)) {
-      spdlog::error("read failed @ {}", bytes_read);
+    struct kburn_bulk_xfer *xfer = queue.front();
+    if ((false == ok) || (nullptr == xfer)) {
+      ok = false;
+      break;
+    }
 
-      return false;
+    auto stalled = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_chunk_at);
+
+    if ((LIBUSB_ERROR_TIMEOUT == xfer->result) && (0x00 == xfer->actual_length) && (stalled < stall_limit)) {
+      spdlog::debug("read chunk {} timeout, retry after {} ms", chunks_done, stalled.count());
+
+      queue.pop();
+      chunks_queued--;
+      continue;
+    }
+
+    uint64_t bytes_per_read = std::min<uint64_t>(in_chunk_size, total_size - bytes_read);
+
+    if ((LIBUSB_SUCCESS != xfer->result) || (xfer->actual_length != static_cast<int>(hdr_size + bytes_per_read))) {
+      spdlog::error("usb bulk read data failed, {}({}), or {} != {}", xfer->result,
+                    libusb_error_name(xfer->result), xfer->actual_length, hdr_size + bytes_per_read);
+      ok = false;
+      break;
+    }
+
+    if (false == kburn_check_read_chunk(reinterpret_cast<const struct kburn_usb_pkt *>(xfer->buffer), bytes_per_read)) {
+      ok = false;
+      break;
+    }
+
+    if (bytes_read < size) {
+      size_t length = static_cast<size_t>(std::min<uint64_t>(bytes_per_read, size - bytes_read));
+
+      if (false == sink(xfer->buffer + hdr_size, length, bytes_read)) {
+        spdlog::error("read sink failed @ {}", bytes_read);
+        ok = false;
+        break;
+      }
     }
 
+    queue.pop();
+    last_chunk_at = std::chrono::steady_clock::now();
+    chunks_done++;
     bytes_read += bytes_per_read;
 
     log_progress(bytes_read, total_size);
-  } while (bytes_read < total_size);
+  }
+
+  if (false == ok) {
+    queue.abort();
+
+    spdlog::error("read failed @ {}", bytes_read);
+
+    return false;
+  }
 
   if (false == kbrun_read_end(&kburn_)) {
     spdlog::error("uboot burner, finsh read failed");
@@ -837,12 +1308,92 @@ bool K230UBOOTBurner::read(void *data, size_t size, uint64_t address) {
   return true;
 }
 
+namespace {
+
+/*
+ * Erase speed per medium type, seeded with a typical figure and learned from
+ * every erase that finished, shared by all devices of the process. It only
+ * paces polling and progress, deadlines go by the slow end of the defaults.
+ */
+class erase_rate_table {
+public:
+  static erase_rate_table &get() {
+    static erase_rate_table table;
+    return table;
+  }
+
+  /* bytes per second */
+  double typical(enum KBurnMediumType type) const {
+    switch (type) {
+    case KBURN_MEDIUM_EMMC:
+    case KBURN_MEDIUM_SDCARD:
+      return 64.0 * 1024 * 1024;
+    case KBURN_MEDIUM_SPI_NAND:
+      return 16.0 * 1024 * 1024;
+    case KBURN_MEDIUM_SPI_NOR:
+      return 128.0 * 1024;
+    default:
+      return 64.0 * 1024;
+    }
+  }
+
+  double estimate(enum KBurnMediumType type) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = rates_.find(type);
+
+    return (it == rates_.end()) ? typical(type) : it->second;
+  }
+
+  void learn(enum KBurnMediumType type, uint64_t size, double elapsed_sec) {
+    // too short to tell the medium from the USB round trip
+    if (elapsed_sec < 0.02) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    double sample = size / elapsed_sec;
+    auto it = rates_.find(type);
+
+    rates_[type] = (it == rates_.end()) ? sample : (it->second + sample) / 2;
+
+    spdlog::debug("erase rate of medium {}, {:.0f} KiB/s", static_cast<int>(type), rates_[type] / 1024);
+  }
+
+private:
+  std::mutex lock_;
+  std::map<enum KBurnMediumType, double> rates_;
+};
+
+}; // namespace
+
 bool K230UBOOTBurner::erase(uint64_t address, size_t size) {
   spdlog::trace("%s", __func__);
 
-  int retry = size / 4096;
+  erase_rate_table &rates = erase_rate_table::get();
+
+  uint64_t expected_ms = static_cast<uint64_t>(size * 1000.0 / rates.estimate(_medium_type));
+  uint64_t deadline_ms = static_cast<uint64_t>(size * 1000.0 / (rates.typical(_medium_type) / 8)) +
+                         kburn_.medium_info.timeout_ms + KBURN_ERASE_DEADLINE_SLACK_MS;
+
+  auto start = std::chrono::steady_clock::now();
+
+  log_progress(0, size);
+
+  // the device says nothing until it is done, progress is the share of the expected time
+  bool ok = kburn_erase(&kburn_, address, size, expected_ms, deadline_ms, [&](uint64_t elapsed_ms) {
+    double done = expected_ms ? std::min(0.99, static_cast<double>(elapsed_ms) / expected_ms) : 0.99;
+
+    log_progress(static_cast<size_t>(size * done), size);
+  });
+
+  if (ok) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    rates.learn(_medium_type, size, elapsed.count());
+    log_progress(size, size);
+  }
 
-  return kburn_erase(&kburn_, address, size, retry);
+  return ok;
 }
 
 }; // namespace K230
@@ -0,0 +1,1115 @@
+#include "k230/kburn_k230.h"
+#include "k230/kburn_k230_emulator.h"
+#include "flash_plan.h"
+#include "kburn_protocol.h"
+#include "usb_async.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace K230 {
+
+#define K230_EMULATOR_MAX_PACKET_SIZE   (512)
+
+/* what DEV_GET_INFO reports, the host waits this long for any response */
+#define K230_EMULATOR_MEDIUM_TIMEOUT_MS (5000)
+
+/* the virtual clock may run this far ahead of the real one before a transfer sleeps */
+#define K230_EMULATOR_SLEEP_SLACK_US    (2000)
+
+/* a libusb timeout of 0 waits forever, the emulator gives up after this */
+#define K230_EMULATOR_NO_TIMEOUT_MS     (1000)
+
+#define MIB (1024.0 * 1024.0)
+
+struct k230_emulator_config k230_emulator_default_config(enum KBurnMediumType medium) {
+  struct k230_emulator_config config;
+
+  config.medium = medium;
+
+  config.out_chunk_size = 1024 * 1024;
+  config.in_chunk_size = 32 * 1024;
+
+  config.reenumerate_ms = 500;
+  config.loader_boot_ms = 200;
+
+  config.model.usb_bandwidth = 40 * MIB;
+  config.model.usb_latency_us = 125;
+  config.model.command_us = 500;
+
+  switch (medium) {
+  case KBURN_MEDIUM_SPI_NAND:
+    config.capacity = 128ULL * 1024 * 1024;
+    config.blk_size = 2048;
+    config.erase_size = 128 * 1024;
+    config.out_chunk_size = 256 * 1024;
+    config.model.read_bandwidth = 20 * MIB;
+    config.model.write_bandwidth = 8 * MIB;
+    config.model.erase_bandwidth = 16 * MIB;
+    break;
+  case KBURN_MEDIUM_SPI_NOR:
+    config.capacity = 16ULL * 1024 * 1024;
+    config.blk_size = 256;
+    config.erase_size = 4096;
+    config.out_chunk_size = 64 * 1024;
+    config.model.read_bandwidth = 8 * MIB;
+    config.model.write_bandwidth = 512 * 1024;
+    config.model.erase_bandwidth = 128 * 1024;
+    break;
+  case KBURN_MEDIUM_OTP:
+    config.capacity = 4096;
+    config.blk_size = 4;
+    config.erase_size = 4;
+    config.out_chunk_size = 4096;
+    config.in_chunk_size = 4096;
+    config.model.read_bandwidth = 64 * 1024;
+    config.model.write_bandwidth = 16 * 1024;
+    config.model.erase_bandwidth = 0;
+    break;
+  case KBURN_MEDIUM_SDCARD:
+    config.capacity = 8ULL * 1024 * 1024 * 1024;
+    config.blk_size = 512;
+    config.erase_size = 512;
+    config.model.read_bandwidth = 40 * MIB;
+    config.model.write_bandwidth = 20 * MIB;
+    config.model.erase_bandwidth = 64 * MIB;
+    break;
+  case KBURN_MEDIUM_EMMC:
+  default:
+    config.capacity = 8ULL * 1024 * 1024 * 1024;
+    config.blk_size = 512;
+    config.erase_size = 512;
+    config.model.read_bandwidth = 80 * MIB;
+    config.model.write_bandwidth = 40 * MIB;
+    config.model.erase_bandwidth = 64 * MIB;
+    break;
+  }
+
+  config.faults.brom_max_page = 0;
+  config.faults.brom_bad_page = 0;
+  config.faults.write_error_at = K230_EMULATOR_FAULT_OFF;
+  config.faults.erase_error_at = K230_EMULATOR_FAULT_OFF;
+  config.faults.read_error_at = K230_EMULATOR_FAULT_OFF;
+  config.faults.in_timeout_every = 0;
+  config.faults.in_race_every = 0;
+  config.faults.in_stall_every = 0;
+  config.faults.in_stall_ms = 0;
+  config.faults.write_protect = false;
+
+  return config;
+}
+
+static bool parse_size(const std::string &value, uint64_t &size) {
+  char *end = nullptr;
+
+  errno = 0;
+  size = strtoull(value.c_str(), &end, 0);
+
+  if (errno || (end == value.c_str())) {
+    return false;
+  }
+
+  switch (tolower(static_cast<unsigned char>(*end))) {
+  case 'g':
+    size *= 1024;
+    // fall through
+  case 'm':
+    size *= 1024;
+    // fall through
+  case 'k':
+    size *= 1024;
+    end++;
+    break;
+  default:
+    break;
+  }
+
+  return 0x00 == *end;
+}
+
+bool k230_emulator_parse_options(const std::string &options, struct k230_emulator_config &config) {
+  std::stringstream stream(options);
+  std::string option;
+
+  while (std::getline(stream, option, ',')) {
+    if (option.empty()) {
+      continue;
+    }
+
+    size_t eq = option.find('=');
+    std::string key = option.substr(0, eq);
+    std::string value = (std::string::npos == eq) ? std::string() : option.substr(eq + 1);
+
+    if ("instant" == key) {
+      config.reenumerate_ms = 0;
+      config.loader_boot_ms = 0;
+      config.model = {0, 0, 0, 0, 0, 0};
+      continue;
+    }
+
+    uint64_t number = 0;
+
+    if (!parse_size(value, number)) {
+      spdlog::error("emulator option '{}', invalid value", option);
+      return false;
+    }
+
+    if ("capacity" == key) {
+      config.capacity = number;
+    } else if ("blk_size" == key) {
+      config.blk_size = number;
+    } else if ("erase_size" == key) {
+      config.erase_size = number;
+    } else if ("out_chunk" == key) {
+      config.out_chunk_size = number;
+    } else if ("in_chunk" == key) {
+      config.in_chunk_size = number;
+    } else if ("reenumerate_ms" == key) {
+      config.reenumerate_ms = number;
+    } else if ("loader_boot_ms" == key) {
+      config.loader_boot_ms = number;
+    } else if ("usb_mibps" == key) {
+      config.model.usb_bandwidth = number * MIB;
+    } else if ("usb_latency_us" == key) {
+      config.model.usb_latency_us = number;
+    } else if ("command_us" == key) {
+      config.model.command_us = number;
+    } else if ("read_mibps" == key) {
+      config.model.read_bandwidth = number * MIB;
+    } else if ("write_mibps" == key) {
+      config.model.write_bandwidth = number * MIB;
+    } else if ("erase_mibps" == key) {
+      config.model.erase_bandwidth = number * MIB;
+    } else if ("brom_max_page" == key) {
+      config.faults.brom_max_page = static_cast<size_t>(number);
+    } else if ("brom_bad_page" == key) {
+      config.faults.brom_bad_page = static_cast<size_t>(number);
+    } else if ("write_error_at" == key) {
+      config.faults.write_error_at = number;
+    } else if ("erase_error_at" == key) {
+      config.faults.erase_error_at = number;
+    } else if ("read_error_at" == key) {
+      config.faults.read_error_at = number;
+    } else if ("in_timeout_every" == key) {
+      config.faults.in_timeout_every = static_cast<unsigned int>(number);
+    } else if ("in_race_every" == key) {
+      config.faults.in_race_every = static_cast<unsigned int>(number);
+    } else if ("in_stall_every" == key) {
+      config.faults.in_stall_every = static_cast<unsigned int>(number);
+    } else if ("in_stall_ms" == key) {
+      config.faults.in_stall_ms = number;
+    } else if ("wp" == key) {
+      config.faults.write_protect = (0x00 != number);
+    } else {
+      spdlog::error("emulator option '{}', unknown key", option);
+      return false;
+    }
+  }
+
+  // a read chunk is sized by the u16 of its header
+  if ((0x00 == config.blk_size) || (0x00 == config.erase_size) || (0x00 == config.out_chunk_size) ||
+      (0x00 == config.in_chunk_size) || (config.in_chunk_size > 0xFFFF)) {
+    spdlog::error("emulator options, invalid medium geometry or chunk size");
+    return false;
+  }
+
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/*
+ * The medium in a sparse file. Bytes are stored xor the erased byte of the
+ * medium, so holes, and erased ranges punched back into holes, read as erased.
+ */
+class K230Emulator::medium {
+public:
+  medium(const std::string &path, uint64_t capacity, uint8_t erased) : erased_(erased) {
+#if defined(_WIN32)
+    file_ = path.empty() ? tmpfile() : fopen(path.c_str(), "r+b");
+    if ((nullptr == file_) && !path.empty()) {
+      file_ = fopen(path.c_str(), "w+b");
+    }
+
+    if (nullptr == file_) {
+      spdlog::error("emulator medium, can not open {}, {}", path, strerror(errno));
+      return;
+    }
+
+    if (0 != _chsize_s(_fileno(file_), static_cast<int64_t>(capacity))) {
+      spdlog::error("emulator medium, can not size {} to {}", path, capacity);
+      fclose(file_);
+      file_ = nullptr;
+    }
+#else
+    if (path.empty()) {
+      FILE *temp = tmpfile();
+
+      fd_ = temp ? dup(fileno(temp)) : -1;
+      if (temp) {
+        fclose(temp);
+      }
+    } else {
+      fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    }
+
+    if (0 > fd_) {
+      spdlog::error("emulator medium, can not open {}, {}", path, strerror(errno));
+      return;
+    }
+
+    struct stat st;
+
+    // a larger file is kept as it is, the medium just ends before its end
+    if ((0 != fstat(fd_, &st)) ||
+        ((static_cast<uint64_t>(st.st_size) < capacity) && (0 != ftruncate(fd_, static_cast<off_t>(capacity))))) {
+      spdlog::error("emulator medium, can not size {} to {}, {}", path, capacity, strerror(errno));
+      close(fd_);
+      fd_ = -1;
+    }
+#endif
+  }
+
+  ~medium() {
+#if defined(_WIN32)
+    if (file_) {
+      fclose(file_);
+    }
+#else
+    if (0 <= fd_) {
+      close(fd_);
+    }
+#endif
+  }
+
+  bool is_open() const {
+#if defined(_WIN32)
+    return nullptr != file_;
+#else
+    return 0 <= fd_;
+#endif
+  }
+
+  bool read(uint64_t offset, uint8_t *data, size_t length) {
+#if defined(_WIN32)
+    if ((0 != _fseeki64(file_, static_cast<int64_t>(offset), SEEK_SET)) || (length != fread(data, 1, length, file_))) {
+      return false;
+    }
+#else
+    for (size_t done = 0; done < length;) {
+      ssize_t count = pread(fd_, data + done, length - done, static_cast<off_t>(offset + done));
+
+      if (0 >= count) {
+        return false;
+      }
+      done += static_cast<size_t>(count);
+    }
+#endif
+    if (erased_) {
+      for (size_t i = 0; i < length; i++) {
+        data[i] ^= erased_;
+      }
+    }
+
+    return true;
+  }
+
+  bool write(uint64_t offset, const uint8_t *data, size_t length) {
+    const uint8_t *stored = data;
+
+    if (erased_) {
+      buffer_.resize(length);
+      for (size_t i = 0; i < length; i++) {
+        buffer_[i] = data[i] ^ erased_;
+      }
+      stored = buffer_.data();
+    }
+
+#if defined(_WIN32)
+    return (0 == _fseeki64(file_, static_cast<int64_t>(offset), SEEK_SET)) && (length == fwrite(stored, 1, length, file_));
+#else
+    for (size_t done = 0; done < length;) {
+      ssize_t count = pwrite(fd_, stored + done, length - done, static_cast<off_t>(offset + done));
+
+      if (0 >= count) {
+        return false;
+      }
+      done += static_cast<size_t>(count);
+    }
+
+    return true;
+#endif
+  }
+
+  bool erase(uint64_t offset, uint64_t length) {
+#if defined(__linux__)
+    if (0 == fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset),
+                       static_cast<off_t>(length))) {
+      return true;
+    }
+#endif
+    // no holes on this file system, store the erased bytes
+    std::vector<uint8_t> erased(static_cast<size_t>(std::min<uint64_t>(length, 1024 * 1024)), erased_);
+
+    for (uint64_t done = 0; done < length;) {
+      size_t count = static_cast<size_t>(std::min<uint64_t>(erased.size(), length - done));
+
+      if (false == write(offset + done, erased.data(), count)) {
+        return false;
+      }
+      done += count;
+    }
+
+    return true;
+  }
+
+private:
+  uint8_t erased_;
+  std::vector<uint8_t> buffer_;
+
+#if defined(_WIN32)
+  FILE *file_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/*
+ * Queued transfers run one per handle_events, so a failure can still cancel
+ * the ones behind it. An IN transfer waits at most the timeout of one
+ * handle_events at a time and stays queued until its own timeout is up, the
+ * way a submitted libusb transfer does while the host pumps events.
+ */
+class K230Emulator::usb_pipe : public KBurnBulkPipe {
+public:
+  explicit usb_pipe(K230Emulator &emulator) : emulator_(emulator) {}
+
+  int submit(struct kburn_bulk_xfer *xfer) override {
+    pending_.push_back(xfer);
+    submitted_[xfer] = clock::now();
+
+    return LIBUSB_SUCCESS;
+  }
+
+  int cancel(struct kburn_bulk_xfer *xfer) override {
+    auto it = std::find(pending_.begin(), pending_.end(), xfer);
+
+    if (it == pending_.end()) {
+      return LIBUSB_ERROR_NOT_FOUND;
+    }
+    pending_.erase(it);
+    submitted_.erase(xfer);
+
+    xfer->actual_length = 0;
+    xfer->result = LIBUSB_ERROR_INTERRUPTED;
+    xfer->completed.store(true, std::memory_order_release);
+
+    return LIBUSB_SUCCESS;
+  }
+
+  int handle_events(int timeout_ms, struct kburn_bulk_xfer *wait) override {
+    (void)wait;
+
+    if (pending_.empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+      return LIBUSB_SUCCESS;
+    }
+
+    struct kburn_bulk_xfer *xfer = pending_.front();
+    unsigned int wait_ms = xfer->timeout_ms;
+    bool last = true;
+    int transferred = 0;
+
+    if ((LIBUSB_ENDPOINT_IN == (xfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)) && (0 < timeout_ms)) {
+      uint64_t waited_ms = static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - submitted_[xfer]).count());
+      uint64_t left_ms = xfer->timeout_ms ? ((waited_ms < xfer->timeout_ms) ? (xfer->timeout_ms - waited_ms) : 0)
+                                          : UINT64_MAX;
+
+      if (left_ms > static_cast<uint64_t>(timeout_ms)) {
+        wait_ms = static_cast<unsigned int>(timeout_ms);
+        last = false;
+      } else {
+        wait_ms = static_cast<unsigned int>(std::max<uint64_t>(left_ms, 1));
+      }
+    }
+
+    int rc = emulator_.transfer(xfer->endpoint, xfer->buffer, xfer->length, &transferred, wait_ms, last);
+
+    if (!last && (LIBUSB_ERROR_TIMEOUT == rc)) {
+      if (0x00 == transferred) {
+        return LIBUSB_SUCCESS;
+      }
+
+      // what arrives while the transfer is still submitted is simply received
+      rc = LIBUSB_SUCCESS;
+    }
+
+    pending_.pop_front();
+    submitted_.erase(xfer);
+
+    xfer->result = rc;
+    xfer->actual_length = transferred;
+    xfer->completed.store(true, std::memory_order_release);
+
+    return LIBUSB_SUCCESS;
+  }
+
+private:
+  K230Emulator &emulator_;
+  std::deque<struct kburn_bulk_xfer *> pending_;
+  std::map<struct kburn_bulk_xfer *, clock::time_point> submitted_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+K230Emulator::K230Emulator(const struct k230_emulator_config &config) : config_(config) {
+  clock::time_point now = clock::now();
+
+  present_at_ = ready_at_ = bus_free_ = medium_free_ = buffer_free_ = now;
+
+  medium_.reset(new medium(config_.backing_file, config_.capacity, kburn_medium_erased_byte(config_.medium)));
+  if (!medium_->is_open()) {
+    medium_.reset();
+    return;
+  }
+
+  spdlog::info("emulator, medium {} capacity {} blk_size {} erase_size {}, backing file '{}'",
+               static_cast<int>(config_.medium), config_.capacity, config_.blk_size, config_.erase_size,
+               config_.backing_file);
+}
+
+K230Emulator::~K230Emulator() {
+}
+
+bool K230Emulator::present(void) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  return present_locked();
+}
+
+void K230Emulator::bulk_endpoints(int &ep_in, uint16_t &in_mps, int &ep_out, uint16_t &out_mps) {
+  ep_in = KENDRYTE_IN_ENDPOINT;
+  ep_out = KENDRYTE_OUT_ENDPOINT;
+  in_mps = out_mps = K230_EMULATOR_MAX_PACKET_SIZE;
+}
+
+std::unique_ptr<KBurnBulkPipe> K230Emulator::bulk_pipe(void) {
+  return std::unique_ptr<KBurnBulkPipe>(new usb_pipe(*this));
+}
+
+/* when a transfer of `bytes` that may not start before `not_before` is off the bus */
+K230Emulator::clock::time_point K230Emulator::bus_transfer(size_t bytes, clock::time_point not_before) {
+  clock::time_point start = std::max({clock::now(), bus_free_, not_before});
+  double sec = config_.model.usb_latency_us / 1e6;
+
+  if (config_.model.usb_bandwidth > 0) {
+    sec += bytes / config_.model.usb_bandwidth;
+  }
+  bus_free_ = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(sec));
+
+  return bus_free_;
+}
+
+K230Emulator::clock::time_point K230Emulator::medium_busy(clock::time_point from, uint64_t bytes, double bandwidth) {
+  clock::time_point start = std::max(from, medium_free_);
+  double sec = (bandwidth > 0) ? (bytes / bandwidth) : 0;
+
+  medium_free_ = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(sec));
+
+  return medium_free_;
+}
+
+void K230Emulator::wait_until(clock::time_point when) {
+  if ((when - clock::now()) > std::chrono::microseconds(K230_EMULATOR_SLEEP_SLACK_US)) {
+    std::this_thread::sleep_until(when);
+  }
+}
+
+int K230Emulator::time_out(unsigned int timeout_ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms ? timeout_ms : K230_EMULATOR_NO_TIMEOUT_MS));
+
+  return LIBUSB_ERROR_TIMEOUT;
+}
+
+void K230Emulator::reset_loader(void) {
+  probed_ = false;
+  session_ = SESSION_IDLE;
+  responses_.clear();
+  page_buffer_.clear();
+}
+
+int K230Emulator::control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                                   uint8_t *data, uint16_t length, unsigned int timeout_ms) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  (void)timeout_ms;
+
+  if (!present_locked()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  wait_until(bus_transfer(length, clock::now()));
+
+  if (LIBUSB_ENDPOINT_IN == (request_type & LIBUSB_ENDPOINT_DIR_MASK)) {
+    if (EP0_GET_CPU_INFO != request) {
+      return LIBUSB_ERROR_PIPE;
+    }
+
+    // the loader answers its version on wValue 1
+    if ((STAGE_LOADER == stage_) && (0x01 == value)) {
+      uint32_t version = 1;
+      size_t count = std::min<size_t>(length, sizeof(version));
+
+      memcpy(data, &version, count);
+      return static_cast<int>(count);
+    }
+
+    const char *info = (STAGE_BROM == stage_) ? "K230" : "Uboot Stage for K230";
+    size_t count = std::min<size_t>(length, strlen(info));
+
+    memcpy(data, info, count);
+    return static_cast<int>(count);
+  }
+
+  // the requests below are the BootROM's, the loader stalls them
+  if (STAGE_BROM != stage_) {
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  uint32_t address = (static_cast<uint32_t>(value) << 16) | index;
+
+  switch (request) {
+  case EP0_SET_DATA_ADDRESS:
+    load_address_ = address;
+    uploaded_ = 0;
+    largest_page_ = 0;
+    return LIBUSB_SUCCESS;
+  case EP0_SET_DATA_LENGTH:
+    return LIBUSB_SUCCESS;
+  case EP0_PROG_START:
+    if ((0x00 == uploaded_) || (address != load_address_)) {
+      spdlog::error("emulator, boot from {:#x} with {} bytes uploaded to {:#x}", address, uploaded_, load_address_);
+      return LIBUSB_ERROR_PIPE;
+    }
+
+    // a loader stored wrong never comes up, the watchdog brings the BootROM back
+    if (config_.faults.brom_bad_page && (largest_page_ > config_.faults.brom_bad_page)) {
+      spdlog::debug("emulator, boot loader uploaded in {} byte pages, it hangs", largest_page_);
+
+      uploaded_ = 0;
+      largest_page_ = 0;
+      present_at_ = clock::now() + std::chrono::milliseconds(config_.reenumerate_ms + config_.loader_boot_ms);
+      return LIBUSB_SUCCESS;
+    }
+
+    spdlog::debug("emulator, boot {} byte loader @ {:#x}", uploaded_, address);
+
+    stage_ = STAGE_LOADER;
+    present_at_ = clock::now() + std::chrono::milliseconds(config_.reenumerate_ms);
+    ready_at_ = present_at_ + std::chrono::milliseconds(config_.loader_boot_ms);
+    reset_loader();
+    return LIBUSB_SUCCESS;
+  default:
+    return LIBUSB_ERROR_PIPE;
+  }
+}
+
+int K230Emulator::bulk_transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred,
+                                unsigned int timeout_ms) {
+  return transfer(endpoint, data, length, transferred, timeout_ms, true);
+}
+
+int K230Emulator::transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout_ms,
+                           bool last) {
+  std::lock_guard<std::mutex> guard(lock_);
+  int dummy;
+
+  if (nullptr == transferred) {
+    transferred = &dummy;
+  }
+  *transferred = 0;
+
+  if (!present_locked()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  if (LIBUSB_ENDPOINT_IN == (endpoint & LIBUSB_ENDPOINT_DIR_MASK)) {
+    // the BootROM never sends anything
+    return (STAGE_BROM == stage_) ? time_out(timeout_ms) : loader_bulk_in(data, length, transferred, timeout_ms, last);
+  }
+
+  if (STAGE_BROM == stage_) {
+    return brom_bulk_out(data, length, transferred);
+  }
+
+  return loader_bulk_out(data, length, transferred, timeout_ms);
+}
+
+int K230Emulator::clear_halt(uint8_t endpoint) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  if (!present_locked()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  if (KENDRYTE_OUT_ENDPOINT == endpoint) {
+    out_halted_ = false;
+  }
+
+  return LIBUSB_SUCCESS;
+}
+
+int K230Emulator::brom_bulk_out(const uint8_t *data, int length, int *transferred) {
+  (void)data;
+
+  if (out_halted_) {
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  // a revision that takes short pages only stalls on the first longer one
+  if (config_.faults.brom_max_page && (static_cast<size_t>(length) > config_.faults.brom_max_page)) {
+    spdlog::debug("emulator, brom page of {} bytes stalled", length);
+
+    out_halted_ = true;
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  wait_until(bus_transfer(length, clock::now()));
+
+  uploaded_ += length;
+  largest_page_ = std::max(largest_page_, static_cast<size_t>(length));
+  *transferred = length;
+
+  return LIBUSB_SUCCESS;
+}
+
+int K230Emulator::loader_bulk_out(const uint8_t *data, int length, int *transferred, unsigned int timeout_ms) {
+  clock::time_point now = clock::now();
+
+  // ZLPs end a chunk on the bus, there is nothing in them for the loader
+  if (0x00 == length) {
+    wait_until(bus_transfer(0, now));
+    return LIBUSB_SUCCESS;
+  }
+
+  if (ready_at_ > now) {
+    if (timeout_ms && ((ready_at_ - now) > std::chrono::milliseconds(timeout_ms))) {
+      return time_out(timeout_ms);
+    }
+    std::this_thread::sleep_until(ready_at_);
+  }
+
+  if (SESSION_FAILED == session_) {
+    if (!responses_.empty()) {
+      return time_out(timeout_ms);
+    }
+    session_ = SESSION_IDLE;
+  }
+
+  if (SESSION_WRITE == session_) {
+    clock::time_point done = bus_transfer(length, buffer_free_);
+
+    wait_until(done);
+    *transferred = length;
+
+    session_data(data, static_cast<size_t>(length), done);
+
+    return LIBUSB_SUCCESS;
+  }
+
+  // the host gave up on a read, whatever was left of it is dropped
+  if (SESSION_READ == session_) {
+    spdlog::debug("emulator, read session aborted @ {}", session_done_);
+
+    session_ = SESSION_IDLE;
+    responses_.clear();
+  }
+
+  clock::time_point done = bus_transfer(length, now);
+
+  wait_until(done);
+  *transferred = length;
+
+  command(data, length, done);
+
+  return LIBUSB_SUCCESS;
+}
+
+int K230Emulator::loader_bulk_in(uint8_t *data, int length, int *transferred, unsigned int timeout_ms, bool last) {
+  if (responses_.empty() && (SESSION_READ == session_)) {
+    next_read_chunk();
+  }
+
+  if (responses_.empty()) {
+    return time_out(timeout_ms);
+  }
+
+  struct response &resp = responses_.front();
+  clock::time_point now = clock::now();
+
+  if (timeout_ms && ((resp.ready_at - now) > std::chrono::milliseconds(timeout_ms))) {
+    return time_out(timeout_ms);
+  }
+
+  // the transfer this fault is meant for times out as a whole, not in one of its slices
+  if (resp.time_out_once && !last) {
+    return time_out(timeout_ms);
+  }
+
+  if (resp.time_out_once) {
+    resp.time_out_once = false;
+
+    spdlog::debug("emulator, in transfer timed out by fault injection");
+    return time_out(timeout_ms);
+  }
+
+  wait_until(bus_transfer(resp.bytes.size(), resp.ready_at));
+
+  size_t count = std::min(resp.bytes.size(), static_cast<size_t>(length));
+  int rc = (count < resp.bytes.size()) ? LIBUSB_ERROR_OVERFLOW : LIBUSB_SUCCESS;
+
+  memcpy(data, resp.bytes.data(), count);
+  *transferred = static_cast<int>(count);
+
+  // the data is in, the host still sees the timeout, one that drops what it got loses the response
+  if (resp.race && last) {
+    spdlog::debug("emulator, in transfer completed as it timed out by fault injection");
+    rc = LIBUSB_ERROR_TIMEOUT;
+  }
+
+  responses_.pop_front();
+
+  // the next chunk comes off the medium while the host handles this one
+  if (responses_.empty() && (SESSION_READ == session_)) {
+    next_read_chunk();
+  }
+
+  return rc;
+}
+
+void K230Emulator::respond(uint16_t cmd, uint16_t result, const void *data, size_t size, clock::time_point ready_at) {
+  struct response resp;
+  struct kburn_usb_pkt_wrap csw;
+
+  memset(&csw, 0, sizeof(csw));
+
+  size = std::min(size, sizeof(csw.data));
+
+  csw.hdr.cmd = cmd | CMD_FLAG_DEV_TO_HOST;
+  csw.hdr.result = result;
+  csw.hdr.data_size = static_cast<uint16_t>(size);
+  if (size) {
+    memcpy(csw.data, data, size);
+  }
+
+  resp.ready_at = ready_at;
+  resp.bytes.assign(reinterpret_cast<uint8_t *>(&csw), reinterpret_cast<uint8_t *>(&csw) + sizeof(csw));
+  resp.time_out_once = false;
+
+  responses_made_++;
+  resp.race = config_.faults.in_race_every && (0x00 == (responses_made_ % config_.faults.in_race_every));
+
+  responses_.push_back(std::move(resp));
+}
+
+void K230Emulator::respond_error(uint16_t cmd, const std::string &msg, clock::time_point ready_at) {
+  // the host terminates the message in the packet, one byte has to stay free
+  size_t size = std::min(msg.size(), sizeof(kburn_usb_pkt_wrap::data) - 1);
+
+  spdlog::debug("emulator, command {:#04x} failed, {}", cmd, msg);
+
+  respond(cmd, KBURN_RESULT_ERROR_MSG, msg.data(), size, ready_at);
+}
+
+void K230Emulator::command(const uint8_t *cbw, int length, clock::time_point at) {
+  struct kburn_usb_pkt_wrap pkt;
+  uint64_t cfg[4] = {0, 0, 0, 0};
+
+  memset(&pkt, 0, sizeof(pkt));
+  memcpy(&pkt, cbw, std::min<size_t>(length, sizeof(pkt)));
+
+  size_t data_size = std::min<size_t>(pkt.hdr.data_size, sizeof(pkt.data));
+  memcpy(cfg, pkt.data, std::min(data_size, sizeof(cfg)));
+
+  clock::time_point t = at + std::chrono::microseconds(config_.model.command_us);
+  uint16_t cmd = pkt.hdr.cmd;
+
+  switch (cmd) {
+  case KBURN_CMD_NONE:
+    respond(cmd, KBURN_RESULT_OK, nullptr, 0, t);
+    return;
+
+  case KBURN_CMD_REBOOT:
+    if (REBOOT_MARK != cfg[0]) {
+      respond_error(cmd, "invalid reboot mark", t);
+      return;
+    }
+
+    spdlog::debug("emulator, reboot to brom");
+
+    stage_ = STAGE_BROM;
+    uploaded_ = 0;
+    out_halted_ = false;
+    present_at_ = clock::now() + std::chrono::milliseconds(config_.reenumerate_ms);
+    reset_loader();
+    return;
+
+  case KBURN_CMD_DEV_PROBE: {
+    uint64_t chunk_sizes[2] = {config_.out_chunk_size, config_.in_chunk_size};
+
+    if ((0x00 == data_size) || (config_.medium != pkt.data[0])) {
+      respond_error(cmd, "medium not found", t);
+      return;
+    }
+    probed_ = true;
+
+    respond(cmd, KBURN_RESULT_OK, chunk_sizes, sizeof(chunk_sizes), t);
+    return;
+  }
+  default:
+    break;
+  }
+
+  if (!probed_) {
+    respond_error(cmd, (KBURN_CMD_MAX > cmd) ? "medium not probed" : "unknown command", t);
+    return;
+  }
+
+  switch (cmd) {
+  case KBURN_CMD_DEV_GET_INFO: {
+    struct kburn_medium_info info;
+
+    memset(&info, 0, sizeof(info));
+    info.capacity = config_.capacity;
+    info.blk_size = config_.blk_size;
+    info.erase_size = config_.erase_size;
+    info.timeout_ms = K230_EMULATOR_MEDIUM_TIMEOUT_MS;
+    info.wp = config_.faults.write_protect ? 1 : 0;
+    info.type = config_.medium;
+    info.valid = 1;
+
+    respond(cmd, KBURN_RESULT_OK, &info, sizeof(info), t);
+    return;
+  }
+
+  case KBURN_CMD_ERASE_LBA: {
+    uint64_t offset = cfg[0], size = cfg[1];
+
+    if (config_.faults.write_protect) {
+      respond_error(cmd, "medium write protected", t);
+      return;
+    }
+
+    if (((offset + size) > config_.capacity) || (offset % config_.erase_size) || (size % config_.erase_size)) {
+      respond_error(cmd, "erase range invalid", t);
+      return;
+    }
+
+    uint64_t fault = config_.faults.erase_error_at;
+    if ((fault >= offset) && (fault < (offset + size))) {
+      medium_->erase(offset, fault - offset);
+      respond_error(cmd, "erase failed @ " + std::to_string(fault), medium_busy(t, fault - offset, config_.model.erase_bandwidth));
+      return;
+    }
+
+    if (false == medium_->erase(offset, size)) {
+      respond_error(cmd, "erase backing file failed", t);
+      return;
+    }
+
+    // the loader answers once the medium is done
+    respond(cmd, KBURN_RESULT_OK, nullptr, 0, medium_busy(t, size, config_.model.erase_bandwidth));
+    return;
+  }
+
+  case KBURN_CMD_WRITE_LBA: {
+    uint64_t offset = cfg[0], size = cfg[1], flag = (data_size >= sizeof(cfg)) ? cfg[3] : 0;
+
+    if (config_.faults.write_protect) {
+      respond_error(cmd, "medium write protected", t);
+      return;
+    }
+
+    if (((offset + size) > config_.capacity) || (offset % config_.erase_size)) {
+      respond_error(cmd, "write range invalid", t);
+      return;
+    }
+
+    session_offset_ = offset;
+    session_size_ = size;
+    session_done_ = 0;
+    session_written_ = 0;
+    session_page_ = 0;
+    session_page_data_ = 0;
+    page_buffer_.clear();
+
+    // nand pages with oob come in whole, only their data part lands on the medium
+    if ((KBURN_MEDIUM_SPI_NAND == config_.medium) && (KBURN_FLAG_SPI_NAND_WRITE_WITH_OOB == KBURN_FLAG_FLAG(flag))) {
+      session_page_data_ = KBURN_FLAG_VAL1(flag);
+      session_page_ = session_page_data_ + KBURN_FLAG_VAL2(flag);
+    }
+
+    buffer_free_ = t;
+    session_ = SESSION_WRITE;
+    respond(cmd, KBURN_RESULT_OK, nullptr, 0, t);
+
+    if (0x00 == size) {
+      session_ = SESSION_IDLE;
+      respond(cmd, KBURN_RESULT_OK, nullptr, 0, t);
+    }
+    return;
+  }
+
+  case KBURN_CMD_READ_LBA: {
+    uint64_t offset = cfg[0];
+    uint64_t size = (cfg[1] + config_.blk_size - 1) / config_.blk_size * config_.blk_size;
+
+    if ((offset + size) > config_.capacity) {
+      respond_error(cmd, "read range invalid", t);
+      return;
+    }
+
+    session_offset_ = offset;
+    session_size_ = size;
+    session_done_ = 0;
+    in_chunks_ = 0;
+
+    respond(cmd, KBURN_RESULT_OK, nullptr, 0, t);
+
+    // chunks are made when the host asks for them, the end follows the last one
+    session_ = SESSION_READ;
+    if (0x00 == size) {
+      session_ = SESSION_IDLE;
+      respond(KBURN_CMD_READ_LBA_CHUNK, KBURN_RESULT_OK, nullptr, 0, t);
+    }
+    return;
+  }
+
+  default:
+    respond_error(cmd, "unknown command", t);
+    return;
+  }
+}
+
+/* `length` bytes of the write session at `offset` on the medium, false when the fault hit */
+bool K230Emulator::session_write(uint64_t offset, const uint8_t *data, size_t length, clock::time_point at) {
+  uint64_t fault = config_.faults.write_error_at;
+
+  if ((fault >= offset) && (fault < (offset + length))) {
+    session_ = SESSION_FAILED;
+    respond_error(KBURN_CMD_WRITE_LBA, "write failed @ " + std::to_string(fault), at);
+    return false;
+  }
+
+  if (false == medium_->write(offset, data, length)) {
+    session_ = SESSION_FAILED;
+    respond_error(KBURN_CMD_WRITE_LBA, "write backing file failed", at);
+    return false;
+  }
+
+  // the next chunk can come in while this one is written, the one after has to wait
+  buffer_free_ = medium_free_;
+  medium_busy(at, length, config_.model.write_bandwidth);
+
+  return true;
+}
+
+void K230Emulator::session_data(const uint8_t *data, size_t length, clock::time_point at) {
+  length = static_cast<size_t>(std::min<uint64_t>(length, session_size_ - session_done_));
+  session_done_ += length;
+
+  if (0x00 == session_page_) {
+    if (false == session_write(session_offset_ + session_written_, data, length, at)) {
+      return;
+    }
+    session_written_ += length;
+  } else {
+    while (length) {
+      size_t count = static_cast<size_t>(std::min<uint64_t>(length, session_page_ - page_buffer_.size()));
+
+      page_buffer_.insert(page_buffer_.end(), data, data + count);
+      data += count;
+      length -= count;
+
+      if (page_buffer_.size() < session_page_) {
+        continue;
+      }
+
+      if (false == session_write(session_offset_ + session_written_, page_buffer_.data(), session_page_data_, at)) {
+        return;
+      }
+      session_written_ += session_page_data_;
+      page_buffer_.clear();
+    }
+  }
+
+  if (session_done_ >= session_size_) {
+    session_ = SESSION_IDLE;
+    respond(KBURN_CMD_WRITE_LBA, KBURN_RESULT_OK, nullptr, 0,
+            medium_free_ + std::chrono::microseconds(config_.model.command_us));
+  }
+}
+
+void K230Emulator::next_read_chunk(void) {
+  uint64_t offset = session_offset_ + session_done_;
+  size_t count = static_cast<size_t>(std::min<uint64_t>(config_.in_chunk_size, session_size_ - session_done_));
+  clock::time_point now = clock::now();
+
+  uint64_t fault = config_.faults.read_error_at;
+  if ((fault >= offset) && (fault < (offset + count))) {
+    session_ = SESSION_IDLE;
+    respond_error(KBURN_CMD_READ_LBA_CHUNK, "read failed @ " + std::to_string(fault), now);
+    return;
+  }
+
+  struct response resp;
+  struct kburn_usb_pkt hdr = {KBURN_CMD_READ_LBA_CHUNK | CMD_FLAG_DEV_TO_HOST, KBURN_RESULT_OK, static_cast<uint16_t>(count)};
+
+  resp.bytes.resize(sizeof(hdr) + count);
+  memcpy(resp.bytes.data(), &hdr, sizeof(hdr));
+
+  if (false == medium_->read(offset, resp.bytes.data() + sizeof(hdr), count)) {
+    session_ = SESSION_IDLE;
+    respond_error(KBURN_CMD_READ_LBA_CHUNK, "read backing file failed", now);
+    return;
+  }
+
+  in_chunks_++;
+
+  resp.ready_at = medium_busy(now, count, config_.model.read_bandwidth);
+  // a stall holds back this chunk and all behind it, even with instant timing
+  if (config_.faults.in_stall_every && (0x00 == (in_chunks_ % config_.faults.in_stall_every))) {
+    resp.ready_at += std::chrono::milliseconds(config_.faults.in_stall_ms);
+  }
+  resp.time_out_once = config_.faults.in_timeout_every && (0x00 == (in_chunks_ % config_.faults.in_timeout_every));
+  resp.race = false;
+
+  responses_.push_back(std::move(resp));
+
+  session_done_ += count;
+  if (session_done_ >= session_size_) {
+    session_ = SESSION_IDLE;
+    respond(KBURN_CMD_READ_LBA_CHUNK, KBURN_RESULT_OK, nullptr, 0, medium_free_);
+  }
+}
+
+}; // namespace K230
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Kendryte_Burning_Tool {
+
+namespace K230 {
+
+/* the packets of the kburn loader, shared by the uboot burner and the emulator */
+
+#define CMD_FLAG_DEV_TO_HOST (0x8000)
+
+enum kburn_pkt_cmd {
+  KBURN_CMD_NONE = 0,
+  KBURN_CMD_REBOOT = 0x01,
+
+  KBURN_CMD_DEV_PROBE = 0x10,
+  KBURN_CMD_DEV_GET_INFO = 0x11,
+
+	KBURN_CMD_ERASE_LBA = 0x20,
+
+	KBURN_CMD_WRITE_LBA = 0x21,
+	KBURN_CMD_WRITE_LBA_CHUNK = 0x22,
+
+	KBURN_CMD_READ_LBA = 0x23,
+	KBURN_CMD_READ_LBA_CHUNK = 0x24,
+
+  KBURN_CMD_MAX,
+};
+
+enum kburn_pkt_result {
+  KBURN_RESULT_NONE = 0,
+
+  KBURN_RESULT_OK = 1,
+  KBURN_RESULT_ERROR = 2,
+
+  KBURN_RESULT_ERROR_MSG = 0xFF,
+
+  KBURN_RESULT_MAX,
+};
+
+#define KBUNR_USB_PKT_SIZE (60)
+
+#define REBOOT_MARK (0x52626F74)
+
+#pragma pack(push, 1)
+
+struct kburn_usb_pkt {
+  uint16_t cmd;
+  uint16_t result; /* only valid in csw */
+  uint16_t data_size;
+};
+
+struct kburn_usb_pkt_wrap {
+  struct kburn_usb_pkt hdr;
+  uint8_t data[KBUNR_USB_PKT_SIZE - sizeof(struct kburn_usb_pkt)];
+};
+
+#pragma pack(pop)
+
+}; // namespace K230
+
+}; // namespace Kendryte_Burning_Tool
@@ -1,4 +1,5 @@
 #include "k230/kburn_k230.h"
+#include "usb_transport.h"
 
 namespace Kendryte_Burning_Tool {
 
@@ -6,18 +7,18 @@ namespace K230 {
 
 #define USB_TIMEOUT (1000)
 
-static int usb_control_get_chip_info(libusb_device_handle *dev_hndl, char info[32])
+int k230_get_chip_info(struct kburn_usb_node *node, char info[32])
 {
     memset(info, 0, 32);
 
-    int r = libusb_control_transfer(/* dev_handle    */ dev_hndl,
-                                    /* bmRequestType */ (uint8_t)(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE),
-                                    /* bRequest      */ 0 /* ISP_STAGE1_CMD_GET_CPU_INFO */,
-                                    /* wValue        */ (uint16_t)(((0) << 8) | 0x00),
-                                    /* wIndex        */ 0,
-                                    /* Data          */ (unsigned char *)info,
-                                    /* wLength       */ 32,
-                                    /* timeout       */ USB_TIMEOUT);
+    int r = kburn_usb_control_transfer(/* node          */ node,
+                                       /* bmRequestType */ (uint8_t)(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE),
+                                       /* bRequest      */ 0 /* ISP_STAGE1_CMD_GET_CPU_INFO */,
+                                       /* wValue        */ (uint16_t)(((0) << 8) | 0x00),
+                                       /* wIndex        */ 0,
+                                       /* Data          */ (unsigned char *)info,
+                                       /* wLength       */ 32,
+                                       /* timeout       */ USB_TIMEOUT);
 
     if (r < LIBUSB_SUCCESS) {
         spdlog::error("read cpu info failed, {}({})", r, libusb_error_name(r));
@@ -36,7 +37,7 @@ bool k230_probe_device(struct kburn_usb_node *node)
     node->info.type = KBURN_USB_DEV_INVALID;
 
     do {
-        if(0 < (size = usb_control_get_chip_info(node->handle, info))) {
+        if(0 < (size = k230_get_chip_info(node, info))) {
             break;
         } else {
             spdlog::error("read chip info failed, device vid 0x{:04x} pid 0x{:04x} path {}", node->info.vid, node->info.pid, node->info.path);
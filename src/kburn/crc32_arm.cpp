@@ -0,0 +1,61 @@
+#include "crc32_impl.h"
+
+#if defined(KBURN_CRC32_ARM)
+
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace crc32_impl {
+
+bool cpu_has_armv8_crc32(void) {
+#if defined(_WIN32)
+  return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#elif defined(__linux__)
+  return 0x00 != (getauxval(AT_HWCAP) & HWCAP_CRC32);
+#elif defined(__APPLE__)
+  // every Apple arm64 part has them
+  return true;
+#else
+  return false;
+#endif
+}
+
+KBURN_TARGET("arch=armv8-a+crc")
+uint32_t update_armv8(uint32_t state, const uint8_t *p, size_t len) {
+  for (; len && (reinterpret_cast<uintptr_t>(p) & 7); len--, p++) {
+    state = __crc32b(state, *p);
+  }
+
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t word;
+
+    memcpy(&word, p, sizeof(word));
+    state = __crc32d(state, word);
+  }
+
+  for (; len; len--, p++) {
+    state = __crc32b(state, *p);
+  }
+
+  return state;
+}
+
+}; // namespace crc32_impl
+
+}; // namespace Kendryte_Burning_Tool
+
+#endif
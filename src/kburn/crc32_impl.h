@@ -0,0 +1,43 @@
+#pragma once
+
+#include "crc32.h"
+
+#if !defined(KBURN_TARGET)
+#if defined(__GNUC__) || defined(__clang__)
+#define KBURN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KBURN_TARGET(isa)
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KBURN_CRC32_X86 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define KBURN_CRC32_ARM 1
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace crc32_impl {
+
+/* update the raw (already inverted) crc state with `len` bytes */
+using update_fn_t = uint32_t (*)(uint32_t state, const uint8_t *p, size_t len);
+
+uint32_t update_table(uint32_t state, const uint8_t *p, size_t len);
+uint32_t update_slice16(uint32_t state, const uint8_t *p, size_t len);
+
+#if defined(KBURN_CRC32_X86)
+bool cpu_has_pclmul(void);
+
+uint32_t update_pclmul(uint32_t state, const uint8_t *p, size_t len);
+#endif
+
+#if defined(KBURN_CRC32_ARM)
+bool cpu_has_armv8_crc32(void);
+
+uint32_t update_armv8(uint32_t state, const uint8_t *p, size_t len);
+#endif
+
+}; // namespace crc32_impl
+
+}; // namespace Kendryte_Burning_Tool
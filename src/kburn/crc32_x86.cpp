@@ -0,0 +1,137 @@
+#include "crc32_impl.h"
+
+#if defined(KBURN_CRC32_X86)
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace crc32_impl {
+
+bool cpu_has_pclmul(void) {
+  static const bool has = []() {
+    uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+#if defined(_MSC_VER)
+    int r[4];
+
+    __cpuid(r, 1);
+    ecx = static_cast<uint32_t>(r[2]);
+#else
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+#endif
+
+    // PCLMULQDQ + SSE4.1
+    return (0x00 != (ecx & (1u << 1))) && (0x00 != (ecx & (1u << 19)));
+  }();
+
+  return has;
+}
+
+/*
+ * Fold four 128 bit lanes across the buffer with carry-less multiplies, then
+ * fold them into one and Barrett-reduce to 32 bits ("Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ", Intel). Constants are for the
+ * reflected 0xEDB88320 polynomial.
+ */
+KBURN_TARGET("pclmul,sse4.1")
+static uint32_t fold_pclmul(uint32_t state, const uint8_t *p, size_t len) {
+  alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+  __m128i x0, x1, x2, x3, x4, x5;
+
+  x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00));
+  x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10));
+  x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20));
+  x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30));
+
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(state)));
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+
+  for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+    __m128i x6, x7, x8;
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30)));
+  }
+
+  // four lanes into one
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+
+  for (__m128i next : {x2, x3, x4}) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+  }
+
+  for (; len >= 16; p += 16, len -= 16) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))), x5);
+  }
+
+  // 128 to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+uint32_t update_pclmul(uint32_t state, const uint8_t *p, size_t len) {
+  // the folding wants at least 64 bytes and whole 16 byte blocks
+  if (len < 64) {
+    return update_slice16(state, p, len);
+  }
+
+  size_t folded = len & ~static_cast<size_t>(15);
+
+  state = fold_pclmul(state, p, folded);
+
+  return update_slice16(state, p + folded, len - folded);
+}
+
+}; // namespace crc32_impl
+
+}; // namespace Kendryte_Burning_Tool
+
+#endif
@@ -0,0 +1,166 @@
+#include "decompress_source.h"
+
+#if defined(KBURN_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+bool kburn_compression_supported(enum kburn_compression type) {
+  switch (type) {
+  case KBURN_COMPRESSION_NONE:
+    return true;
+#if defined(KBURN_HAVE_ZSTD)
+  case KBURN_COMPRESSION_ZSTD:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+const char *kburn_compression_name(enum kburn_compression type) {
+  const char *names[] = {"none", "zstd"};
+
+  if (type >= KBURN_COMPRESSION_MAX) {
+    return "unknown";
+  }
+
+  return names[type];
+}
+
+#if defined(KBURN_HAVE_ZSTD)
+struct KBurnDecompressSource::decoder {
+  ZSTD_DStream *stream = nullptr;
+  ZSTD_inBuffer in = {nullptr, 0, 0};
+  bool failed = false;
+
+  ~decoder() {
+    ZSTD_freeDStream(stream);
+  }
+};
+#else
+struct KBurnDecompressSource::decoder {
+  bool failed = true;
+};
+#endif
+
+KBurnDecompressSource::KBurnDecompressSource(KBurnImageSource &compressed, enum kburn_compression type, uint64_t size)
+    : compressed_(compressed), type_(type), size_(size) {
+  if (!kburn_compression_supported(type_) || (KBURN_COMPRESSION_NONE == type_)) {
+    spdlog::error("decompress source, {} streams are not supported by this build", kburn_compression_name(type_));
+    return;
+  }
+
+#if defined(KBURN_HAVE_ZSTD)
+  auto decoder = std::make_unique<struct decoder>();
+
+  if (nullptr == (decoder->stream = ZSTD_createDStream())) {
+    spdlog::error("decompress source, can not create zstd stream");
+    return;
+  }
+  ZSTD_initDStream(decoder->stream);
+
+  in_buffer_.resize(ZSTD_DStreamInSize());
+  decoder_ = std::move(decoder);
+#endif
+}
+
+KBurnDecompressSource::~KBurnDecompressSource() {
+}
+
+bool KBurnDecompressSource::restart(void) {
+#if defined(KBURN_HAVE_ZSTD)
+  ZSTD_DCtx_reset(decoder_->stream, ZSTD_reset_session_only);
+
+  decoder_->in = {nullptr, 0, 0};
+  decoder_->failed = false;
+
+  in_offset_ = 0;
+  out_offset_ = 0;
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+size_t KBurnDecompressSource::decode(uint8_t *buffer, size_t length) {
+#if defined(KBURN_HAVE_ZSTD)
+  struct decoder &dec = *decoder_;
+  ZSTD_outBuffer out = {buffer, length, 0};
+
+  while (!dec.failed && (out.pos < out.size)) {
+    if (dec.in.pos == dec.in.size) {
+      uint64_t remain = compressed_.size() - in_offset_;
+
+      if (0x00 == remain) {
+        break;
+      }
+
+      // a mapped stream is handed to zstd whole, anything else goes through the input buffer
+      const uint8_t *data = compressed_.view(in_offset_, static_cast<size_t>(remain));
+      size_t count = static_cast<size_t>(remain);
+
+      if (nullptr == data) {
+        count = static_cast<size_t>(std::min<uint64_t>(in_buffer_.size(), remain));
+
+        if (count != compressed_.read(in_offset_, in_buffer_.data(), count)) {
+          spdlog::error("decompress source, read compressed data @ {} failed", in_offset_);
+          dec.failed = true;
+          break;
+        }
+        data = in_buffer_.data();
+      }
+
+      dec.in = {data, count, 0};
+      in_offset_ += count;
+    }
+
+    size_t rc = ZSTD_decompressStream(dec.stream, &out, &dec.in);
+    if (ZSTD_isError(rc)) {
+      spdlog::error("decompress source, zstd error @ {}, {}", out_offset_ + out.pos, ZSTD_getErrorName(rc));
+      dec.failed = true;
+    }
+  }
+
+  out_offset_ += out.pos;
+
+  return out.pos;
+#else
+  (void)buffer;
+  (void)length;
+  return 0;
+#endif
+}
+
+size_t KBurnDecompressSource::read(uint64_t offset, void *buffer, size_t length) {
+  if (!decoder_ || (offset >= size_)) {
+    return 0;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  if ((offset < out_offset_) && !restart()) {
+    return 0;
+  }
+
+  // forward seeks decode the gap and drop it
+  while (out_offset_ < offset) {
+    size_t count = static_cast<size_t>(std::min<uint64_t>(256 * 1024, offset - out_offset_));
+
+    skip_buffer_.resize(count);
+    if (count != decode(skip_buffer_.data(), count)) {
+      spdlog::error("decompress source, stream ends @ {} before {}", out_offset_, offset);
+      return 0;
+    }
+  }
+
+  size_t count = decode(reinterpret_cast<uint8_t *>(buffer), length);
+  if (count != length) {
+    spdlog::error("decompress source, stream ends @ {}, {} bytes expected", out_offset_, size_);
+  }
+
+  return count;
+}
+
+}; // namespace Kendryte_Burning_Tool
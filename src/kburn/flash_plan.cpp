@@ -0,0 +1,165 @@
+#include "flash_plan.h"
+
+#include <algorithm>
+
+namespace Kendryte_Burning_Tool {
+
+uint8_t kburn_medium_erased_byte(enum KBurnMediumType type) {
+  switch (type) {
+  case KBURN_MEDIUM_SPI_NAND:
+  case KBURN_MEDIUM_SPI_NOR:
+    return 0xFF;
+  default:
+    return 0x00;
+  }
+}
+
+static bool medium_can_merge(enum KBurnMediumType type) {
+  return (KBURN_MEDIUM_EMMC == type) || (KBURN_MEDIUM_SDCARD == type) || (KBURN_MEDIUM_SPI_NOR == type);
+}
+
+std::vector<struct kburn_write_session> kburn_plan_write_sessions(const std::vector<struct kburn_plan_item> &items,
+                                                                  enum KBurnMediumType type, uint64_t max_gap) {
+  std::vector<struct kburn_write_session> sessions;
+  bool open = false;
+
+  for (size_t i = 0; i < items.size(); i++) {
+    const struct kburn_plan_item &item = items[i];
+    bool alone = !medium_can_merge(type) || !item.mergeable || (0x00 != item.flag);
+
+    if (open && !alone) {
+      struct kburn_write_session &session = sessions.back();
+      const struct kburn_plan_item &prev = items[session.items.back()];
+      uint64_t end = session.offset + session.size;
+
+      if ((item.offset >= end) && ((item.offset - end) <= max_gap) && (item.offset <= prev.offset + prev.max)) {
+        session.size = item.offset + item.size - session.offset;
+        session.max = std::max(std::max(session.max, item.offset + item.max - session.offset), session.size);
+        session.items.push_back(i);
+
+        continue;
+      }
+    }
+
+    sessions.push_back({item.offset, item.size, item.max, item.flag, {i}});
+    open = !alone;
+  }
+
+  spdlog::debug("flash plan, {} items in {} sessions", items.size(), sessions.size());
+
+  return sessions;
+}
+
+/* whole erase blocks inside each range, sorted, overlapping and touching ones joined */
+static std::vector<struct kburn_range> aligned_union(const std::vector<struct kburn_range> &ranges, uint64_t erase_size) {
+  std::vector<struct kburn_range> blocks;
+
+  for (const auto &range : ranges) {
+    uint64_t start = (range.offset + erase_size - 1) / erase_size * erase_size;
+    uint64_t end = (range.offset + range.size) / erase_size * erase_size;
+
+    if (end > start) {
+      blocks.push_back({start, end - start});
+    }
+  }
+
+  std::sort(blocks.begin(), blocks.end(),
+            [](const struct kburn_range &a, const struct kburn_range &b) { return a.offset < b.offset; });
+
+  std::vector<struct kburn_range> merged;
+
+  for (const auto &block : blocks) {
+    if (!merged.empty() && (block.offset <= merged.back().offset + merged.back().size)) {
+      uint64_t end = std::max(merged.back().offset + merged.back().size, block.offset + block.size);
+
+      merged.back().size = end - merged.back().offset;
+    } else {
+      merged.push_back(block);
+    }
+  }
+
+  return merged;
+}
+
+std::vector<struct kburn_range> kburn_plan_erases(const std::vector<struct kburn_range> &erases,
+                                                  const std::vector<struct kburn_range> &writes, uint64_t erase_size,
+                                                  bool writes_erase) {
+  if (0x00 == erase_size) {
+    return {};
+  }
+
+  std::vector<struct kburn_range> wanted = aligned_union(erases, erase_size);
+
+  if (!writes_erase) {
+    return wanted;
+  }
+
+  std::vector<struct kburn_range> covered = aligned_union(writes, erase_size);
+  std::vector<struct kburn_range> result;
+  size_t next = 0;
+
+  // both lists are sorted and disjoint, walk them side by side
+  for (const auto &range : wanted) {
+    uint64_t pos = range.offset, end = range.offset + range.size;
+
+    while ((next < covered.size()) && (covered[next].offset + covered[next].size <= pos)) {
+      next++;
+    }
+
+    for (size_t i = next; (i < covered.size()) && (covered[i].offset < end); i++) {
+      if (covered[i].offset > pos) {
+        result.push_back({pos, covered[i].offset - pos});
+      }
+      pos = std::max(pos, covered[i].offset + covered[i].size);
+    }
+
+    if (pos < end) {
+      result.push_back({pos, end - pos});
+    }
+  }
+
+  uint64_t before = 0, after = 0;
+  for (const auto &range : wanted) {
+    before += range.size;
+  }
+  for (const auto &range : result) {
+    after += range.size;
+  }
+  spdlog::debug("flash plan, erase {} bytes in {} ranges, {} bytes left to the writes", after, result.size(), before - after);
+
+  return result;
+}
+
+std::vector<struct kburn_range> kburn_plan_part_erases(const std::vector<struct kburn_plan_item> &items,
+                                                       const std::vector<struct kburn_write_session> &sessions,
+                                                       uint64_t erase_size, bool writes_erase,
+                                                       const kburn_session_ranges_fn &written) {
+  std::vector<struct kburn_range> erases, writes;
+
+  for (const auto &item : items) {
+    if (item.erase > item.size) {
+      erases.push_back({item.offset + item.size, item.erase - item.size});
+    }
+  }
+
+  if (erases.empty()) {
+    return {};
+  }
+
+  for (const auto &session : sessions) {
+    std::vector<struct kburn_image_range> ranges;
+
+    if ((1 == session.items.size()) && !items[session.items.front()].mergeable && written && written(session, ranges)) {
+      for (const auto &range : ranges) {
+        writes.push_back({session.offset + range.offset, range.size});
+      }
+      continue;
+    }
+
+    writes.push_back({session.offset, session.size});
+  }
+
+  return kburn_plan_erases(erases, writes, erase_size, writes_erase);
+}
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,57 @@
+#include "image_sink.h"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(_WIN32)
+#define kburn_fseek _fseeki64
+#else
+#define kburn_fseek fseeko
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+KBurnFileImageSink::KBurnFileImageSink(const std::string &path) : path_(path) {
+  if (nullptr == (file_ = fopen(path_.c_str(), "wb"))) {
+    spdlog::error("image sink, can not open {}, {}", path_, strerror(errno));
+  }
+}
+
+KBurnFileImageSink::~KBurnFileImageSink() {
+  close();
+}
+
+bool KBurnFileImageSink::write(uint64_t offset, const void *data, size_t length) {
+  if (nullptr == file_) {
+    return false;
+  }
+
+  // chunks arrive in order, only seek if someone skipped a range
+  if (offset != position_) {
+    if (0 != kburn_fseek(file_, static_cast<int64_t>(offset), SEEK_SET)) {
+      spdlog::error("image sink, seek {} to {} failed, {}", path_, offset, strerror(errno));
+      return false;
+    }
+  }
+
+  if (length != fwrite(data, 1, length, file_)) {
+    spdlog::error("image sink, write {} bytes to {} failed, {}", length, path_, strerror(errno));
+    return false;
+  }
+  position_ = offset + length;
+
+  return true;
+}
+
+bool KBurnFileImageSink::close(void) {
+  bool ok = true;
+
+  if (file_) {
+    ok = (0 == fclose(file_));
+    file_ = nullptr;
+  }
+
+  return ok;
+}
+
+}; // namespace Kendryte_Burning_Tool
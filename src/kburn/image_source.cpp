@@ -0,0 +1,312 @@
+#include "image_source.h"
+
+#include <cstring>
+#include <filesystem>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+KBurnFileImageSource::KBurnFileImageSource(const std::string &path) : path_(path) {
+  std::error_code ec;
+
+  size_ = std::filesystem::file_size(path_, ec);
+  if (ec) {
+    spdlog::error("image source, can not stat {}, {}", path_, ec.message());
+    return;
+  }
+
+  if (map_file()) {
+    is_open_ = true;
+    return;
+  }
+
+  stream_.open(path_, std::ios::binary);
+  if (!stream_.is_open()) {
+    spdlog::error("image source, can not open {}", path_);
+    return;
+  }
+  is_open_ = true;
+
+  spdlog::debug("image source, {} is not mapped, read through stream", path_);
+}
+
+KBurnFileImageSource::~KBurnFileImageSource() {
+#if !defined(_WIN32)
+  if (map_) {
+    munmap(const_cast<uint8_t *>(map_), size_);
+  }
+#endif
+}
+
+bool KBurnFileImageSource::map_file(void) {
+#if defined(_WIN32)
+  return false;
+#else
+  if ((0x00 == size_) || (size_ > SIZE_MAX)) {
+    return false;
+  }
+
+  int fd = ::open(path_.c_str(), O_RDONLY);
+  if (0 > fd) {
+    return false;
+  }
+
+  void *addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if (MAP_FAILED == addr) {
+    spdlog::debug("image source, mmap {} failed, {}", path_, strerror(errno));
+    return false;
+  }
+
+  // streamed once front to back, let the kernel read ahead aggressively
+  madvise(addr, size_, MADV_SEQUENTIAL);
+
+  map_ = static_cast<const uint8_t *>(addr);
+
+  return true;
+#endif
+}
+
+const uint8_t *KBurnFileImageSource::view(uint64_t offset, size_t length) {
+  if ((nullptr == map_) || (offset > size_) || (length > (size_ - offset))) {
+    return nullptr;
+  }
+
+  return map_ + offset;
+}
+
+size_t KBurnFileImageSource::read(uint64_t offset, void *buffer, size_t length) {
+  if (offset >= size_) {
+    return 0;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  if (map_) {
+    memcpy(buffer, map_ + offset, length);
+    return length;
+  }
+
+  if (offset != stream_pos_) {
+    stream_.clear();
+    stream_.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+  }
+  stream_.read(reinterpret_cast<char *>(buffer), length);
+
+  size_t count = static_cast<size_t>(stream_.gcount());
+  stream_pos_ = offset + count;
+
+  return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBurnStreamImageSource::KBurnStreamImageSource(std::ifstream &stream) : stream_(stream) {
+  base_ = stream_.tellg();
+  if (0 > base_) {
+    base_ = 0;
+  }
+
+  stream_.seekg(0, std::ios::end);
+  std::streamoff end = stream_.tellg();
+  stream_.seekg(base_, std::ios::beg);
+
+  size_ = (end > base_) ? static_cast<uint64_t>(end - base_) : 0;
+}
+
+size_t KBurnStreamImageSource::read(uint64_t offset, void *buffer, size_t length) {
+  if (offset >= size_) {
+    return 0;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  if (offset != pos_) {
+    stream_.clear();
+    stream_.seekg(base_ + static_cast<std::streamoff>(offset), std::ios::beg);
+  }
+  stream_.read(reinterpret_cast<char *>(buffer), length);
+
+  size_t count = static_cast<size_t>(stream_.gcount());
+  pos_ = offset + count;
+
+  return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBurnSubImageSource::KBurnSubImageSource(KBurnImageSource &parent, uint64_t offset, uint64_t size)
+    : parent_(parent), offset_(offset) {
+  uint64_t parent_size = parent_.size();
+
+  if (offset_ > parent_size) {
+    offset_ = parent_size;
+  }
+  size_ = std::min<uint64_t>(size, parent_size - offset_);
+}
+
+const uint8_t *KBurnSubImageSource::view(uint64_t offset, size_t length) {
+  if ((offset > size_) || (length > (size_ - offset))) {
+    return nullptr;
+  }
+
+  return parent_.view(offset_ + offset, length);
+}
+
+size_t KBurnSubImageSource::read(uint64_t offset, void *buffer, size_t length) {
+  if (offset >= size_) {
+    return 0;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  return parent_.read(offset_ + offset, buffer, length);
+}
+
+void KBurnSubImageSource::digest(uint64_t offset, const void *data, size_t length) {
+  if (offset >= size_) {
+    return;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  parent_.digest(offset_ + offset, data, length);
+}
+
+bool KBurnSubImageSource::verify(void) {
+  // a range in the middle has not seen everything, checking now would read the parent to its end each time
+  if ((offset_ + size_) != parent_.size()) {
+    return true;
+  }
+
+  return parent_.verify();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBurnMemoryImageSource::KBurnMemoryImageSource(const void *data, uint64_t size)
+    : data_(static_cast<const uint8_t *>(data)), size_(size) {
+}
+
+const uint8_t *KBurnMemoryImageSource::view(uint64_t offset, size_t length) {
+  if ((offset > size_) || (length > size_ - offset)) {
+    return nullptr;
+  }
+
+  return data_ + offset;
+}
+
+size_t KBurnMemoryImageSource::read(uint64_t offset, void *buffer, size_t length) {
+  if (offset >= size_) {
+    return 0;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  memcpy(buffer, data_ + offset, length);
+
+  return length;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBurnJoinedImageSource::KBurnJoinedImageSource(uint64_t size, uint8_t fill) : size_(size), fill_(fill) {
+}
+
+bool KBurnJoinedImageSource::add(uint64_t offset, KBurnImageSource &source) {
+  uint64_t end = pieces_.empty() ? 0 : (pieces_.back().offset + pieces_.back().size);
+
+  if ((offset < end) || (offset > size_) || (source.size() > (size_ - offset))) {
+    spdlog::error("joined source, piece @ {} size {} does not fit", offset, source.size());
+    return false;
+  }
+
+  pieces_.push_back({offset, source.size(), &source});
+
+  return true;
+}
+
+const uint8_t *KBurnJoinedImageSource::view(uint64_t offset, size_t length) {
+  for (auto &piece : pieces_) {
+    if ((offset >= piece.offset) && (offset - piece.offset + length <= piece.size)) {
+      return piece.source->view(offset - piece.offset, length);
+    }
+  }
+
+  return nullptr;
+}
+
+size_t KBurnJoinedImageSource::read(uint64_t offset, void *buffer, size_t length) {
+  uint8_t *out = reinterpret_cast<uint8_t *>(buffer);
+
+  if (offset >= size_) {
+    return 0;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  uint64_t pos = offset, end = offset + length;
+
+  for (auto &piece : pieces_) {
+    uint64_t piece_end = piece.offset + piece.size;
+
+    if (piece_end <= pos) {
+      continue;
+    }
+    if (piece.offset >= end) {
+      break;
+    }
+
+    // hole in front of the piece
+    if (pos < piece.offset) {
+      memset(out + (pos - offset), fill_, static_cast<size_t>(piece.offset - pos));
+      pos = piece.offset;
+    }
+
+    size_t count = static_cast<size_t>(std::min(end, piece_end) - pos);
+
+    if (count != piece.source->read(pos - piece.offset, out + (pos - offset), count)) {
+      return 0;
+    }
+    pos += count;
+  }
+
+  if (pos < end) {
+    memset(out + (pos - offset), fill_, static_cast<size_t>(end - pos));
+  }
+
+  return length;
+}
+
+bool KBurnJoinedImageSource::digests(void) const {
+  for (const auto &piece : pieces_) {
+    if (piece.source->digests()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void KBurnJoinedImageSource::digest(uint64_t offset, const void *data, size_t length) {
+  const uint8_t *in = reinterpret_cast<const uint8_t *>(data);
+  uint64_t end = offset + length;
+
+  for (auto &piece : pieces_) {
+    uint64_t start = std::max(offset, piece.offset);
+    uint64_t stop = std::min(end, piece.offset + piece.size);
+
+    if (start < stop) {
+      piece.source->digest(start - piece.offset, in + (start - offset), static_cast<size_t>(stop - start));
+    }
+  }
+}
+
+bool KBurnJoinedImageSource::verify(void) {
+  bool ok = true;
+
+  for (auto &piece : pieces_) {
+    ok = piece.source->verify() && ok;
+  }
+
+  return ok;
+}
+
+}; // namespace Kendryte_Burning_Tool
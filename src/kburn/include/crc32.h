@@ -0,0 +1,32 @@
+#pragma once
+
+#include "kburn.h"
+
+namespace Kendryte_Burning_Tool {
+
+enum kburn_crc32_backend {
+  KBURN_CRC32_TABLE = 0,  /* one table lookup per byte, the reference */
+  KBURN_CRC32_SLICE16,    /* sixteen tables, sixteen bytes per step */
+  KBURN_CRC32_PCLMUL,     /* x86 carry-less multiply folding */
+  KBURN_CRC32_ARMV8,      /* ARMv8 CRC32 instructions */
+  KBURN_CRC32_BACKEND_MAX,
+};
+
+KBURN_API bool kburn_crc32_backend_supported(enum kburn_crc32_backend backend);
+KBURN_API const char *kburn_crc32_backend_name(enum kburn_crc32_backend backend);
+
+/* the fastest supported backend is picked on first use, set_backend overrides it */
+KBURN_API enum kburn_crc32_backend kburn_crc32_get_backend(void);
+KBURN_API bool kburn_crc32_set_backend(enum kburn_crc32_backend backend);
+
+/*
+ * CRC-32 as used by zlib and the kdimage tables (reflected 0xEDB88320,
+ * inverted in and out). Pass the previous result as `crc` to continue, 0 to
+ * start.
+ */
+KBURN_API uint32_t kburn_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* the same with an explicit backend, for checking them against each other */
+KBURN_API uint32_t kburn_crc32_with(enum kburn_crc32_backend backend, uint32_t crc, const void *buf, size_t len);
+
+}; // namespace Kendryte_Burning_Tool
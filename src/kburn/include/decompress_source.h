@@ -0,0 +1,57 @@
+#pragma once
+
+#include "kburn.h"
+#include "image_source.h"
+
+#include <memory>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+enum kburn_compression {
+  KBURN_COMPRESSION_NONE = 0,
+  KBURN_COMPRESSION_ZSTD = 1,   /* one or more zstd frames */
+  KBURN_COMPRESSION_MAX,
+};
+
+/* zstd is optional, builds without it refuse compressed parts */
+KBURN_API bool kburn_compression_supported(enum kburn_compression type);
+KBURN_API const char *kburn_compression_name(enum kburn_compression type);
+
+/*
+ * The decompressed bytes of a compressed stream held by another source.
+ * Decoding is sequential: reading front to back streams through the decoder
+ * with nothing kept but its window, a read behind the last one starts over
+ * and a read ahead of it decodes the gap. Nothing is mapped, view() always
+ * misses, so write_stream decodes on its read-ahead thread.
+ */
+class KBURN_API KBurnDecompressSource : public KBurnImageSource {
+public:
+  KBurnDecompressSource(KBurnImageSource &compressed, enum kburn_compression type, uint64_t size);
+  ~KBurnDecompressSource();
+
+  bool is_valid() const { return nullptr != decoder_; }
+
+  uint64_t size() const override { return size_; }
+  size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+private:
+  struct decoder;
+
+  KBurnImageSource &compressed_;
+  enum kburn_compression type_;
+  uint64_t size_;
+
+  std::unique_ptr<struct decoder> decoder_;
+
+  std::vector<uint8_t> in_buffer_;
+  std::vector<uint8_t> skip_buffer_;
+
+  uint64_t in_offset_ = 0;    /* compressed bytes fed to the decoder so far */
+  uint64_t out_offset_ = 0;   /* decompressed bytes produced so far */
+
+  bool restart(void);
+  size_t decode(uint8_t *buffer, size_t length);
+};
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "kburn.h"
+#include "sparse_image.h"
+
+#include <functional>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+/* one image to write, as the planner sees it */
+struct kburn_plan_item {
+  uint64_t offset;    /* medium address */
+  uint64_t size;      /* bytes written */
+  uint64_t max;       /* size of its partition, the space past `size` belongs to it */
+  uint64_t flag;      /* part flag, any flag keeps the item on its own */
+  bool mergeable;     /* false for items with a write path of their own, like sparse images */
+  uint64_t erase = 0; /* bytes from offset its partition wants erased, the part of it past `size` is */
+};
+
+/* one WRITE_LBA session, items in list order with the erased byte between them */
+struct kburn_write_session {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t max;
+  uint64_t flag;
+
+  std::vector<size_t> items;   /* indices into the planned list */
+};
+
+/* what an erased medium reads back as, gaps inside a session are filled with it */
+KBURN_API uint8_t kburn_medium_erased_byte(enum KBurnMediumType type);
+
+/*
+ * Group the items into as few write sessions as possible, keeping their order.
+ * An item joins the session before it when it starts at or after the end of
+ * that session and the gap in between is at most `max_gap` bytes and inside
+ * the partition of the item before it, so no byte outside the image is
+ * touched. Items with a flag, items that are not mergeable and everything on
+ * SPI NAND and OTP, where bad block skipping or the write path moves data,
+ * get a session each.
+ */
+KBURN_API std::vector<struct kburn_write_session> kburn_plan_write_sessions(const std::vector<struct kburn_plan_item> &items,
+                                                                           enum KBurnMediumType type, uint64_t max_gap);
+
+struct kburn_range {
+  uint64_t offset;
+  uint64_t size;
+};
+
+/*
+ * The fewest ERASE_LBA commands for a set of erase requests. Every request is
+ * shrunk to whole erase blocks, the union is taken and neighbours are joined.
+ * With `writes_erase`, blocks a write covers whole are left out, its write
+ * path replaces them anyway. The result is sorted and meant to be erased
+ * before anything is written.
+ */
+KBURN_API std::vector<struct kburn_range> kburn_plan_erases(const std::vector<struct kburn_range> &erases,
+                                                           const std::vector<struct kburn_range> &writes,
+                                                           uint64_t erase_size, bool writes_erase);
+
+/* what a session writes relative to its offset, false when that is all of it */
+using kburn_session_ranges_fn = std::function<bool(const struct kburn_write_session &session,
+                                                   std::vector<struct kburn_image_range> &ranges)>;
+
+/*
+ * kburn_plan_erases() for a planned image: the space of every item past its
+ * size up to its `erase`, around what the sessions write. Sessions of an item
+ * that is not mergeable ask `written`, a sparse image leaves its DONT_CARE
+ * holes to the erase.
+ */
+KBURN_API std::vector<struct kburn_range> kburn_plan_part_erases(const std::vector<struct kburn_plan_item> &items,
+                                                                const std::vector<struct kburn_write_session> &sessions,
+                                                                uint64_t erase_size, bool writes_erase,
+                                                                const kburn_session_ranges_fn &written);
+
+}; // namespace Kendryte_Burning_Tool
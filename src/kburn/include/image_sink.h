@@ -0,0 +1,34 @@
+#pragma once
+
+#include "kburn.h"
+
+#include <cstdio>
+#include <string>
+
+namespace Kendryte_Burning_Tool {
+
+/* receives data read back from the medium, chunk by chunk and in order */
+class KBURN_API KBurnImageSink {
+public:
+  virtual ~KBurnImageSink() {}
+
+  virtual bool write(uint64_t offset, const void *data, size_t length) = 0;
+};
+
+class KBURN_API KBurnFileImageSink : public KBurnImageSink {
+public:
+  explicit KBurnFileImageSink(const std::string &path);
+  ~KBurnFileImageSink();
+
+  bool is_open() const { return nullptr != file_; }
+
+  bool write(uint64_t offset, const void *data, size_t length) override;
+  bool close(void);
+
+private:
+  std::string path_;
+  FILE *file_ = nullptr;
+  uint64_t position_ = 0;
+};
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "kburn.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+/*
+ * Read-only byte source for write_stream. Sources that can expose their bytes
+ * in place (mmap) return them from view(), chunks then go to libusb without
+ * being copied. Everything else is read into the caller's buffers.
+ */
+class KBURN_API KBurnImageSource {
+public:
+  virtual ~KBurnImageSource() {}
+
+  virtual uint64_t size() const = 0;
+
+  /* pointer to [offset, offset + length), valid while the source lives, or nullptr */
+  virtual const uint8_t *view(uint64_t offset, size_t length) {
+    (void)offset;
+    (void)length;
+    return nullptr;
+  }
+
+  /* copy up to length bytes from offset, returns the number of bytes copied */
+  virtual size_t read(uint64_t offset, void *buffer, size_t length) = 0;
+
+  /* sources that carry a checksum take every byte once, in order, through digest() */
+  virtual bool digests(void) const { return false; }
+  virtual void digest(uint64_t offset, const void *data, size_t length) {
+    (void)offset;
+    (void)data;
+    (void)length;
+  }
+
+  /* sources that carry a checksum check it here, once everything was consumed */
+  virtual bool verify(void) { return true; }
+};
+
+/* a file on disk, mapped when the platform allows it and read through ifstream otherwise */
+class KBURN_API KBurnFileImageSource : public KBurnImageSource {
+public:
+  explicit KBurnFileImageSource(const std::string &path);
+  ~KBurnFileImageSource();
+
+  bool is_open() const { return is_open_; }
+  bool is_mapped() const { return nullptr != map_; }
+
+  uint64_t size() const override { return size_; }
+  const uint8_t *view(uint64_t offset, size_t length) override;
+  size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+private:
+  std::string path_;
+  uint64_t size_ = 0;
+  bool is_open_ = false;
+
+  const uint8_t *map_ = nullptr;
+  std::ifstream stream_;
+  uint64_t stream_pos_ = 0;
+
+  bool map_file(void);
+};
+
+/* adapter for callers that still hand over an opened stream, starts at its current position */
+class KBURN_API KBurnStreamImageSource : public KBurnImageSource {
+public:
+  explicit KBurnStreamImageSource(std::ifstream &stream);
+
+  uint64_t size() const override { return size_; }
+  size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+private:
+  std::ifstream &stream_;
+  std::streamoff base_ = 0;
+  uint64_t size_ = 0;
+  uint64_t pos_ = 0;
+};
+
+/*
+ * [offset, offset + size) of another source, presented as a source of its own.
+ * Checksums are passed on to the parent at its own offsets; only a range that
+ * ends where the parent ends checks them, the parent's owner checks the rest.
+ */
+class KBURN_API KBurnSubImageSource : public KBurnImageSource {
+public:
+  KBurnSubImageSource(KBurnImageSource &parent, uint64_t offset, uint64_t size);
+
+  uint64_t size() const override { return size_; }
+  const uint8_t *view(uint64_t offset, size_t length) override;
+  size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+  bool digests(void) const override { return parent_.digests(); }
+  void digest(uint64_t offset, const void *data, size_t length) override;
+  bool verify(void) override;
+
+private:
+  KBurnImageSource &parent_;
+  uint64_t offset_ = 0;
+  uint64_t size_ = 0;
+};
+
+/* bytes already in memory, borrowed for the life of the source */
+class KBURN_API KBurnMemoryImageSource : public KBurnImageSource {
+public:
+  KBurnMemoryImageSource(const void *data, uint64_t size);
+
+  uint64_t size() const override { return size_; }
+  const uint8_t *view(uint64_t offset, size_t length) override;
+  size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+private:
+  const uint8_t *data_;
+  uint64_t size_;
+};
+
+/*
+ * Several sources laid out at increasing offsets as one, bytes between them
+ * read as `fill`. Checksums are passed on to the pieces that carry one.
+ */
+class KBURN_API KBurnJoinedImageSource : public KBurnImageSource {
+public:
+  KBurnJoinedImageSource(uint64_t size, uint8_t fill);
+
+  /* `source` must stay alive, start at or after the end of the previous piece and fit */
+  bool add(uint64_t offset, KBurnImageSource &source);
+
+  uint64_t size() const override { return size_; }
+  const uint8_t *view(uint64_t offset, size_t length) override;
+  size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+  bool digests(void) const override;
+  void digest(uint64_t offset, const void *data, size_t length) override;
+  bool verify(void) override;
+
+private:
+  struct piece {
+    uint64_t offset;
+    uint64_t size;
+    KBurnImageSource *source;
+  };
+
+  uint64_t size_;
+  uint8_t fill_;
+  std::vector<struct piece> pieces_;
+};
+
+}; // namespace Kendryte_Burning_Tool
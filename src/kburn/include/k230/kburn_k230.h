@@ -1,6 +1,11 @@
 #pragma once
 
 #include "kburn.h"
+#include "image_sink.h"
+#include "image_source.h"
+#include "read_ahead.h"
+#include "sparse_image.h"
+
 #include <fstream>
 
 namespace Kendryte_Burning_Tool {
@@ -24,6 +29,8 @@ enum USB_KENDRYTE_REQUEST_BASIC {
   EP0_PROG_START = 4,
 };
 
+class K230UBOOTBurner;
+
 class KBURN_API K230BROMBurner : public KBurner {
 public:
   K230BROMBurner(struct kburn_usb_node *node) : KBurner(node) {}
@@ -33,14 +40,79 @@ public:
   bool get_loader(const char **loader, size_t *size);
 
   bool write(const void *data, size_t size, uint64_t address = 0x80360000);
-  bool write_stream(std::ifstream& file_stream, size_t size, uint64_t address, uint64_t max, uint64_t flag) {
+
+  // lets write() try pages larger than 1000 bytes on a chip whose page size is not known yet
+  void set_page_probe(bool enable) { page_probe_ = enable; }
+
+  using KBurner::write_stream;
+  bool write_stream(KBurnImageSource &source, size_t size, uint64_t address, uint64_t max, uint64_t flag) {
     spdlog::error("brom burner, not support write stream");
     return false;
   }
 
+  // the chip and page size the last write went through with
+  struct upload_info {
+    std::string chip_key;
+    size_t page_size = 0;
+  };
+  const struct upload_info &get_upload_info() const { return upload_; }
+
+  // keeps the page size of `upload` for its chip once the loader it uploaded answered, else the next smaller one
+  static void confirm_upload(const struct upload_info &upload, bool loader_answered);
+
+  // the page size tried after `page_size`, 0 when there is none
+  static size_t next_page_size(size_t page_size);
+
+  // where the page sizes per chip are kept, the part cache's default directory when empty
+  static void set_page_table_dir(const std::string &dir);
+
+  // the steps of boot_loader(), each reported with the device it starts from
+  enum boot_step {
+    BOOT_STEP_UPLOAD,
+    BOOT_STEP_BOOT,
+    BOOT_STEP_REENUMERATE,
+    BOOT_STEP_LOADER_READY,
+    BOOT_STEP_RETRY,          /* the loader did not come up, waiting for the BootROM again */
+  };
+  using boot_step_fn_t = std::function<void(void *ctx, enum boot_step step, const struct kburn_usb_dev_info &dev)>;
+
+  struct boot_options {
+    enum KBurnMediumType medium_type = KBURN_MEDIUM_INVAILD;
+    const char *loader = nullptr;         /* the built in loader of the medium when null */
+    size_t loader_size = 0;
+    uint64_t address = 0x80360000;
+    bool page_probe = false;              /* see set_page_probe() */
+    int reenumerate_timeout_ms = 15000;   /* how long a rebooted chip has to come back */
+    progress_fn_t progress_fn;            /* of the loader upload, optional */
+    boot_step_fn_t step_fn;               /* optional */
+    void *ctx = nullptr;                  /* passed to both callbacks */
+  };
+
+  /*
+   * Uploads the loader to the BROM device `dev`, boots it and waits for it on
+   * the same port. A loader that does not come up lowers the page size for its
+   * chip, and the board is tried again once it is back in the BootROM. A device
+   * already in loader mode is taken as is. Returns the loader that answered,
+   * with `dev` updated to it and the upload it came up from in `loaded`, or
+   * nullptr and the reason in `error`.
+   */
+  static std::unique_ptr<K230UBOOTBurner> boot_loader(struct kburn_usb_dev_info &dev, const struct boot_options &options,
+                                                      std::string &error, struct upload_info *loaded = nullptr);
+
 private:
+  enum upload_result {
+    UPLOAD_OK,
+    UPLOAD_PAGE_REJECTED,   /* a page did not go through, smaller ones may */
+    UPLOAD_FAILED,          /* the device is gone, nothing else is tried */
+  };
+
+  struct upload_info upload_;
+  bool page_probe_ = false;
+
   bool k230_brom_set_data_addr(uint64_t address = 0x80360000);
-  bool k230_brom_write_data_chunk(const uint8_t *data, size_t size);
+
+  enum upload_result upload(const uint8_t *data, size_t size, uint64_t address, size_t page_size);
+  std::string chip_key(void);
 };
 
 struct kburn_medium_info {
@@ -63,16 +135,17 @@ struct kburn_t {
   int loader_version;
 
   int ep_in, ep_out;
-  uint16_t ep_out_mps;
+  uint16_t ep_in_mps, ep_out_mps;
   uint64_t capacity;
-
-  std::vector<uint8_t> rd_buffer;
 };
 
 class KBURN_API K230UBOOTBurner : public KBurner {
 public:
   K230UBOOTBurner(struct kburn_usb_node *node);
 
+  // the loader answered a command when the burner was created
+  bool is_ready(void) const { return ready_; }
+
   bool probe(void);
   bool reboot(void);
 
@@ -95,14 +168,45 @@ public:
     return false;
   }
 
-  bool write_stream(std::ifstream& file_stream, size_t size, uint64_t address, uint64_t max, uint64_t flag);
+  using KBurner::write_stream;
+  bool write_stream(KBurnImageSource &source, size_t size, uint64_t address, uint64_t max, uint64_t flag);
+  // writes only the data ranges of the sparse image, one session each, DONT_CARE runs are left untouched
+  bool write_sparse(KBurnSparseImage &image, uint64_t address, uint64_t max, uint64_t flag);
+  // what write_sparse writes of `image`, relative to its start; the rest of it keeps what the medium holds
+  std::vector<struct kburn_image_range> sparse_write_ranges(KBurnSparseImage &image, uint64_t flag);
+  // reads the target back per erase block and rewrites only the runs that differ from the source
+  bool write_incremental(KBurnImageSource &source, size_t size, uint64_t address, uint64_t max, uint64_t flag);
+
+  // called for every chunk read back, in order, `offset` is relative to the read address
+  using sink_fn_t = std::function<bool(const uint8_t *data, size_t size, uint64_t offset)>;
 
   bool read(void *data, size_t size, uint64_t address);
+  bool read_stream(sink_fn_t sink, size_t size, uint64_t address);
+  bool read_stream(KBurnImageSink &sink, size_t size, uint64_t address);
 
   bool erase(uint64_t address, size_t size);
 
+  // number of bulk OUT transfers (chunks and ZLPs) kept queued while streaming
+  void set_out_queue_depth(unsigned int depth) { out_queue_depth = depth ? depth : 1; }
+  // number of bulk IN chunk reads kept queued while reading back
+  void set_in_queue_depth(unsigned int depth) { in_queue_depth = depth ? depth : 1; }
+  // number of chunks the reader thread may prepare ahead of the USB stage
+  void set_read_ahead_chunks(unsigned int chunks) { read_ahead_chunks = chunks; }
+
+  // where the last write_stream spent its time waiting
+  const struct kburn_stream_stats &get_stream_stats() const { return stream_stats_; }
+
+  // what the loader, or the host side checks, reported for the last failed command
+  const char *get_error_msg() const { return kburn_.error_msg; }
+
 private:
+  bool ready_ = false;
   bool probe_succ = false;
+  unsigned int out_queue_depth = 4;
+  unsigned int in_queue_depth = 4;
+  unsigned int read_ahead_chunks = 4;
+
+  struct kburn_stream_stats stream_stats_ = {};
   uint64_t out_chunk_size = 512;
   uint64_t in_chunk_size = 512;
 
@@ -111,6 +215,9 @@ private:
   struct kburn_t kburn_;
 };
 
+/* the 32 byte chip info string of the BootROM or the loader, its length or -1 */
+int k230_get_chip_info(struct kburn_usb_node *node, char info[32]);
+
 KBURN_API bool k230_probe_device(struct kburn_usb_node *node);
 
 KBURN_API KBurner *k230_request_burner(struct kburn_usb_node *node);
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "kburn.h"
+#include "usb_transport.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+namespace K230 {
+
+/* how long the emulated board takes, bandwidths in bytes per second, 0 is unlimited */
+struct k230_emulator_model {
+  double usb_bandwidth;
+  uint64_t usb_latency_us;    /* per bulk or control transfer */
+  uint64_t command_us;        /* the loader handling one command */
+
+  double read_bandwidth;
+  double write_bandwidth;
+  double erase_bandwidth;
+};
+
+#define K230_EMULATOR_FAULT_OFF (UINT64_MAX)
+
+struct k230_emulator_faults {
+  size_t brom_max_page;       /* BROM pages longer than this stall the endpoint, 0 takes any */
+  size_t brom_bad_page;       /* BROM pages longer than this go through but are stored wrong, 0 none */
+
+  /* a medium offset, the write, erase or read session that reaches it fails */
+  uint64_t write_error_at;
+  uint64_t erase_error_at;
+  uint64_t read_error_at;
+
+  unsigned int in_timeout_every;  /* every n-th IN chunk of a read times out once, 0 never */
+  unsigned int in_race_every;     /* every n-th command response completes its read as that read times out, 0 never */
+  unsigned int in_stall_every;    /* every n-th IN chunk of a read comes in_stall_ms late, 0 never */
+  uint64_t in_stall_ms;
+  bool write_protect;
+};
+
+struct k230_emulator_config {
+  enum KBurnMediumType medium;
+
+  uint64_t capacity;
+  uint64_t blk_size;
+  uint64_t erase_size;
+
+  std::string backing_file;   /* sparse, created when missing, sized to capacity */
+
+  uint64_t out_chunk_size;    /* chunk sizes DEV_PROBE reports */
+  uint64_t in_chunk_size;
+
+  uint64_t reenumerate_ms;    /* off the bus between PROG_START and the loader */
+  uint64_t loader_boot_ms;    /* then the loader ignores commands this long */
+
+  struct k230_emulator_model model;
+  struct k230_emulator_faults faults;
+};
+
+/* a board with `medium` and the timing typical for it, no faults */
+KBURN_API struct k230_emulator_config k230_emulator_default_config(enum KBurnMediumType medium);
+
+/*
+ * Overrides from "key=value,..." (capacity, blk_size, erase_size, out_chunk,
+ * in_chunk, reenumerate_ms, loader_boot_ms, usb_mibps, usb_latency_us,
+ * command_us, read_mibps, write_mibps, erase_mibps, brom_max_page, brom_bad_page,
+ * write_error_at, erase_error_at, read_error_at, in_timeout_every,
+ * in_race_every, in_stall_every, in_stall_ms, wp and instant, which drops all timing). Sizes and offsets take k/m/g suffixes,
+ * the *_mibps bandwidths are in MiB/s.
+ */
+KBURN_API bool k230_emulator_parse_options(const std::string &options, struct k230_emulator_config &config);
+
+/*
+ * A K230 in software, the BootROM until a loader was uploaded and started,
+ * then the kburn loader with its medium in the backing file. It runs on the
+ * caller's thread inside the transfers: a transfer takes as long as the model
+ * says the board would, by a virtual clock that only sleeps once it runs
+ * ahead of the real one.
+ */
+class KBURN_API K230Emulator : public KBurnUsbTransport {
+public:
+  explicit K230Emulator(const struct k230_emulator_config &config);
+  ~K230Emulator();
+
+  bool is_valid() const { return nullptr != medium_; }
+  const struct k230_emulator_config &config() const { return config_; }
+
+  bool present(void) override;
+
+  // not a revision a real board reports, what is learnt about the emulator stays with it
+  uint16_t bcd_device(void) override { return 0xEEEE; }
+  void bulk_endpoints(int &ep_in, uint16_t &in_mps, int &ep_out, uint16_t &out_mps) override;
+
+  int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                       uint8_t *data, uint16_t length, unsigned int timeout_ms) override;
+  int bulk_transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred,
+                    unsigned int timeout_ms) override;
+  int clear_halt(uint8_t endpoint) override;
+
+  std::unique_ptr<KBurnBulkPipe> bulk_pipe(void) override;
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  enum stage {
+    STAGE_BROM,
+    STAGE_LOADER,
+  };
+
+  enum session {
+    SESSION_IDLE,
+    SESSION_WRITE,
+    SESSION_READ,
+    SESSION_FAILED,   /* takes no data until its error message was read */
+  };
+
+  struct response {
+    clock::time_point ready_at;
+    std::vector<uint8_t> bytes;
+    bool time_out_once;
+    bool race;          /* handed over with LIBUSB_ERROR_TIMEOUT, as if it made it just as the read gave up */
+  };
+
+  class medium;
+  class usb_pipe;
+
+  struct k230_emulator_config config_;
+  std::unique_ptr<medium> medium_;
+
+  std::mutex lock_;
+
+  enum stage stage_ = STAGE_BROM;
+  clock::time_point present_at_;      /* back on the bus after a re-enumeration */
+  clock::time_point ready_at_;        /* the loader takes commands */
+  clock::time_point bus_free_;
+  clock::time_point medium_free_;
+  clock::time_point buffer_free_;     /* the loader has a buffer for the next write chunk */
+
+  uint32_t load_address_ = 0;
+  uint64_t uploaded_ = 0;
+  size_t largest_page_ = 0;         /* of the upload since the last data address */
+  bool out_halted_ = false;
+
+  bool probed_ = false;
+  enum session session_ = SESSION_IDLE;
+  uint64_t session_offset_ = 0;
+  uint64_t session_size_ = 0;       /* bytes on the bus */
+  uint64_t session_done_ = 0;
+  uint64_t session_written_ = 0;    /* bytes on the medium, less than done with oob */
+  uint64_t session_page_ = 0;       /* nand page with oob, 0 for plain data */
+  uint64_t session_page_data_ = 0;
+  uint64_t in_chunks_ = 0;
+  uint64_t responses_made_ = 0;
+
+  std::deque<struct response> responses_;
+  std::vector<uint8_t> page_buffer_;
+
+  bool present_locked(void) const { return clock::now() >= present_at_; }
+
+  clock::time_point bus_transfer(size_t bytes, clock::time_point not_before);
+  clock::time_point medium_busy(clock::time_point from, uint64_t bytes, double bandwidth);
+  void wait_until(clock::time_point when);
+  int time_out(unsigned int timeout_ms);
+
+  // `last` is false for a slice of a longer wait, that one only ends when the transfer times out
+  int transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout_ms, bool last);
+
+  void reset_loader(void);
+
+  int brom_bulk_out(const uint8_t *data, int length, int *transferred);
+
+  int loader_bulk_out(const uint8_t *data, int length, int *transferred, unsigned int timeout_ms);
+  int loader_bulk_in(uint8_t *data, int length, int *transferred, unsigned int timeout_ms, bool last);
+
+  void command(const uint8_t *cbw, int length, clock::time_point at);
+  void session_data(const uint8_t *data, size_t length, clock::time_point at);
+  bool session_write(uint64_t offset, const uint8_t *data, size_t length, clock::time_point at);
+  void next_read_chunk(void);
+
+  void respond(uint16_t cmd, uint16_t result, const void *data, size_t size, clock::time_point ready_at);
+  void respond_error(uint16_t cmd, const std::string &msg, clock::time_point ready_at);
+};
+
+}; // namespace K230
+
+}; // namespace Kendryte_Burning_Tool
@@ -3,7 +3,10 @@
 #include <cstdint>
 #include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 
 #include <libusb.h>
 
@@ -55,8 +58,12 @@ struct kburn_usb_dev_info {
   char path[KBURN_USB_PATH_BUFERR_SIZE];
 };
 
+class KBurnUsbTransport;
+
 struct kburn_usb_node {
   struct libusb_device_handle *handle;
+  /* set for emulated devices, their transfers go through it instead of handle */
+  KBurnUsbTransport *transport = nullptr;
 
   struct kburn_usb_dev_info info;
 
@@ -115,13 +122,25 @@ public:
 
   bool can_detach() { return usb_can_detach_kernel_driver; };
 
+  // probed device types, valid until the device re-enumerates and gets a new address
+  bool cached_dev_type(uint32_t key, enum kburn_usb_dev_type &type);
+  void cache_dev_type(uint32_t key, enum kburn_usb_dev_type type);
+  // addresses are reused once a device is gone, its type must not outlive it
+  void forget_dev_type(uint32_t key);
+  void retain_dev_types(const std::set<uint32_t> &present);
+
 private:
   static KBurn *_instance;
 
+  std::mutex dev_type_lock;
+  std::map<uint32_t, enum kburn_usb_dev_type> dev_type_cache;
+
   struct libusb_context *usb_ctx;
   bool usb_can_detach_kernel_driver = false;
 };
 
+class KBurnImageSource;
+
 class KBURN_API KBurner {
 public:
   using progress_fn_t = std::function<void(void *ctx, size_t current, size_t totoal)>;
@@ -142,7 +161,8 @@ public:
   }
 
   virtual bool write(const void *data, size_t size, uint64_t address) = 0;
-  virtual bool write_stream(std::ifstream& file_stream, size_t size, uint64_t address, uint64_t max, uint64_t flag) = 0;
+  virtual bool write_stream(KBurnImageSource &source, size_t size, uint64_t address, uint64_t max, uint64_t flag) = 0;
+  bool write_stream(std::ifstream& file_stream, size_t size, uint64_t address, uint64_t max, uint64_t flag);
 
 protected:
   struct kburn_usb_node *dev_node;
@@ -152,7 +172,7 @@ protected:
   void *progress_user_ctx = NULL;
   progress_fn_t progress_fn_ = default_progress;
 
-  void log_progress(int current, size_t total) {
+  void log_progress(size_t current, size_t total) {
     progress_fn_(progress_user_ctx, current, total);
   }
 
@@ -199,8 +219,19 @@ KBURN_API int spdlog_get_log_level(void);
 KBURN_API void spdlog_log(const char *msg, spdlog::level::level_enum level = spdlog::level::level_enum::info);
 KBURN_API void spdlog_set_user_logger(std::function<void(int, const std::string &)> callback);
 
-KBURN_API KBurnUSBDeviceList *list_usb_device_with_vid_pid(uint16_t vid = 0x29f1,
-                                                 uint16_t pid = 0x0230);
+// with `path` set only the device on that bus-port is opened and probed
+KBURN_API std::unique_ptr<KBurnUSBDeviceList> list_usb_device_with_vid_pid(uint16_t vid = 0x29f1,
+                                                                    uint16_t pid = 0x0230,
+                                                                    const char *path = nullptr);
+
+/*
+ * Wait until a device shows up on `path` (any port when nullptr) and probes as
+ * `type` (any type with KBURN_USB_DEV_INVALID). Woken by libusb hotplug events
+ * where the platform has them, polls otherwise. timeout_ms < 0 waits forever.
+ */
+KBURN_API bool wait_usb_device_with_vid_pid(struct kburn_usb_dev_info &info, const char *path,
+                                            enum kburn_usb_dev_type type, int timeout_ms = -1,
+                                            uint16_t vid = 0x29f1, uint16_t pid = 0x0230);
 
 KBURN_API struct kburn_usb_node *open_usb_dev_with_info(struct kburn_usb_dev_info &info);
 KBURN_API void close_usb_dev(struct kburn_usb_node *node);
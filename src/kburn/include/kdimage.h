@@ -10,12 +10,18 @@
 #include <stdexcept>
 #include <vector>
 
-#include "picosha2.h"
+#include "decompress_source.h"
+#include "image_source.h"
+#include "part_cache.h"
+#include "sha256.h"
 
 namespace Kendryte_Burning_Tool {
 #define KDIMG_HADER_MAGIC   (0x27CB8F93)
 #define KDIMG_PART_MAGIC    (0x91DF6DA4)
 
+/* first header version whose parts may be stored compressed */
+#define KDIMG_VERSION_COMPRESSION   (0x03)
+
 struct alignas(512) kd_img_hdr_t {
     uint32_t img_hdr_magic;
     uint32_t img_hdr_crc32;
@@ -45,6 +51,11 @@ struct alignas(256) kd_img_part_t {
 
     char part_name[32];
 
+    // version 3 and later, zero before. part_content_size and the SHA-256 cover
+    // the decompressed content, the image holds part_comp_size bytes of enum kburn_compression
+    uint32_t part_comp_type;
+    uint32_t part_comp_size;
+
     // Overload the equality operator
     bool operator==(const kd_img_part_t &other) const {
         return part_offset == other.part_offset &&
@@ -71,6 +82,54 @@ struct KburnImageItem_t {
 
 	std::string fileName;
 	uint32_t fileSize;
+
+    // the part lives in the file named by fileName, the .kdimg or its entry in
+    // the part cache, contentSize bytes at contentOffset followed by 0xFF up to fileSize
+    bool fromImage = false;
+    uint64_t contentOffset = 0;
+    uint64_t contentSize = 0;
+    uint8_t contentSha256[32] = {};
+
+    // contentSize is what compressedSize bytes at contentOffset decompress to
+    enum kburn_compression compression = KBURN_COMPRESSION_NONE;
+    uint64_t compressedSize = 0;
+
+    uint64_t storedSize() const { return (KBURN_COMPRESSION_NONE == compression) ? contentSize : compressedSize; }
+};
+
+/* one part of a .kdimg, read in place, the SHA-256 is checked by verify() */
+class KBURN_API KBurnKdImagePartSource : public KBurnImageSource {
+public:
+    explicit KBurnKdImagePartSource(const struct KburnImageItem_t &item);
+
+    bool is_open() const {
+        return image_.is_open() && (item_.contentOffset + item_.storedSize() <= image_.size()) &&
+               ((KBURN_COMPRESSION_NONE == item_.compression) || (content_ && content_->is_valid()));
+    }
+
+    uint64_t size() const override { return item_.fileSize; }
+    const uint8_t *view(uint64_t offset, size_t length) override;
+    size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+    bool digests(void) const override { return true; }
+    void digest(uint64_t offset, const void *data, size_t length) override;
+    bool verify(void) override;
+
+private:
+    struct KburnImageItem_t item_;
+    KBurnFileImageSource image_;
+
+    // compressed parts are decoded while they are read, the stored bytes are a range of the image
+    std::unique_ptr<KBurnSubImageSource> stored_;
+    std::unique_ptr<KBurnDecompressSource> content_;
+
+    // content passed to digest() in order is hashed on the way, verify() covers the rest
+    KBurnSha256 sha256_;
+    uint64_t hashed_ = 0;
+    bool verified_ = false;
+
+    void hash(uint64_t offset, const void *data, size_t length);
+    size_t read_content(uint64_t offset, void *buffer, size_t length);
 };
 
 class KBURN_API KburnImageItemList {
@@ -136,27 +195,22 @@ private:
 
 class SHA256 {
 public:
-    SHA256() {
-        // Initialize the hash256_one_by_one object
-        hasher_.init();
-    }
+    SHA256() {}
 
     void update(const void *data, size_t length) {
-        // Update the hash with new data
-        const unsigned char *byteData = reinterpret_cast<const unsigned char*>(data);
-        hasher_.process(byteData, byteData + length);
+        // Update the hash with new data, on the fastest backend the CPU has
+        hasher_.update(data, length);
     }
 
     std::string final() {
         // Finalize the hash and return the result
-        hasher_.finish();
-        return get_hash_hex_string(hasher_);
+        return hasher_.final_hex();
     }
 
     static constexpr uint32_t SHA256_DIGEST_LENGTH = 32;
 
 private:
-    picosha2::hash256_one_by_one hasher_; // Incremental SHA-256 hasher
+    KBurnSha256 hasher_; // Incremental SHA-256 hasher
 };
 
 class KBURN_API KburnKdImage {
@@ -198,7 +252,14 @@ public:
         }
         return max;
     }
-    KburnImageItemList *items(void);
+    /* parts are read from the image in place, `extract` copies them to the part cache first */
+    KburnImageItemList *items(bool extract = false);
+
+    /* where extracted parts are kept, the default directory and size when never set */
+    void set_cache(const std::string &dir, uint64_t max_size) {
+        _cache_dir = dir;
+        _cache_size = max_size;
+    }
 
     static KburnKdImage *instance();
     static void deleteInstance();
@@ -212,23 +273,30 @@ private:
     std::ifstream _image_file;
     KburnImageItemList _items;
 
+    std::string _cache_dir;
+    uint64_t _cache_size = KBURN_PART_CACHE_DEFAULT_SIZE;
+
     struct kd_img_hdr_t _header;
     std::vector<struct kd_img_part_t> _curr_parts;
-    std::vector<struct kd_img_part_t> _last_parts;
 private:
     static void createInstance();
 
     bool parse_parts(void);
     bool extract_parts(void);
-    void get_parts_from_temp(void);
-    void convert_parts_to_items();
+    bool convert_parts_to_ranges(void);
+    bool extract_part(const struct kd_img_part_t &part, KBurnPartCache &cache,
+                      KBurnImageSource &image, std::vector<char> &buffer, struct KburnImageItem_t &item);
+    void convert_part_to_item(const struct kd_img_part_t &part, struct KburnImageItem_t &item);
 
     void dump_header(void);
     void dump_parts(std::vector<struct kd_img_part_t> parts);
 };
 
-KBURN_API KburnImageItemList *get_kdimage_items(const std::string &image_path);
+KBURN_API KburnImageItemList *get_kdimage_items(const std::string &image_path, bool extract = false);
 
 KBURN_API size_t get_kdimage_max_offset(void);
 
+// empty `dir` keeps the default, KBurnPartCache::default_dir()
+KBURN_API void set_kdimage_cache(const std::string &dir, uint64_t max_size = KBURN_PART_CACHE_DEFAULT_SIZE);
+
 }; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "kburn.h"
+#include "sha256.h"
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+#define KBURN_PART_CACHE_DEFAULT_SIZE   (4ULL * 1024 * 1024 * 1024)
+
+/*
+ * Extracted partitions, one file per unique content named by its SHA-256 and
+ * shared by every image and every process using the same directory. Entries
+ * are written under a private name and renamed in place once their hash
+ * checked out, so a name that exists always holds the right bytes. Lookups,
+ * publishing and eviction take a lock file in the directory; the least
+ * recently used entries go first once the cache grows past max_size. Entries
+ * returned by lookup() or publish() stay pinned until the process exits, no
+ * process evicts them in between.
+ */
+class KBURN_API KBurnPartCache {
+public:
+  /* appends `length` bytes to the entry being published, false aborts */
+  using write_fn_t = std::function<bool(const void *data, size_t length)>;
+  /* produces the content of an entry through `write` */
+  using fill_fn_t = std::function<bool(const write_fn_t &write)>;
+
+  explicit KBurnPartCache(const std::filesystem::path &dir, uint64_t max_size = KBURN_PART_CACHE_DEFAULT_SIZE);
+
+  bool is_open() const { return is_open_; }
+  const std::filesystem::path &dir() const { return dir_; }
+
+  /* the entry holding `size` bytes hashing to `sha256`, empty when not cached; a hit counts as a use */
+  std::filesystem::path lookup(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE], uint64_t size);
+
+  /* fill a new entry, it only becomes visible when the content hashes to `sha256` */
+  std::filesystem::path publish(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE], uint64_t size, const fill_fn_t &fill);
+
+  /* drop the least recently used entries until the cache fits, entries in `keep` stay */
+  void evict(const std::vector<std::filesystem::path> &keep = {});
+
+  static std::filesystem::path default_dir(void);
+
+  /* a name next to `path` no other thread or process uses, for writing before a rename */
+  static std::filesystem::path private_path(const std::filesystem::path &path);
+
+private:
+  std::filesystem::path dir_;
+  uint64_t max_size_;
+  bool is_open_ = false;
+
+  std::filesystem::path entry_path(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE]) const;
+  std::filesystem::path temp_path(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE]) const;
+};
+
+}; // namespace Kendryte_Burning_Tool
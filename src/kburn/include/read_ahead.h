@@ -0,0 +1,178 @@
+#pragma once
+
+#include "kburn.h"
+#include "image_source.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+struct kburn_chunk {
+  uint8_t *data;
+  size_t size;
+  uint64_t offset;
+  uint64_t index;
+};
+
+struct kburn_stream_stats {
+  double reader_busy_sec;   /* time spent producing chunks */
+  double reader_stall_sec;  /* producer waited for a free buffer (USB bound) */
+  double sender_stall_sec;  /* consumer waited for a filled buffer (source bound) */
+  double digest_stall_sec;  /* consumer waited for the checksum of sent chunks (hash bound) */
+  bool active;              /* a read ahead or prefetch stage ran, the times above are meaningful */
+};
+
+/*
+ * Bounded ring of chunk buffers filled by a reader thread ahead of the USB
+ * stage. Chunks are handed out and must be released strictly in order; the
+ * reader blocks once every buffer is filled or still owned by the consumer.
+ */
+class KBURN_API KBurnReadAhead {
+public:
+  /* fill `size` bytes of `buffer` with the data at `offset`, false aborts */
+  using fill_fn_t = std::function<bool(uint8_t *buffer, size_t size, uint64_t offset)>;
+
+  KBurnReadAhead(size_t chunk_size, uint64_t total_size, unsigned int depth, fill_fn_t fill_fn);
+  ~KBurnReadAhead();
+
+  void start(void);
+  void cancel(void);
+
+  /* next chunk in order, false on end of stream, reader failure or cancel */
+  bool acquire(struct kburn_chunk &chunk);
+  /* give back the oldest chunk not yet released */
+  void release(void);
+
+  bool failed() const { return failed_; }
+
+  struct kburn_stream_stats stats(void);
+
+private:
+  enum slot_state { SLOT_FREE, SLOT_FILLING, SLOT_FULL, SLOT_OWNED };
+
+  struct slot {
+    std::vector<uint8_t> buffer;
+    enum slot_state state = SLOT_FREE;
+    size_t size = 0;
+    uint64_t offset = 0;
+  };
+
+  size_t chunk_size_;
+  uint64_t total_size_;
+  uint64_t total_chunks_;
+  fill_fn_t fill_fn_;
+
+  std::vector<struct slot> slots_;
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::thread reader_;
+
+  bool started_ = false;
+  bool cancelled_ = false;
+  bool failed_ = false;
+
+  uint64_t next_acquire_ = 0;
+  uint64_t next_release_ = 0;
+
+  struct kburn_stream_stats stats_ = {};
+
+  void reader_main(void);
+};
+
+/*
+ * The read ahead of mapped sources: a reader thread faults the mapped pages
+ * in ahead of the USB stage, which then sends them in place. The reader stays
+ * at most `window` bytes ahead of what was consumed.
+ */
+class KBURN_API KBurnPrefetch {
+public:
+  KBurnPrefetch(const uint8_t *data, uint64_t size, uint64_t window);
+  ~KBurnPrefetch();
+
+  void start(void);
+  void cancel(void);
+
+  /* wait until [0, end) was faulted in, returns early on cancel */
+  void wait_ready(uint64_t end);
+  /* the bytes before `offset` are off the bus, the reader may move on */
+  void consumed(uint64_t offset);
+
+  struct kburn_stream_stats stats(void);
+
+private:
+  const uint8_t *data_;
+  uint64_t size_;
+  uint64_t window_;
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::thread reader_;
+
+  bool started_ = false;
+  bool cancelled_ = false;
+
+  uint64_t ready_ = 0;
+  uint64_t consumed_ = 0;
+
+  struct kburn_stream_stats stats_ = {};
+
+  void reader_main(void);
+};
+
+/*
+ * Feeds the chunks handed to the USB stage to source.digest() on a helper
+ * thread, in order, so the checksum is computed while the data is on the bus.
+ * A chunk buffer must stay valid until completed_chunks() has moved past it.
+ * Sources without a checksum make every call a no-op.
+ */
+class KBURN_API KBurnDigestStage {
+public:
+  explicit KBurnDigestStage(KBurnImageSource &source);
+  ~KBurnDigestStage();
+
+  bool active() const { return active_; }
+
+  /* `size` may be short of the chunk, or 0, where the chunk is padding */
+  void push(const uint8_t *data, size_t size, uint64_t offset);
+
+  /* wait until at least `chunks` chunks were digested */
+  void wait_completed(uint64_t chunks);
+  uint64_t completed_chunks(void);
+
+  /* wait for every pushed chunk, then source.verify() */
+  bool finish(void);
+  void cancel(void);
+
+  double stall_sec(void);
+
+private:
+  struct pending {
+    const uint8_t *data;
+    size_t size;
+    uint64_t offset;
+  };
+
+  KBurnImageSource &source_;
+  bool active_;
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::thread hasher_;
+
+  std::deque<struct pending> pending_;
+  uint64_t pushed_ = 0;
+  uint64_t completed_ = 0;
+  bool cancelled_ = false;
+
+  double stall_sec_ = 0;
+
+  void hasher_main(void);
+};
+
+}; // namespace Kendryte_Burning_Tool
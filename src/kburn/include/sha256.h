@@ -0,0 +1,52 @@
+#pragma once
+
+#include "kburn.h"
+
+#include <string>
+
+namespace Kendryte_Burning_Tool {
+
+#define KBURN_SHA256_DIGEST_SIZE    (32)
+#define KBURN_SHA256_BLOCK_SIZE     (64)
+
+enum kburn_sha256_backend {
+  KBURN_SHA256_PICOSHA2 = 0,  /* portable, always there */
+  KBURN_SHA256_SHANI,         /* x86 SHA extensions */
+  KBURN_SHA256_ARMV8,         /* ARMv8 crypto extensions */
+  KBURN_SHA256_BACKEND_MAX,
+};
+
+KBURN_API bool kburn_sha256_backend_supported(enum kburn_sha256_backend backend);
+KBURN_API const char *kburn_sha256_backend_name(enum kburn_sha256_backend backend);
+
+/* the fastest supported backend is picked on first use, set_backend overrides it */
+KBURN_API enum kburn_sha256_backend kburn_sha256_get_backend(void);
+KBURN_API bool kburn_sha256_set_backend(enum kburn_sha256_backend backend);
+
+/*
+ * Hash `count` independent buffers. With AVX2 eight of them go through the
+ * rounds side by side, otherwise they are hashed in turn with the active
+ * backend. Lanes pay off on CPUs without SHA instructions, see kburn_bench.
+ */
+KBURN_API bool kburn_sha256_multi_supported(void);
+KBURN_API void kburn_sha256_multi(const uint8_t *const data[], const size_t size[], size_t count,
+                                  uint8_t (*digest)[KBURN_SHA256_DIGEST_SIZE]);
+
+class KBURN_API KBurnSha256 {
+public:
+  KBurnSha256() { reset(); }
+
+  void reset(void);
+  void update(const void *data, size_t length);
+  void final(uint8_t digest[KBURN_SHA256_DIGEST_SIZE]);
+
+  std::string final_hex(void);
+
+private:
+  uint32_t state_[8];
+  uint8_t block_[KBURN_SHA256_BLOCK_SIZE];
+  size_t block_used_;
+  uint64_t total_;
+};
+
+}; // namespace Kendryte_Burning_Tool
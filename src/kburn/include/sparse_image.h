@@ -0,0 +1,92 @@
+#pragma once
+
+#include "image_source.h"
+
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+#define SPARSE_HEADER_MAGIC     (0xED26FF3A)
+
+#define SPARSE_CHUNK_TYPE_RAW       (0xCAC1)
+#define SPARSE_CHUNK_TYPE_FILL      (0xCAC2)
+#define SPARSE_CHUNK_TYPE_DONT_CARE (0xCAC3)
+#define SPARSE_CHUNK_TYPE_CRC32     (0xCAC4)
+
+#pragma pack(push, 1)
+
+struct sparse_header_t {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+static_assert(sizeof(struct sparse_header_t) == 28, "Size of sparse_header_t struct is not 28 bytes!");
+
+struct sparse_chunk_header_t {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  uint32_t chunk_sz;  // in blocks of the output image
+  uint32_t total_sz;  // in bytes of the sparse file, header included
+};
+static_assert(sizeof(struct sparse_chunk_header_t) == 12, "Size of sparse_chunk_header_t struct is not 12 bytes!");
+
+#pragma pack(pop)
+
+struct kburn_image_range {
+  uint64_t offset;
+  uint64_t size;
+};
+
+/*
+ * Android sparse image, presented as the expanded image it describes. RAW
+ * chunks are read from (or viewed in) the underlying source, FILL chunks are
+ * expanded on the fly and DONT_CARE chunks read back as zeroes.
+ */
+class KBURN_API KBurnSparseImage : public KBurnImageSource {
+public:
+  explicit KBurnSparseImage(KBurnImageSource &raw);
+
+  static bool probe(KBurnImageSource &raw);
+
+  bool is_valid() const { return valid_; }
+
+  uint64_t size() const override { return size_; }
+  const uint8_t *view(uint64_t offset, size_t length) override;
+  size_t read(uint64_t offset, void *buffer, size_t length) override;
+
+  /*
+   * Ranges of the expanded image holding data, rounded out to `align` and
+   * merged when less than `min_gap` apart. Everything else is DONT_CARE.
+   */
+  std::vector<struct kburn_image_range> data_ranges(uint64_t align, uint64_t min_gap) const;
+
+  uint64_t data_size() const { return data_size_; }
+
+private:
+  struct chunk {
+    uint16_t type;
+    uint64_t offset;      // in the expanded image
+    uint64_t size;
+    uint64_t raw_offset;  // RAW data in the sparse file
+    uint32_t fill;
+  };
+
+  KBurnImageSource &raw_;
+  bool valid_ = false;
+
+  uint64_t size_ = 0;
+  uint64_t data_size_ = 0;
+
+  std::vector<struct chunk> chunks_;
+
+  bool parse(void);
+  size_t find_chunk(uint64_t offset) const;
+};
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "kburn.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+struct kburn_bulk_xfer {
+  uint8_t endpoint = 0;
+  uint8_t *buffer = nullptr;
+  int length = 0;
+  unsigned int timeout_ms = 0;
+
+  /* filled by the pipe on completion */
+  std::atomic<bool> completed{false};
+  int completed_flag = 0;   /* set before completed, what libusb checks while it waits for events */
+  int result = 0;           /* LIBUSB_SUCCESS or a libusb_error */
+  int actual_length = 0;
+
+  uint64_t tag = 0;         /* caller cookie, chunk offset for data transfers */
+  bool is_zlp = false;
+
+  void *priv = nullptr;     /* owned by the pipe */
+};
+
+/*
+ * Submission side of a pair of bulk endpoints. The libusb implementation below
+ * is used with real devices, anything implementing the same contract can stand
+ * in for the loader (completions must set xfer->completed last).
+ */
+class KBURN_API KBurnBulkPipe {
+public:
+  virtual ~KBurnBulkPipe() {}
+
+  virtual int submit(struct kburn_bulk_xfer *xfer) = 0;
+  virtual int cancel(struct kburn_bulk_xfer *xfer) = 0;
+
+  /* wait up to timeout_ms for completions, less once `wait` completed, whichever thread handled it */
+  virtual int handle_events(int timeout_ms, struct kburn_bulk_xfer *wait) = 0;
+};
+
+class KBURN_API KBurnLibusbBulkPipe : public KBurnBulkPipe {
+public:
+  explicit KBurnLibusbBulkPipe(struct libusb_device_handle *handle);
+  ~KBurnLibusbBulkPipe();
+
+  int submit(struct kburn_bulk_xfer *xfer) override;
+  int cancel(struct kburn_bulk_xfer *xfer) override;
+  int handle_events(int timeout_ms, struct kburn_bulk_xfer *wait) override;
+
+private:
+  struct libusb_device_handle *handle_;
+
+  std::vector<struct libusb_transfer *> transfers_;
+};
+
+/*
+ * Keeps up to `depth` transfers (data chunks and their ZLPs) queued on one OUT
+ * endpoint. Chunk buffers are borrowed, they must stay valid until
+ * completed_chunks() has moved past the chunk. Each transfer gets `timeout_ms`
+ * from when the ones in front of it are done, not from its submission.
+ */
+class KBURN_API KBurnBulkOutQueue {
+public:
+  KBurnBulkOutQueue(KBurnBulkPipe *pipe, uint8_t endpoint, uint16_t max_packet_size,
+                    unsigned int depth, unsigned int timeout_ms, bool send_zlp = true);
+  ~KBurnBulkOutQueue();
+
+  bool submit(const void *data, size_t size, uint64_t tag);
+
+  /* wait until at least `chunks` chunks completed */
+  bool wait_completed(uint64_t chunks);
+  bool drain(void);
+
+  void abort(void);
+
+  uint64_t submitted_chunks() const { return submitted_chunks_; }
+  uint64_t completed_chunks() const { return completed_chunks_; }
+  uint64_t completed_bytes() const { return completed_bytes_; }
+
+  bool failed() const { return failed_; }
+  uint64_t failed_tag() const { return failed_tag_; }
+  int failed_result() const { return failed_result_; }
+
+private:
+  KBurnBulkPipe *pipe_;
+
+  uint8_t endpoint_;
+  uint16_t max_packet_size_;
+  unsigned int timeout_ms_;
+  bool send_zlp_;
+
+  std::vector<struct kburn_bulk_xfer> slots_;
+  std::vector<size_t> free_slots_;
+  std::deque<size_t> inflight_;
+
+  uint64_t submitted_chunks_ = 0;
+  uint64_t completed_chunks_ = 0;
+  uint64_t completed_bytes_ = 0;
+
+  bool failed_ = false;
+  uint64_t failed_tag_ = 0;
+  int failed_result_ = 0;
+
+  // when the transfer at the head became the head, and whether it was cancelled for its timeout
+  std::chrono::steady_clock::time_point head_since_;
+  bool head_timed_out_ = false;
+
+  bool queue(uint8_t *data, int length, uint64_t tag, bool is_zlp);
+  bool reap(void);
+  void fail(struct kburn_bulk_xfer *xfer);
+};
+
+/*
+ * Keeps up to `depth` reads queued on one IN endpoint, each into its own
+ * buffer. Completions are consumed oldest first; the buffer of the front
+ * transfer stays valid until pop() hands its slot back.
+ */
+class KBURN_API KBurnBulkInQueue {
+public:
+  KBurnBulkInQueue(KBurnBulkPipe *pipe, uint8_t endpoint, unsigned int depth,
+                   size_t buffer_size, unsigned int timeout_ms);
+  ~KBurnBulkInQueue();
+
+  bool submit(int length, uint64_t tag);
+
+  /* wait for the oldest transfer, nullptr if nothing is queued */
+  struct kburn_bulk_xfer *front(void);
+  void pop(void);
+
+  void abort(void);
+
+  size_t inflight() const { return inflight_.size(); }
+  bool full() const { return free_slots_.empty(); }
+
+private:
+  KBurnBulkPipe *pipe_;
+
+  uint8_t endpoint_;
+  unsigned int timeout_ms_;
+
+  std::vector<struct kburn_bulk_xfer> slots_;
+  std::vector<std::vector<uint8_t>> buffers_;
+  std::vector<size_t> free_slots_;
+  std::deque<size_t> inflight_;
+};
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "kburn.h"
+#include "usb_async.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Kendryte_Burning_Tool {
+
+/*
+ * A device reached without libusb, such as the K230 emulator. A node that
+ * carries one sends every transfer of the burners through it, nodes without
+ * go to libusb as before. Return values follow the libusb calls they stand
+ * in for.
+ */
+class KBURN_API KBurnUsbTransport {
+public:
+  virtual ~KBurnUsbTransport() {}
+
+  /* false while the device is off the bus, e.g. re-enumerating */
+  virtual bool present(void) = 0;
+
+  virtual uint16_t bcd_device(void) = 0;
+  /* the bulk endpoints of interface 0 and their max packet sizes */
+  virtual void bulk_endpoints(int &ep_in, uint16_t &in_mps, int &ep_out, uint16_t &out_mps) = 0;
+
+  virtual int control_transfer(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                               uint8_t *data, uint16_t length, unsigned int timeout_ms) = 0;
+  virtual int bulk_transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred,
+                            unsigned int timeout_ms) = 0;
+  virtual int clear_halt(uint8_t endpoint) = 0;
+
+  /* asynchronous transfers on the same endpoints */
+  virtual std::unique_ptr<KBurnBulkPipe> bulk_pipe(void) = 0;
+};
+
+/* the transfers of a node, through its transport when it has one and libusb otherwise */
+KBURN_API int kburn_usb_control_transfer(struct kburn_usb_node *node, uint8_t request_type, uint8_t request,
+                                         uint16_t value, uint16_t index, uint8_t *data, uint16_t length,
+                                         unsigned int timeout_ms);
+KBURN_API int kburn_usb_bulk_transfer(struct kburn_usb_node *node, uint8_t endpoint, uint8_t *data, int length,
+                                      int *transferred, unsigned int timeout_ms);
+KBURN_API int kburn_usb_clear_halt(struct kburn_usb_node *node, uint8_t endpoint);
+KBURN_API std::unique_ptr<KBurnBulkPipe> kburn_usb_bulk_pipe(struct kburn_usb_node *node);
+KBURN_API bool kburn_usb_bcd_device(struct kburn_usb_node *node, uint16_t &bcd_device);
+
+/*
+ * Emulated devices are listed, waited for and opened like the ones on the
+ * bus, under their own `path` (at most KBURN_USB_PATH_BUFERR_SIZE - 1 chars).
+ */
+KBURN_API bool kburn_add_emulated_device(const std::string &path, uint16_t vid, uint16_t pid,
+                                         std::shared_ptr<KBurnUsbTransport> transport);
+KBURN_API void kburn_remove_emulated_devices(void);
+
+struct kburn_emulated_device {
+  struct kburn_usb_dev_info info;   /* type is not probed */
+  std::shared_ptr<KBurnUsbTransport> transport;
+};
+
+/* the emulated devices matching vid, pid and, when given, path that are on the bus now */
+std::vector<struct kburn_emulated_device> kburn_emulated_devices(uint16_t vid, uint16_t pid, const char *path);
+bool kburn_has_emulated_devices(void);
+
+}; // namespace Kendryte_Burning_Tool
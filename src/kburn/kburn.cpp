@@ -1,13 +1,20 @@
 #include "kburn.h"
+#include "image_source.h"
+#include "usb_transport.h"
 
 #include "3rd-party/libusb-cmake/libusb/libusb/libusb.h"
 #include "k230/kburn_k230.h"
 
 #include "spdlog/spdlog.h"
 
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
 #include <spdlog/common.h>
 #include <sys/types.h>
 
@@ -126,11 +133,53 @@ void KBurn::deleteInstance() {
   KBurn::_instance = NULL;
 }
 
+bool KBurn::cached_dev_type(uint32_t key, enum kburn_usb_dev_type &type) {
+  std::lock_guard<std::mutex> guard(dev_type_lock);
+
+  auto it = dev_type_cache.find(key);
+  if (it == dev_type_cache.end()) {
+    return false;
+  }
+  type = it->second;
+
+  return true;
+}
+
+void KBurn::cache_dev_type(uint32_t key, enum kburn_usb_dev_type type) {
+  std::lock_guard<std::mutex> guard(dev_type_lock);
+
+  dev_type_cache[key] = type;
+}
+
+void KBurn::forget_dev_type(uint32_t key) {
+  std::lock_guard<std::mutex> guard(dev_type_lock);
+
+  dev_type_cache.erase(key);
+}
+
+void KBurn::retain_dev_types(const std::set<uint32_t> &present) {
+  std::lock_guard<std::mutex> guard(dev_type_lock);
+
+  for (auto it = dev_type_cache.begin(); it != dev_type_cache.end();) {
+    if (present.count(it->first)) {
+      ++it;
+    } else {
+      it = dev_type_cache.erase(it);
+    }
+  }
+}
+
 KBurner::~KBurner()
 {
   close_usb_dev(dev_node);
 }
 
+bool KBurner::write_stream(std::ifstream& file_stream, size_t size, uint64_t address, uint64_t max, uint64_t flag) {
+  KBurnStreamImageSource source(file_stream);
+
+  return write_stream(source, size, address, max, flag);
+}
+
 void KBurner::default_progress(void *ctx, size_t current, size_t total) {
   (void)ctx;
 
@@ -174,28 +223,86 @@ static void usb_get_dev_path(struct libusb_device *dev, char *path_buffer) {
   snprintf(path_buffer, KBURN_USB_PATH_BUFERR_SIZE, "%d-%d", bus, port);
 }
 
-KBurnUSBDeviceList *list_usb_device_with_vid_pid(uint16_t vid, uint16_t pid) {
+static uint32_t usb_get_dev_key(struct libusb_device *dev) {
+  return (static_cast<uint32_t>(libusb_get_bus_number(dev)) << 16) |
+         (static_cast<uint32_t>(libusb_get_port_number(dev)) << 8) |
+         static_cast<uint32_t>(libusb_get_device_address(dev));
+}
+
+/* false when the device could not be opened, its type is then unknown */
+static bool usb_probe_dev_type(struct libusb_device *dev, struct kburn_usb_dev_info &info) {
+  struct kburn_usb_node node;
+  int result;
+
+  info.type = KBURN_USB_DEV_INVALID;
+
+  for(int retry = 0; retry < 3; retry++) {
+    if(LIBUSB_SUCCESS == (result = libusb_open(dev, &node.handle))) {
+      break;
+    }
+    do_sleep(500);
+  }
+
+  if(LIBUSB_SUCCESS != result) {
+    spdlog::warn("Open usb device failed, {}({})", result, libusb_strerror(result));
+    return false;
+  }
+
+  memcpy(&node.info, &info, sizeof(info));
+
+  info.type = get_usb_dev_type_with_node(&node);
+
+  libusb_close(node.handle);
+
+  return true;
+}
+
+static void usb_probe_emulated_type(KBurnUsbTransport *transport, struct kburn_usb_dev_info &info) {
   struct kburn_usb_node node;
-  struct kburn_usb_dev_info info;
-  
-  KBurnUSBDeviceList *list = new KBurnUSBDeviceList();
+
+  node.handle = nullptr;
+  node.transport = transport;
+  memcpy(&node.info, &info, sizeof(info));
+
+  info.type = get_usb_dev_type_with_node(&node);
+}
+
+std::unique_ptr<KBurnUSBDeviceList> list_usb_device_with_vid_pid(uint16_t vid, uint16_t pid, const char *path) {
+  struct probe_entry {
+    struct libusb_device *dev;
+    uint32_t key;
+    bool cached;
+    bool opened;
+    struct kburn_usb_dev_info info;
+    std::shared_ptr<KBurnUsbTransport> transport;   /* emulated devices, never cached */
+  };
+
+  KBurn *kburn = KBurn::instance();
+  std::vector<struct probe_entry> entries;
 
   libusb_device **dev_list = NULL;
   ssize_t dev_count =
-      libusb_get_device_list(KBurn::instance()->context(), &dev_list);
+      libusb_get_device_list(kburn->context(), &dev_list);
 
   if (0 > dev_count) {
-    delete list;
-
     spdlog::warn("can not get usb device list");
 
-    return nullptr;
+    // emulated devices do not need the bus
+    if (!kburn_has_emulated_devices()) {
+      return nullptr;
+    }
+    dev_list = NULL;
+    dev_count = 0;
   }
 
+  std::set<uint32_t> present;
+
   for (ssize_t i = 0; i < dev_count; i++) {
-    int result;
     struct libusb_device *dev = dev_list[i];
     struct libusb_device_descriptor desc;
+    struct probe_entry entry;
+
+    present.insert(usb_get_dev_key(dev));
 
     if (0 > libusb_get_device_descriptor(dev, &desc)) {
       continue;
@@ -205,32 +312,75 @@ KBurnUSBDeviceList *list_usb_device_with_vid_pid(uint16_t vid, uint16_t pid) {
       continue;
     }
 
-    info.vid = desc.idVendor;
-    info.pid = desc.idProduct;
-    usb_get_dev_path(dev, info.path);
+    memset(&entry.info, 0, sizeof(entry.info));
 
-    for(int retry = 0; retry < 3; retry++) {
-      if(LIBUSB_SUCCESS == (result = libusb_open(dev, &node.handle))) {
-        break;
-      }
-      do_sleep(500);
-    }
+    entry.dev = dev;
+    entry.key = usb_get_dev_key(dev);
+    entry.opened = true;
+    entry.info.vid = desc.idVendor;
+    entry.info.pid = desc.idProduct;
+    usb_get_dev_path(dev, entry.info.path);
 
-    if(LIBUSB_SUCCESS != result) {
-      spdlog::warn("Open usb device failed, {}({})", result, libusb_strerror(result));
+    // devices on other ports may be busy with another burner, leave them alone
+    if (path && (0x00 != strncmp(path, entry.info.path, KBURN_USB_PATH_BUFERR_SIZE))) {
       continue;
-    } else {
-      memcpy(&node.info, &info, sizeof(info));
+    }
+
+    // same bus, port and address means the device did not re-enumerate since it was probed
+    entry.cached = kburn->cached_dev_type(entry.key, entry.info.type);
 
-      info.type = get_usb_dev_type_with_node(&node);
+    entries.push_back(entry);
+  }
+
+  // whatever is not on the bus any more may come back under a reused address
+  if (dev_list) {
+    kburn->retain_dev_types(present);
+  }
+
+  for (auto &device : kburn_emulated_devices(vid, pid, path)) {
+    struct probe_entry entry;
+
+    entry.dev = nullptr;
+    entry.key = 0;
+    entry.cached = false;
+    entry.opened = true;
+    entry.info = device.info;
+    entry.transport = device.transport;
+
+    entries.push_back(entry);
+  }
 
-      libusb_close(node.handle);
+  // open retries and chip info probes sleep, do all devices at once
+  std::vector<std::thread> probes;
+
+  for (auto &entry : entries) {
+    if (entry.transport) {
+      probes.emplace_back([&entry]() { usb_probe_emulated_type(entry.transport.get(), entry.info); });
+    } else if (!entry.cached) {
+      probes.emplace_back([&entry]() { entry.opened = usb_probe_dev_type(entry.dev, entry.info); });
+    }
+  }
+
+  for (auto &probe : probes) {
+    probe.join();
+  }
+
+  std::unique_ptr<KBurnUSBDeviceList> list(new KBurnUSBDeviceList());
+
+  for (auto &entry : entries) {
+    if (!entry.opened) {
+      continue;
+    }
+
+    // devices that answered nothing useful are listed as such, and probed again next time
+    if (!entry.cached && !entry.transport && (KBURN_USB_DEV_INVALID != entry.info.type)) {
+      kburn->cache_dev_type(entry.key, entry.info.type);
     }
 
     spdlog::debug("found usb device vid 0x{:04x} pid 0x{:04x} path {}",
-                  info.vid, info.pid, info.path);
+                  entry.info.vid, entry.info.pid, entry.info.path);
 
-    list->push(info);
+    list->push(entry.info);
   }
 
   libusb_free_device_list(dev_list, true);
@@ -238,11 +388,188 @@ KBurnUSBDeviceList *list_usb_device_with_vid_pid(uint16_t vid, uint16_t pid) {
   return list;
 }
 
+#define KBURN_USB_POLL_INTERVAL_MS    (500)
+#define KBURN_USB_EVENT_POLL_MS       (100)
+/* a device that just arrived may need a moment before it can be opened */
+#define KBURN_USB_ARRIVAL_RETRY       (10)
+#define KBURN_USB_ARRIVAL_RETRY_MS    (50)
+
+struct usb_arrival_waiter {
+  std::mutex lock;
+  const char *path;
+  uint64_t arrivals = 0;
+};
+
+static int LIBUSB_CALL usb_arrival_callback(libusb_context *ctx, libusb_device *dev,
+                                            libusb_hotplug_event event, void *user_data) {
+  struct usb_arrival_waiter *waiter = static_cast<struct usb_arrival_waiter *>(user_data);
+  char dev_path[KBURN_USB_PATH_BUFERR_SIZE];
+
+  (void)ctx;
+
+  // whatever gets this address next is another device, or the same one in another stage
+  if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
+    KBurn::instance()->forget_dev_type(usb_get_dev_key(dev));
+    return 0;
+  }
+
+  // runs on whichever thread handles events, only note the arrival here
+  usb_get_dev_path(dev, dev_path);
+
+  if (!waiter->path || (0x00 == strncmp(dev_path, waiter->path, KBURN_USB_PATH_BUFERR_SIZE))) {
+    std::lock_guard<std::mutex> guard(waiter->lock);
+
+    waiter->arrivals++;
+  }
+
+  return 0;
+}
+
+static bool usb_device_present(struct kburn_usb_dev_info &info, const char *path,
+                               enum kburn_usb_dev_type type, uint16_t vid, uint16_t pid) {
+  auto list = list_usb_device_with_vid_pid(vid, pid, path);
+
+  if (!list) {
+    return false;
+  }
+
+  for (auto it = list->begin(); it != list->end(); ++it) {
+    const struct kburn_usb_dev_info dev = *it;
+
+    if ((KBURN_USB_DEV_INVALID == type) || (type == dev.type)) {
+      info = dev;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool usb_emulated_device_present(struct kburn_usb_dev_info &info, const char *path,
+                                        enum kburn_usb_dev_type type, uint16_t vid, uint16_t pid) {
+  for (auto &device : kburn_emulated_devices(vid, pid, path)) {
+    struct kburn_usb_dev_info dev = device.info;
+
+    usb_probe_emulated_type(device.transport.get(), dev);
+
+    if ((KBURN_USB_DEV_INVALID == type) || (type == dev.type)) {
+      info = dev;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool wait_usb_device_with_vid_pid(struct kburn_usb_dev_info &info, const char *path,
+                                  enum kburn_usb_dev_type type, int timeout_ms,
+                                  uint16_t vid, uint16_t pid) {
+  struct libusb_context *ctx = KBurn::instance()->context();
+  auto start = std::chrono::steady_clock::now();
+
+  auto expired = [&]() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    return (0 <= timeout_ms) && (elapsed.count() > timeout_ms);
+  };
+
+  struct usb_arrival_waiter waiter;
+  libusb_hotplug_callback_handle handle;
+  bool hotplug = false;
+
+  waiter.path = path;
+
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    int r = libusb_hotplug_register_callback(ctx,
+                                             static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                                                               LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                                             LIBUSB_HOTPLUG_NO_FLAGS,
+                                             vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, usb_arrival_callback,
+                                             &waiter, &handle);
+    if (LIBUSB_SUCCESS == r) {
+      hotplug = true;
+    } else {
+      spdlog::warn("hotplug register failed, {}({}), poll for devices", r, libusb_error_name(r));
+    }
+  }
+
+  // registered before the first look, an arrival in between is not lost
+  bool found = usb_device_present(info, path, type, vid, pid);
+  bool pending = false;
+  uint64_t seen = 0;
+  auto last_look = std::chrono::steady_clock::now();
+
+  while (!found && !expired()) {
+    if (!hotplug) {
+      do_sleep(KBURN_USB_POLL_INTERVAL_MS);
+
+      found = usb_device_present(info, path, type, vid, pid);
+      continue;
+    }
+
+    struct timeval tv = {0, KBURN_USB_EVENT_POLL_MS * 1000};
+    libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+
+    bool arrived = false;
+    {
+      std::lock_guard<std::mutex> guard(waiter.lock);
+
+      arrived = (seen != waiter.arrivals);
+      seen = waiter.arrivals;
+    }
+
+    // emulated devices raise no hotplug events, their table is looked at every poll, not the bus
+    if ((found = usb_emulated_device_present(info, path, type, vid, pid))) {
+      break;
+    }
+
+    // an arrival that could not be opened yet is looked at again at polling pace
+    auto since_look = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_look);
+
+    if (!arrived && !(pending && (since_look.count() >= KBURN_USB_POLL_INTERVAL_MS))) {
+      continue;
+    }
+
+    spdlog::debug("usb device arrived on {}", path ? path : "any port");
+
+    for (int retry = 0; !found && (retry < KBURN_USB_ARRIVAL_RETRY); retry++) {
+      if (!(found = usb_device_present(info, path, type, vid, pid))) {
+        do_sleep(KBURN_USB_ARRIVAL_RETRY_MS);
+      }
+    }
+
+    pending = !found;
+    last_look = std::chrono::steady_clock::now();
+  }
+
+  if (hotplug) {
+    libusb_hotplug_deregister_callback(ctx, handle);
+  }
+
+  return found;
+}
+
 struct kburn_usb_node *open_usb_dev_with_info(struct kburn_usb_dev_info &info) {
   char dev_path[KBURN_USB_PATH_BUFERR_SIZE];
 
   struct kburn_usb_node *node = NULL;
 
+  // emulated devices are opened without libusb, nothing to claim
+  for (auto &device : kburn_emulated_devices(info.vid, info.pid, info.path)) {
+    node = new kburn_usb_node();
+
+    node->handle = nullptr;
+    node->transport = device.transport.get();
+    node->info = info;
+
+    get_usb_dev_type_with_node(node);
+
+    spdlog::debug("open emulated device vid 0x{:04x}, pid 0x{:04x}, path {}, type {}",
+                  info.vid, info.pid, info.path, static_cast<int>(node->info.type));
+
+    return node;
+  }
+
   libusb_device **dev_list = NULL;
   ssize_t dev_count =
       libusb_get_device_list(KBurn::instance()->context(), &dev_list);
@@ -0,0 +1,413 @@
+#include "part_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <set>
+
+#if defined(_WIN32)
+#include <process.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace {
+
+/* exclusive lock on <dir>/.lock, shared by threads and processes alike */
+class cache_lock {
+public:
+  explicit cache_lock(const std::filesystem::path &dir) {
+    std::filesystem::path path = dir / ".lock";
+
+#if defined(_WIN32)
+    handle_ = CreateFileW(path.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                          nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == handle_) {
+      spdlog::warn("part cache, can not open {}", path.string());
+      return;
+    }
+
+    OVERLAPPED overlapped = {};
+    locked_ = LockFileEx(handle_, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+#else
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (0 > fd_) {
+      spdlog::warn("part cache, can not open {}, {}", path.string(), strerror(errno));
+      return;
+    }
+
+    int rc;
+    while ((0 != (rc = flock(fd_, LOCK_EX))) && (EINTR == errno)) {
+    }
+    locked_ = (0 == rc);
+#endif
+
+    if (!locked_) {
+      spdlog::warn("part cache, can not lock {}", path.string());
+    }
+  }
+
+  ~cache_lock() {
+#if defined(_WIN32)
+    if (INVALID_HANDLE_VALUE != handle_) {
+      if (locked_) {
+        OVERLAPPED overlapped = {};
+        UnlockFileEx(handle_, 0, 1, 0, &overlapped);
+      }
+      CloseHandle(handle_);
+    }
+#else
+    if (0 <= fd_) {
+      if (locked_) {
+        flock(fd_, LOCK_UN);
+      }
+      ::close(fd_);
+    }
+#endif
+  }
+
+  cache_lock(const cache_lock &) = delete;
+  cache_lock &operator=(const cache_lock &) = delete;
+
+private:
+#if defined(_WIN32)
+  HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+  int fd_ = -1;
+#endif
+  bool locked_ = false;
+};
+
+static std::string sha256_hex(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE]) {
+  char hex[KBURN_SHA256_DIGEST_SIZE * 2 + 1];
+
+  for (size_t i = 0; i < KBURN_SHA256_DIGEST_SIZE; i++) {
+    snprintf(&hex[i * 2], 3, "%02x", sha256[i]);
+  }
+
+  return std::string(hex, KBURN_SHA256_DIGEST_SIZE * 2);
+}
+
+static int process_id(void) {
+#if defined(_WIN32)
+  return _getpid();
+#else
+  return getpid();
+#endif
+}
+
+/*
+ * Entries handed out by this process, each held open until it exits. A shared
+ * lock on POSIX and a handle without delete sharing on Windows keep evict() in
+ * any process from removing them before they are opened for the write.
+ */
+class entry_pins {
+public:
+  static entry_pins &get() {
+    static entry_pins pins;
+    return pins;
+  }
+
+  bool pin(const std::filesystem::path &path) {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    if (pinned_.count(path.string())) {
+      return true;
+    }
+
+#if defined(_WIN32)
+    HANDLE handle = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == handle) {
+      spdlog::warn("part cache, can not pin {}", path.string());
+      return false;
+    }
+
+    handles_.push_back(handle);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (0 > fd) {
+      spdlog::warn("part cache, can not pin {}, {}", path.string(), strerror(errno));
+      return false;
+    }
+
+    int rc;
+    while ((0 != (rc = flock(fd, LOCK_SH))) && (EINTR == errno)) {
+    }
+    if (0 != rc) {
+      spdlog::warn("part cache, can not pin {}, {}", path.string(), strerror(errno));
+      ::close(fd);
+      return false;
+    }
+
+    fds_.push_back(fd);
+#endif
+
+    pinned_.insert(path.string());
+
+    return true;
+  }
+
+  entry_pins(const entry_pins &) = delete;
+  entry_pins &operator=(const entry_pins &) = delete;
+
+private:
+  entry_pins() = default;
+
+  std::mutex lock_;
+  std::set<std::string> pinned_;
+#if defined(_WIN32)
+  std::vector<HANDLE> handles_;
+#else
+  std::vector<int> fds_;
+#endif
+};
+
+/* an entry some process pinned, called with the cache lock held */
+static bool entry_in_use(const std::filesystem::path &path) {
+#if defined(_WIN32)
+  // the pin refuses the delete, remove() finds out
+  (void)path;
+  return false;
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (0 > fd) {
+    return false;
+  }
+
+  bool in_use = (0 != flock(fd, LOCK_EX | LOCK_NB));
+
+  ::close(fd);
+
+  return in_use;
+#endif
+}
+
+/* half written entries of a process that died are removed after this long */
+constexpr auto StaleTempAge = std::chrono::hours(1);
+
+}; // namespace
+
+KBurnPartCache::KBurnPartCache(const std::filesystem::path &dir, uint64_t max_size)
+    : dir_(dir), max_size_(max_size) {
+  std::error_code ec;
+
+  std::filesystem::create_directories(dir_, ec);
+  if (ec || !std::filesystem::is_directory(dir_, ec)) {
+    spdlog::error("part cache, can not create {}, {}", dir_.string(), ec.message());
+    return;
+  }
+
+  is_open_ = true;
+}
+
+std::filesystem::path KBurnPartCache::default_dir(void) {
+  std::error_code ec;
+  std::filesystem::path temp = std::filesystem::temp_directory_path(ec);
+
+  return (ec ? std::filesystem::path(".") : temp) / "k230_flash_cache";
+}
+
+std::filesystem::path KBurnPartCache::entry_path(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE]) const {
+  return dir_ / (sha256_hex(sha256) + ".bin");
+}
+
+std::filesystem::path KBurnPartCache::temp_path(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE]) const {
+  return private_path(dir_ / sha256_hex(sha256));
+}
+
+std::filesystem::path KBurnPartCache::private_path(const std::filesystem::path &path) {
+  static std::atomic<uint32_t> sequence{0};
+  std::filesystem::path temp = path;
+
+  temp += "." + std::to_string(process_id()) + "." + std::to_string(sequence++) + ".tmp";
+
+  return temp;
+}
+
+std::filesystem::path KBurnPartCache::lookup(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE], uint64_t size) {
+  std::filesystem::path entry = entry_path(sha256);
+  std::error_code ec;
+
+  if (!is_open_) {
+    return {};
+  }
+
+  cache_lock lock(dir_);
+
+  if (!std::filesystem::is_regular_file(entry, ec) || (size != std::filesystem::file_size(entry, ec)) || ec) {
+    return {};
+  }
+
+  // the caller opens it much later, after the device wait
+  if (!entry_pins::get().pin(entry)) {
+    return {};
+  }
+
+  // the modification time is the use time, eviction goes by it
+  std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+
+  spdlog::debug("part cache, hit {}", entry.string());
+
+  return entry;
+}
+
+std::filesystem::path KBurnPartCache::publish(const uint8_t sha256[KBURN_SHA256_DIGEST_SIZE], uint64_t size,
+                                              const fill_fn_t &fill) {
+  std::filesystem::path entry = entry_path(sha256);
+  std::filesystem::path temp = temp_path(sha256);
+  std::error_code ec;
+
+  if (!is_open_) {
+    return {};
+  }
+
+  // written without the lock, nobody else knows the private name
+  std::ofstream out(temp, std::ios::binary);
+  if (!out.is_open()) {
+    spdlog::error("part cache, can not create {}", temp.string());
+    return {};
+  }
+
+  KBurnSha256 hasher;
+  uint64_t written = 0;
+
+  bool ok = fill([&](const void *data, size_t length) {
+    out.write(reinterpret_cast<const char *>(data), length);
+    hasher.update(data, length);
+    written += length;
+
+    return !out.fail();
+  });
+
+  out.close();
+  ok = ok && !out.fail();
+
+  uint8_t digest[KBURN_SHA256_DIGEST_SIZE];
+  hasher.final(digest);
+
+  if (!ok || (written != size) || (0 != memcmp(digest, sha256, sizeof(digest)))) {
+    if (ok) {
+      spdlog::error("part cache, content of {} does not match its name, {} bytes, sha256 {}", entry.filename().string(),
+                    written, sha256_hex(digest));
+    } else {
+      spdlog::error("part cache, write {} failed", temp.string());
+    }
+
+    std::filesystem::remove(temp, ec);
+    return {};
+  }
+
+  cache_lock lock(dir_);
+
+  std::filesystem::rename(temp, entry, ec);
+  if (ec) {
+    std::error_code exist_ec;
+
+    // someone else published the same content first, theirs is as good
+    std::filesystem::remove(temp, exist_ec);
+
+    if (size != std::filesystem::file_size(entry, exist_ec) || exist_ec) {
+      spdlog::error("part cache, can not publish {}, {}", entry.string(), ec.message());
+      return {};
+    }
+  }
+
+  if (!entry_pins::get().pin(entry)) {
+    return {};
+  }
+
+  spdlog::debug("part cache, published {}", entry.string());
+
+  return entry;
+}
+
+void KBurnPartCache::evict(const std::vector<std::filesystem::path> &keep) {
+  struct cache_entry {
+    std::filesystem::path path;
+    uint64_t size;
+    std::filesystem::file_time_type used;
+  };
+
+  std::vector<struct cache_entry> entries;
+  uint64_t total = 0;
+  std::error_code ec;
+
+  if (!is_open_) {
+    return;
+  }
+
+  cache_lock lock(dir_);
+
+  auto now = std::filesystem::file_time_type::clock::now();
+
+  for (const auto &dirent : std::filesystem::directory_iterator(dir_, ec)) {
+    std::error_code entry_ec;
+    const std::filesystem::path &path = dirent.path();
+
+    if (!dirent.is_regular_file(entry_ec)) {
+      continue;
+    }
+
+    auto used = std::filesystem::last_write_time(path, entry_ec);
+    uint64_t size = std::filesystem::file_size(path, entry_ec);
+    if (entry_ec) {
+      continue;
+    }
+
+    if (path.extension() == ".tmp") {
+      if ((now - used) > StaleTempAge) {
+        spdlog::debug("part cache, remove stale {}", path.string());
+        std::filesystem::remove(path, entry_ec);
+      }
+      continue;
+    }
+
+    if (path.extension() != ".bin") {
+      continue;
+    }
+
+    entries.push_back({path, size, used});
+    total += size;
+  }
+
+  if ((0x00 == max_size_) || (total <= max_size_)) {
+    return;
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const struct cache_entry &a, const struct cache_entry &b) { return a.used < b.used; });
+
+  for (const auto &entry : entries) {
+    if (total <= max_size_) {
+      break;
+    }
+
+    if (std::find(keep.begin(), keep.end(), entry.path) != keep.end()) {
+      continue;
+    }
+
+    // handed out by a process that may not have opened it yet
+    if (entry_in_use(entry.path)) {
+      continue;
+    }
+
+    // a pinned entry on Windows refuses the delete and stays
+    if (std::filesystem::remove(entry.path, ec)) {
+      spdlog::debug("part cache, evict {}, {} bytes", entry.path.string(), entry.size);
+      total -= entry.size;
+    }
+  }
+
+  spdlog::debug("part cache, {} bytes in {}", total, dir_.string());
+}
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,372 @@
+#include "read_ahead.h"
+
+#include <algorithm>
+#include <chrono>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+using stall_clock = std::chrono::steady_clock;
+
+static double seconds_since(stall_clock::time_point start) {
+  return std::chrono::duration<double>(stall_clock::now() - start).count();
+}
+
+KBurnReadAhead::KBurnReadAhead(size_t chunk_size, uint64_t total_size, unsigned int depth, fill_fn_t fill_fn)
+    : chunk_size_(chunk_size), total_size_(total_size), fill_fn_(fill_fn), slots_(depth ? depth : 1) {
+  total_chunks_ = chunk_size_ ? (total_size_ + chunk_size_ - 1) / chunk_size_ : 0;
+}
+
+KBurnReadAhead::~KBurnReadAhead() {
+  cancel();
+}
+
+void KBurnReadAhead::start(void) {
+  for (auto &slot : slots_) {
+    slot.buffer.resize(chunk_size_);
+  }
+
+  started_ = true;
+  reader_ = std::thread(&KBurnReadAhead::reader_main, this);
+}
+
+void KBurnReadAhead::cancel(void) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    cancelled_ = true;
+  }
+  cond_.notify_all();
+
+  if (reader_.joinable()) {
+    reader_.join();
+  }
+}
+
+void KBurnReadAhead::reader_main(void) {
+  for (uint64_t index = 0; index < total_chunks_; index++) {
+    struct slot &slot = slots_[index % slots_.size()];
+
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+
+      if ((SLOT_FREE != slot.state) && !cancelled_) {
+        auto start = stall_clock::now();
+        cond_.wait(guard, [&] { return (SLOT_FREE == slot.state) || cancelled_; });
+        stats_.reader_stall_sec += seconds_since(start);
+      }
+
+      if (cancelled_) {
+        return;
+      }
+      slot.state = SLOT_FILLING;
+    }
+
+    uint64_t offset = index * chunk_size_;
+    size_t size = static_cast<size_t>(std::min<uint64_t>(chunk_size_, total_size_ - offset));
+
+    auto start = stall_clock::now();
+    bool ok = fill_fn_(slot.buffer.data(), size, offset);
+    double busy = seconds_since(start);
+
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+
+      stats_.reader_busy_sec += busy;
+
+      if (!ok) {
+        spdlog::error("read ahead, fill chunk @ {} failed", offset);
+
+        failed_ = true;
+        slot.state = SLOT_FREE;
+      } else {
+        slot.size = size;
+        slot.offset = offset;
+        slot.state = SLOT_FULL;
+      }
+    }
+    cond_.notify_all();
+
+    if (!ok) {
+      return;
+    }
+  }
+}
+
+bool KBurnReadAhead::acquire(struct kburn_chunk &chunk) {
+  std::unique_lock<std::mutex> guard(lock_);
+
+  if (next_acquire_ >= total_chunks_) {
+    return false;
+  }
+
+  struct slot &slot = slots_[next_acquire_ % slots_.size()];
+
+  if ((SLOT_FULL != slot.state) && !cancelled_ && !failed_) {
+    auto start = stall_clock::now();
+    cond_.wait(guard, [&] { return (SLOT_FULL == slot.state) || cancelled_ || failed_; });
+    stats_.sender_stall_sec += seconds_since(start);
+  }
+
+  if (SLOT_FULL != slot.state) {
+    return false;
+  }
+  slot.state = SLOT_OWNED;
+
+  chunk.data = slot.buffer.data();
+  chunk.size = slot.size;
+  chunk.offset = slot.offset;
+  chunk.index = next_acquire_++;
+
+  return true;
+}
+
+void KBurnReadAhead::release(void) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    if (next_release_ >= next_acquire_) {
+      return;
+    }
+    slots_[(next_release_++) % slots_.size()].state = SLOT_FREE;
+  }
+  cond_.notify_all();
+}
+
+struct kburn_stream_stats KBurnReadAhead::stats(void) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  struct kburn_stream_stats stats = stats_;
+  stats.active = started_;
+
+  return stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/* the reader faults in this much per step, small enough to keep the sender close behind */
+#define KBURN_PREFETCH_STEP (256 * 1024)
+
+/* one read per page is enough to fault it in, smaller than any page size in use */
+#define KBURN_PREFETCH_TOUCH (4096)
+
+KBurnPrefetch::KBurnPrefetch(const uint8_t *data, uint64_t size, uint64_t window)
+    : data_(data), size_(size), window_(std::max<uint64_t>(window, KBURN_PREFETCH_STEP)) {
+}
+
+KBurnPrefetch::~KBurnPrefetch() {
+  cancel();
+}
+
+void KBurnPrefetch::start(void) {
+  started_ = true;
+  reader_ = std::thread(&KBurnPrefetch::reader_main, this);
+}
+
+void KBurnPrefetch::cancel(void) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    cancelled_ = true;
+  }
+  cond_.notify_all();
+
+  if (reader_.joinable()) {
+    reader_.join();
+  }
+}
+
+void KBurnPrefetch::reader_main(void) {
+#if !defined(_WIN32)
+  const uintptr_t page_mask = ~static_cast<uintptr_t>(sysconf(_SC_PAGESIZE) - 1);
+#endif
+
+  for (uint64_t pos = 0; pos < size_;) {
+    size_t count = static_cast<size_t>(std::min<uint64_t>(KBURN_PREFETCH_STEP, size_ - pos));
+
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+
+      if (((pos + count) > (consumed_ + window_)) && !cancelled_) {
+        auto start = stall_clock::now();
+        cond_.wait(guard, [&] { return ((pos + count) <= (consumed_ + window_)) || cancelled_; });
+        stats_.reader_stall_sec += seconds_since(start);
+      }
+
+      if (cancelled_) {
+        return;
+      }
+    }
+
+    auto start = stall_clock::now();
+    const volatile uint8_t *bytes = data_ + pos;
+    uint8_t sink = 0;
+
+#if !defined(_WIN32)
+    // let the kernel start reading the whole step at once, the loads below mostly wait on it
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data_ + pos) & page_mask;
+    madvise(reinterpret_cast<void *>(begin), reinterpret_cast<uintptr_t>(data_ + pos + count) - begin, MADV_WILLNEED);
+#endif
+
+    for (size_t i = 0; i < count; i += KBURN_PREFETCH_TOUCH) {
+      sink ^= bytes[i];
+    }
+    sink ^= bytes[count - 1];
+    (void)sink;
+
+    double busy = seconds_since(start);
+    pos += count;
+
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+
+      stats_.reader_busy_sec += busy;
+      ready_ = pos;
+    }
+    cond_.notify_all();
+  }
+}
+
+void KBurnPrefetch::wait_ready(uint64_t end) {
+  std::unique_lock<std::mutex> guard(lock_);
+
+  end = std::min(end, size_);
+
+  if ((ready_ < end) && !cancelled_) {
+    auto start = stall_clock::now();
+    cond_.wait(guard, [&] { return (ready_ >= end) || cancelled_; });
+    stats_.sender_stall_sec += seconds_since(start);
+  }
+}
+
+void KBurnPrefetch::consumed(uint64_t offset) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    if (offset <= consumed_) {
+      return;
+    }
+    consumed_ = offset;
+  }
+  cond_.notify_all();
+}
+
+struct kburn_stream_stats KBurnPrefetch::stats(void) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  struct kburn_stream_stats stats = stats_;
+  stats.active = started_;
+
+  return stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBurnDigestStage::KBurnDigestStage(KBurnImageSource &source) : source_(source), active_(source.digests()) {
+  if (active_) {
+    hasher_ = std::thread(&KBurnDigestStage::hasher_main, this);
+  }
+}
+
+KBurnDigestStage::~KBurnDigestStage() {
+  cancel();
+}
+
+void KBurnDigestStage::cancel(void) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    cancelled_ = true;
+  }
+  cond_.notify_all();
+
+  if (hasher_.joinable()) {
+    hasher_.join();
+  }
+}
+
+void KBurnDigestStage::hasher_main(void) {
+  for (;;) {
+    struct pending chunk;
+
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+
+      cond_.wait(guard, [&] { return !pending_.empty() || cancelled_; });
+
+      if (cancelled_) {
+        return;
+      }
+      chunk = pending_.front();
+    }
+
+    if (chunk.size) {
+      source_.digest(chunk.offset, chunk.data, chunk.size);
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+
+      pending_.pop_front();
+      completed_++;
+    }
+    cond_.notify_all();
+  }
+}
+
+void KBurnDigestStage::push(const uint8_t *data, size_t size, uint64_t offset) {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    pushed_++;
+
+    if (!active_) {
+      completed_ = pushed_;
+      return;
+    }
+    pending_.push_back({data, size, offset});
+  }
+  cond_.notify_all();
+}
+
+void KBurnDigestStage::wait_completed(uint64_t chunks) {
+  std::unique_lock<std::mutex> guard(lock_);
+
+  if ((completed_ < chunks) && !cancelled_) {
+    auto start = stall_clock::now();
+    cond_.wait(guard, [&] { return (completed_ >= chunks) || cancelled_; });
+    stall_sec_ += seconds_since(start);
+  }
+}
+
+uint64_t KBurnDigestStage::completed_chunks(void) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  return completed_;
+}
+
+bool KBurnDigestStage::finish(void) {
+  if (!active_) {
+    return true;
+  }
+
+  uint64_t pushed;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    pushed = pushed_;
+  }
+  wait_completed(pushed);
+
+  if (completed_chunks() < pushed) {
+    return false;
+  }
+
+  return source_.verify();
+}
+
+double KBurnDigestStage::stall_sec(void) {
+  std::lock_guard<std::mutex> guard(lock_);
+
+  return stall_sec_;
+}
+
+}; // namespace Kendryte_Burning_Tool
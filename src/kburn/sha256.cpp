@@ -0,0 +1,309 @@
+#include "sha256_impl.h"
+#include "picosha2.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace Kendryte_Burning_Tool {
+
+namespace sha256_impl {
+
+const uint32_t initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+void compress_picosha2(uint32_t state[8], const uint8_t *data, size_t blocks) {
+  picosha2::word_t digest[8];
+
+  for (int i = 0; i < 8; i++) {
+    digest[i] = state[i];
+  }
+
+  for (; blocks; blocks--, data += KBURN_SHA256_BLOCK_SIZE) {
+    picosha2::detail::hash256_block(digest, data, data + KBURN_SHA256_BLOCK_SIZE);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    state[i] = static_cast<uint32_t>(digest[i]);
+  }
+}
+
+}; // namespace sha256_impl
+
+using namespace sha256_impl;
+
+static std::atomic<int> sha256_backend{-1};
+
+static compress_fn_t sha256_compress_fn(enum kburn_sha256_backend backend) {
+  switch (backend) {
+#if defined(KBURN_SHA256_X86)
+  case KBURN_SHA256_SHANI:
+    return compress_shani;
+#endif
+#if defined(KBURN_SHA256_ARM)
+  case KBURN_SHA256_ARMV8:
+    return compress_armv8;
+#endif
+  default:
+    return compress_picosha2;
+  }
+}
+
+bool kburn_sha256_backend_supported(enum kburn_sha256_backend backend) {
+  switch (backend) {
+  case KBURN_SHA256_PICOSHA2:
+    return true;
+#if defined(KBURN_SHA256_X86)
+  case KBURN_SHA256_SHANI:
+    return cpu_has_shani();
+#endif
+#if defined(KBURN_SHA256_ARM)
+  case KBURN_SHA256_ARMV8:
+    return cpu_has_armv8_sha2();
+#endif
+  default:
+    return false;
+  }
+}
+
+const char *kburn_sha256_backend_name(enum kburn_sha256_backend backend) {
+  const char *names[] = {"picosha2", "sha-ni", "armv8"};
+
+  if (backend >= KBURN_SHA256_BACKEND_MAX) {
+    return "invalid";
+  }
+
+  return names[backend];
+}
+
+enum kburn_sha256_backend kburn_sha256_get_backend(void) {
+  int backend = sha256_backend.load(std::memory_order_relaxed);
+
+  if (0 > backend) {
+    backend = KBURN_SHA256_PICOSHA2;
+
+    for (int i = KBURN_SHA256_BACKEND_MAX - 1; i > KBURN_SHA256_PICOSHA2; i--) {
+      if (kburn_sha256_backend_supported(static_cast<enum kburn_sha256_backend>(i))) {
+        backend = i;
+        break;
+      }
+    }
+
+    spdlog::debug("sha256 backend {}", kburn_sha256_backend_name(static_cast<enum kburn_sha256_backend>(backend)));
+
+    sha256_backend.store(backend, std::memory_order_relaxed);
+  }
+
+  return static_cast<enum kburn_sha256_backend>(backend);
+}
+
+bool kburn_sha256_set_backend(enum kburn_sha256_backend backend) {
+  if (!kburn_sha256_backend_supported(backend)) {
+    return false;
+  }
+
+  sha256_backend.store(backend, std::memory_order_relaxed);
+
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void KBurnSha256::reset(void) {
+  memcpy(state_, initial_state, sizeof(state_));
+  block_used_ = 0;
+  total_ = 0;
+}
+
+void KBurnSha256::update(const void *data, size_t length) {
+  const uint8_t *input = reinterpret_cast<const uint8_t *>(data);
+  compress_fn_t compress = sha256_compress_fn(kburn_sha256_get_backend());
+
+  total_ += length;
+
+  if (block_used_) {
+    size_t count = std::min(length, sizeof(block_) - block_used_);
+
+    memcpy(block_ + block_used_, input, count);
+    block_used_ += count;
+    input += count;
+    length -= count;
+
+    if (block_used_ < sizeof(block_)) {
+      return;
+    }
+
+    compress(state_, block_, 1);
+    block_used_ = 0;
+  }
+
+  // whole blocks straight from the caller's buffer
+  size_t blocks = length / KBURN_SHA256_BLOCK_SIZE;
+  if (blocks) {
+    compress(state_, input, blocks);
+
+    input += blocks * KBURN_SHA256_BLOCK_SIZE;
+    length -= blocks * KBURN_SHA256_BLOCK_SIZE;
+  }
+
+  memcpy(block_, input, length);
+  block_used_ = length;
+}
+
+void KBurnSha256::final(uint8_t digest[KBURN_SHA256_DIGEST_SIZE]) {
+  compress_fn_t compress = sha256_compress_fn(kburn_sha256_get_backend());
+  uint64_t bits = total_ * 8;
+
+  block_[block_used_++] = 0x80;
+
+  if (block_used_ > (sizeof(block_) - 8)) {
+    memset(block_ + block_used_, 0, sizeof(block_) - block_used_);
+    compress(state_, block_, 1);
+    block_used_ = 0;
+  }
+
+  memset(block_ + block_used_, 0, sizeof(block_) - 8 - block_used_);
+  for (int i = 0; i < 8; i++) {
+    block_[sizeof(block_) - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+  }
+  compress(state_, block_, 1);
+
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4 + 0] = static_cast<uint8_t>(state_[i] >> 24);
+    digest[i * 4 + 1] = static_cast<uint8_t>(state_[i] >> 16);
+    digest[i * 4 + 2] = static_cast<uint8_t>(state_[i] >> 8);
+    digest[i * 4 + 3] = static_cast<uint8_t>(state_[i]);
+  }
+
+  reset();
+}
+
+std::string KBurnSha256::final_hex(void) {
+  static const char hex[] = "0123456789abcdef";
+  uint8_t digest[KBURN_SHA256_DIGEST_SIZE];
+  std::string result;
+
+  final(digest);
+
+  for (auto byte : digest) {
+    result += hex[byte >> 4];
+    result += hex[byte & 0x0f];
+  }
+
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool kburn_sha256_multi_supported(void) {
+#if defined(KBURN_SHA256_X86)
+  return cpu_has_avx2();
+#else
+  return false;
+#endif
+}
+
+#if defined(KBURN_SHA256_X86)
+/* the blocks of one message with its padding, the last one or two come from `tail` */
+struct sha256_lane {
+  const uint8_t *data;
+  size_t full_blocks;
+  size_t total_blocks;
+  uint8_t tail[2 * KBURN_SHA256_BLOCK_SIZE];
+
+  void init(const uint8_t *msg, size_t size) {
+    size_t rest = size % KBURN_SHA256_BLOCK_SIZE;
+    size_t tail_size = (rest < (KBURN_SHA256_BLOCK_SIZE - 8)) ? KBURN_SHA256_BLOCK_SIZE : 2 * KBURN_SHA256_BLOCK_SIZE;
+    uint64_t bits = static_cast<uint64_t>(size) * 8;
+
+    data = msg;
+    full_blocks = size / KBURN_SHA256_BLOCK_SIZE;
+    total_blocks = full_blocks + tail_size / KBURN_SHA256_BLOCK_SIZE;
+
+    memset(tail, 0, sizeof(tail));
+    if (rest) {
+      memcpy(tail, msg + full_blocks * KBURN_SHA256_BLOCK_SIZE, rest);
+    }
+    tail[rest] = 0x80;
+    for (int i = 0; i < 8; i++) {
+      tail[tail_size - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+    }
+  }
+
+  const uint8_t *block(size_t index) const {
+    if (index < full_blocks) {
+      return data + index * KBURN_SHA256_BLOCK_SIZE;
+    }
+    return tail + (index - full_blocks) * KBURN_SHA256_BLOCK_SIZE;
+  }
+};
+#endif
+
+void kburn_sha256_multi(const uint8_t *const data[], const size_t size[], size_t count,
+                        uint8_t (*digest)[KBURN_SHA256_DIGEST_SIZE]) {
+#if defined(KBURN_SHA256_X86)
+  if (cpu_has_avx2()) {
+    static const uint8_t idle_block[KBURN_SHA256_BLOCK_SIZE] = {};
+
+    for (size_t base = 0; base < count; base += 8) {
+      size_t lanes = std::min<size_t>(8, count - base);
+      size_t max_blocks = 0;
+
+      uint32_t state[8][8];
+      struct sha256_lane lane[8];
+      const uint8_t *blocks[8];
+
+      for (size_t i = 0; i < 8; i++) {
+        memcpy(state[i], initial_state, sizeof(initial_state));
+        lane[i].init(data[base + std::min(i, lanes - 1)], size[base + std::min(i, lanes - 1)]);
+      }
+
+      for (size_t i = 0; i < lanes; i++) {
+        max_blocks = std::max(max_blocks, lane[i].total_blocks);
+      }
+
+      for (size_t b = 0; b < max_blocks; b++) {
+        for (size_t i = 0; i < 8; i++) {
+          blocks[i] = ((i < lanes) && (b < lane[i].total_blocks)) ? lane[i].block(b) : idle_block;
+        }
+
+        compress_avx2_x8(state, blocks);
+
+        // a lane that just took its last block is done, keep its state before it gets idle blocks
+        for (size_t i = 0; i < lanes; i++) {
+          if ((b + 1) == lane[i].total_blocks) {
+            for (int w = 0; w < 8; w++) {
+              digest[base + i][w * 4 + 0] = static_cast<uint8_t>(state[i][w] >> 24);
+              digest[base + i][w * 4 + 1] = static_cast<uint8_t>(state[i][w] >> 16);
+              digest[base + i][w * 4 + 2] = static_cast<uint8_t>(state[i][w] >> 8);
+              digest[base + i][w * 4 + 3] = static_cast<uint8_t>(state[i][w]);
+            }
+          }
+        }
+      }
+    }
+
+    return;
+  }
+#endif
+
+  // no vector lanes, one buffer after another
+  for (size_t i = 0; i < count; i++) {
+    KBurnSha256 sha256;
+
+    sha256.update(data[i], size[i]);
+    sha256.final(digest[i]);
+  }
+}
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,70 @@
+#include "sha256_impl.h"
+
+#if defined(KBURN_SHA256_ARM)
+
+#include <arm_neon.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace sha256_impl {
+
+bool cpu_has_armv8_sha2(void) {
+#if defined(_WIN32)
+  return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE);
+#elif defined(__linux__)
+  return 0x00 != (getauxval(AT_HWCAP) & HWCAP_SHA2);
+#elif defined(__APPLE__)
+  // every Apple arm64 part has them
+  return true;
+#else
+  return false;
+#endif
+}
+
+KBURN_TARGET("arch=armv8-a+crypto")
+void compress_armv8(uint32_t state[8], const uint8_t *data, size_t blocks) {
+  uint32x4_t abcd = vld1q_u32(&state[0]);
+  uint32x4_t efgh = vld1q_u32(&state[4]);
+
+  for (; blocks; blocks--, data += KBURN_SHA256_BLOCK_SIZE) {
+    uint32x4_t abcd_save = abcd;
+    uint32x4_t efgh_save = efgh;
+    uint32x4_t w[4];
+
+    for (int i = 0; i < 4; i++) {
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+    }
+
+    for (int g = 0; g < 16; g++) {
+      uint32x4_t wk = vaddq_u32(w[g % 4], vld1q_u32(&round_constants[g * 4]));
+      uint32x4_t abcd_prev = abcd;
+
+      // w[g % 4] becomes the schedule four groups ahead
+      if (g < 12) {
+        w[g % 4] = vsha256su1q_u32(vsha256su0q_u32(w[g % 4], w[(g + 1) % 4]), w[(g + 2) % 4], w[(g + 3) % 4]);
+      }
+
+      abcd = vsha256hq_u32(abcd, efgh, wk);
+      efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+    }
+
+    abcd = vaddq_u32(abcd, abcd_save);
+    efgh = vaddq_u32(efgh, efgh_save);
+  }
+
+  vst1q_u32(&state[0], abcd);
+  vst1q_u32(&state[4], efgh);
+}
+
+}; // namespace sha256_impl
+
+}; // namespace Kendryte_Burning_Tool
+
+#endif
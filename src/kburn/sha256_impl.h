@@ -0,0 +1,49 @@
+#pragma once
+
+#include "sha256.h"
+
+#if !defined(KBURN_TARGET)
+#if defined(__GNUC__) || defined(__clang__)
+#define KBURN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KBURN_TARGET(isa)
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KBURN_SHA256_X86 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define KBURN_SHA256_ARM 1
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace sha256_impl {
+
+/* compress `blocks` consecutive 64 byte blocks into state (a..h, host order) */
+using compress_fn_t = void (*)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+extern const uint32_t initial_state[8];
+extern const uint32_t round_constants[64];
+
+void compress_picosha2(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+#if defined(KBURN_SHA256_X86)
+bool cpu_has_shani(void);
+bool cpu_has_avx2(void);
+
+void compress_shani(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+/* eight states, one block each, lanes that are done still get a block to chew on */
+void compress_avx2_x8(uint32_t state[8][8], const uint8_t *const block[8]);
+#endif
+
+#if defined(KBURN_SHA256_ARM)
+bool cpu_has_armv8_sha2(void);
+
+void compress_armv8(uint32_t state[8], const uint8_t *data, size_t blocks);
+#endif
+
+}; // namespace sha256_impl
+
+}; // namespace Kendryte_Burning_Tool
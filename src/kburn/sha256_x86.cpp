@@ -0,0 +1,226 @@
+#include "sha256_impl.h"
+
+#if defined(KBURN_SHA256_X86)
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace Kendryte_Burning_Tool {
+
+namespace sha256_impl {
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+  int r[4];
+
+  __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+  for (int i = 0; i < 4; i++) {
+    regs[i] = static_cast<uint32_t>(r[i]);
+  }
+#else
+  regs[0] = regs[1] = regs[2] = regs[3] = 0;
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint32_t cpuid_max_leaf(void) {
+  uint32_t regs[4];
+
+  cpuid(0, 0, regs);
+
+  return regs[0];
+}
+
+bool cpu_has_shani(void) {
+  static const bool has = []() {
+    uint32_t leaf1[4], leaf7[4];
+
+    if (cpuid_max_leaf() < 7) {
+      return false;
+    }
+
+    cpuid(1, 0, leaf1);
+    cpuid(7, 0, leaf7);
+
+    // SHA + SSE4.1 + SSSE3
+    return (0x00 != (leaf7[1] & (1u << 29))) && (0x00 != (leaf1[2] & (1u << 19))) &&
+           (0x00 != (leaf1[2] & (1u << 9)));
+  }();
+
+  return has;
+}
+
+static uint64_t xgetbv0(void) {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  uint32_t eax, edx;
+
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+  return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+bool cpu_has_avx2(void) {
+  static const bool has = []() {
+    uint32_t leaf1[4], leaf7[4];
+
+    if (cpuid_max_leaf() < 7) {
+      return false;
+    }
+
+    cpuid(1, 0, leaf1);
+    cpuid(7, 0, leaf7);
+
+    // the OS has to save the ymm registers too
+    if ((0x00 == (leaf1[2] & (1u << 27))) || (0x06 != (xgetbv0() & 0x06))) {
+      return false;
+    }
+
+    return 0x00 != (leaf7[1] & (1u << 5));
+  }();
+
+  return has;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBURN_TARGET("sha,sse4.1,ssse3")
+void compress_shani(uint32_t state[8], const uint8_t *data, size_t blocks) {
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  // a..h to the ABEF / CDGH layout the instructions work on
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0])), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4])), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (; blocks; blocks--, data += KBURN_SHA256_BLOCK_SIZE) {
+    __m128i save0 = state0;
+    __m128i save1 = state1;
+    __m128i w[4];
+
+    for (int g = 0; g < 16; g++) {
+      __m128i msg;
+
+      if (g < 4) {
+        w[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + g * 16)), bswap);
+      } else {
+        // w[g % 4] still holds W[g - 4]
+        __m128i next = _mm_sha256msg1_epu32(w[g % 4], w[(g + 1) % 4]);
+
+        next = _mm_add_epi32(next, _mm_alignr_epi8(w[(g + 3) % 4], w[(g + 2) % 4], 4));
+        w[g % 4] = _mm_sha256msg2_epu32(next, w[(g + 3) % 4]);
+      }
+
+      msg = _mm_add_epi32(w[g % 4], _mm_loadu_si128(reinterpret_cast<const __m128i *>(&round_constants[g * 4])));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+
+    state0 = _mm_add_epi32(state0, save0);
+    state1 = _mm_add_epi32(state1, save1);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+KBURN_TARGET("avx2")
+void compress_avx2_x8(uint32_t state[8][8], const uint8_t *const block[8]) {
+  alignas(32) uint32_t words[16][8];
+  __m256i w[64];
+  __m256i s[8];
+
+  // word i of every lane side by side, big endian
+  for (int lane = 0; lane < 8; lane++) {
+    for (int i = 0; i < 16; i++) {
+      const uint8_t *p = block[lane] + i * 4;
+
+      words[i][lane] = (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+                       (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+    }
+  }
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = _mm256_load_si256(reinterpret_cast<const __m256i *>(words[i]));
+  }
+
+  for (int i = 16; i < 64; i++) {
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w[i - 15], 7), ROTR8(w[i - 15], 18)),
+                                  _mm256_srli_epi32(w[i - 15], 3));
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w[i - 2], 17), ROTR8(w[i - 2], 19)),
+                                  _mm256_srli_epi32(w[i - 2], 10));
+
+    w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0), _mm256_add_epi32(w[i - 7], s1));
+  }
+
+  for (int j = 0; j < 8; j++) {
+    s[j] = _mm256_set_epi32(static_cast<int>(state[7][j]), static_cast<int>(state[6][j]),
+                            static_cast<int>(state[5][j]), static_cast<int>(state[4][j]),
+                            static_cast<int>(state[3][j]), static_cast<int>(state[2][j]),
+                            static_cast<int>(state[1][j]), static_cast<int>(state[0][j]));
+  }
+
+  __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+  for (int i = 0; i < 64; i++) {
+    __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(e, 6), ROTR8(e, 11)), ROTR8(e, 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+    __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1),
+                                  _mm256_add_epi32(_mm256_add_epi32(ch, w[i]),
+                                                   _mm256_set1_epi32(static_cast<int>(round_constants[i]))));
+    __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(a, 2), ROTR8(a, 13)), ROTR8(a, 22));
+    __m256i maj = _mm256_xor_si256(_mm256_and_si256(a, _mm256_xor_si256(b, c)), _mm256_and_si256(b, c));
+    __m256i t2 = _mm256_add_epi32(S0, maj);
+
+    h = g;
+    g = f;
+    f = e;
+    e = _mm256_add_epi32(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = _mm256_add_epi32(t1, t2);
+  }
+
+  s[0] = _mm256_add_epi32(s[0], a);
+  s[1] = _mm256_add_epi32(s[1], b);
+  s[2] = _mm256_add_epi32(s[2], c);
+  s[3] = _mm256_add_epi32(s[3], d);
+  s[4] = _mm256_add_epi32(s[4], e);
+  s[5] = _mm256_add_epi32(s[5], f);
+  s[6] = _mm256_add_epi32(s[6], g);
+  s[7] = _mm256_add_epi32(s[7], h);
+
+  for (int j = 0; j < 8; j++) {
+    alignas(32) uint32_t out[8];
+
+    _mm256_store_si256(reinterpret_cast<__m256i *>(out), s[j]);
+    for (int lane = 0; lane < 8; lane++) {
+      state[lane][j] = out[lane];
+    }
+  }
+}
+
+#undef ROTR8
+
+}; // namespace sha256_impl
+
+}; // namespace Kendryte_Burning_Tool
+
+#endif
@@ -0,0 +1,220 @@
+#include "sparse_image.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Kendryte_Burning_Tool {
+
+KBurnSparseImage::KBurnSparseImage(KBurnImageSource &raw) : raw_(raw) {
+  valid_ = parse();
+}
+
+bool KBurnSparseImage::probe(KBurnImageSource &raw) {
+  uint32_t magic = 0;
+
+  if (sizeof(magic) != raw.read(0, &magic, sizeof(magic))) {
+    return false;
+  }
+
+  return SPARSE_HEADER_MAGIC == magic;
+}
+
+bool KBurnSparseImage::parse(void) {
+  struct sparse_header_t hdr;
+
+  if (sizeof(hdr) != raw_.read(0, &hdr, sizeof(hdr))) {
+    spdlog::error("sparse image, header truncated");
+    return false;
+  }
+
+  if ((SPARSE_HEADER_MAGIC != hdr.magic) || (1 != hdr.major_version)) {
+    spdlog::error("sparse image, bad magic {:08x} or version {}", hdr.magic, hdr.major_version);
+    return false;
+  }
+
+  if ((hdr.file_hdr_sz < sizeof(struct sparse_header_t)) ||
+      (hdr.chunk_hdr_sz < sizeof(struct sparse_chunk_header_t)) ||
+      (0x00 == hdr.blk_sz) || (0x00 != (hdr.blk_sz % 4))) {
+    spdlog::error("sparse image, bad header size {}/{} or block size {}", hdr.file_hdr_sz,
+                  hdr.chunk_hdr_sz, hdr.blk_sz);
+    return false;
+  }
+
+  uint64_t raw_offset = hdr.file_hdr_sz;
+  uint64_t out_offset = 0;
+
+  // total_chunks is untrusted, every chunk takes at least a header in the file
+  chunks_.reserve(std::min<uint64_t>(hdr.total_chunks, raw_.size() / hdr.chunk_hdr_sz));
+
+  for (uint32_t i = 0; i < hdr.total_chunks; i++) {
+    struct sparse_chunk_header_t chdr;
+
+    if (sizeof(chdr) != raw_.read(raw_offset, &chdr, sizeof(chdr))) {
+      spdlog::error("sparse image, chunk {} header truncated", i);
+      return false;
+    }
+
+    if (chdr.total_sz < hdr.chunk_hdr_sz) {
+      spdlog::error("sparse image, chunk {} size {} < header size {}", i, chdr.total_sz,
+                    hdr.chunk_hdr_sz);
+      return false;
+    }
+
+    struct chunk c;
+
+    c.type = chdr.chunk_type;
+    c.offset = out_offset;
+    c.size = static_cast<uint64_t>(chdr.chunk_sz) * hdr.blk_sz;
+    c.raw_offset = raw_offset + hdr.chunk_hdr_sz;
+    c.fill = 0;
+
+    uint64_t payload = chdr.total_sz - hdr.chunk_hdr_sz;
+
+    switch (chdr.chunk_type) {
+    case SPARSE_CHUNK_TYPE_RAW:
+      if (payload != c.size) {
+        spdlog::error("sparse image, raw chunk {} size {} != {}", i, payload, c.size);
+        return false;
+      }
+      data_size_ += c.size;
+      break;
+    case SPARSE_CHUNK_TYPE_FILL:
+      if ((sizeof(c.fill) != payload) ||
+          (sizeof(c.fill) != raw_.read(c.raw_offset, &c.fill, sizeof(c.fill)))) {
+        spdlog::error("sparse image, fill chunk {} truncated", i);
+        return false;
+      }
+      data_size_ += c.size;
+      break;
+    case SPARSE_CHUNK_TYPE_DONT_CARE:
+      break;
+    case SPARSE_CHUNK_TYPE_CRC32:
+      // checksums cover the expanded image, the medium is verified elsewhere
+      c.size = 0;
+      break;
+    default:
+      spdlog::error("sparse image, unknown chunk type {:04x} @ {}", chdr.chunk_type, i);
+      return false;
+    }
+
+    raw_offset += chdr.total_sz;
+    out_offset += c.size;
+
+    if ((0x00 != c.size) && (SPARSE_CHUNK_TYPE_DONT_CARE != c.type)) {
+      chunks_.push_back(c);
+    }
+  }
+
+  if (raw_offset > raw_.size()) {
+    spdlog::error("sparse image, truncated, need {} bytes, have {}", raw_offset, raw_.size());
+    return false;
+  }
+
+  size_ = static_cast<uint64_t>(hdr.total_blks) * hdr.blk_sz;
+
+  if (out_offset != size_) {
+    spdlog::error("sparse image, chunks cover {} bytes, header says {}", out_offset, size_);
+    return false;
+  }
+
+  spdlog::info("sparse image, {} bytes expanded, {} bytes of data in {} chunks", size_, data_size_,
+               chunks_.size());
+
+  return true;
+}
+
+// index of the first data chunk ending after offset, chunks_.size() if none
+size_t KBurnSparseImage::find_chunk(uint64_t offset) const {
+  auto it = std::upper_bound(chunks_.begin(), chunks_.end(), offset,
+                             [](uint64_t off, const struct chunk &c) { return off < (c.offset + c.size); });
+
+  return static_cast<size_t>(it - chunks_.begin());
+}
+
+const uint8_t *KBurnSparseImage::view(uint64_t offset, size_t length) {
+  size_t idx = find_chunk(offset);
+
+  if ((idx >= chunks_.size()) || (SPARSE_CHUNK_TYPE_RAW != chunks_[idx].type)) {
+    return nullptr;
+  }
+
+  const struct chunk &c = chunks_[idx];
+
+  if ((offset < c.offset) || (length > (c.offset + c.size - offset))) {
+    return nullptr;
+  }
+
+  return raw_.view(c.raw_offset + (offset - c.offset), length);
+}
+
+size_t KBurnSparseImage::read(uint64_t offset, void *buffer, size_t length) {
+  if (offset >= size_) {
+    return 0;
+  }
+  length = static_cast<size_t>(std::min<uint64_t>(length, size_ - offset));
+
+  uint8_t *out = reinterpret_cast<uint8_t *>(buffer);
+  uint64_t end = offset + length;
+  size_t idx = find_chunk(offset);
+
+  while (offset < end) {
+    if ((idx >= chunks_.size()) || (offset < chunks_[idx].offset)) {
+      // DONT_CARE up to the next data chunk
+      uint64_t hole_end = (idx < chunks_.size()) ? std::min(end, chunks_[idx].offset) : end;
+
+      memset(out, 0, static_cast<size_t>(hole_end - offset));
+      out += hole_end - offset;
+      offset = hole_end;
+      continue;
+    }
+
+    const struct chunk &c = chunks_[idx];
+    size_t count = static_cast<size_t>(std::min(end, c.offset + c.size) - offset);
+
+    if (SPARSE_CHUNK_TYPE_RAW == c.type) {
+      if (count != raw_.read(c.raw_offset + (offset - c.offset), out, count)) {
+        spdlog::error("sparse image, read raw chunk @ {} failed", c.raw_offset);
+        return static_cast<size_t>(out - reinterpret_cast<uint8_t *>(buffer));
+      }
+    } else {
+      // the pattern repeats every 4 bytes from the start of the chunk
+      size_t phase = static_cast<size_t>((offset - c.offset) % sizeof(c.fill));
+      const uint8_t *pattern = reinterpret_cast<const uint8_t *>(&c.fill);
+
+      for (size_t i = 0; i < count; i++) {
+        out[i] = pattern[(phase + i) % sizeof(c.fill)];
+      }
+    }
+
+    out += count;
+    offset += count;
+    idx++;
+  }
+
+  return length;
+}
+
+std::vector<struct kburn_image_range> KBurnSparseImage::data_ranges(uint64_t align, uint64_t min_gap) const {
+  std::vector<struct kburn_image_range> ranges;
+
+  if (0x00 == align) {
+    align = 1;
+  }
+
+  for (const auto &c : chunks_) {
+    uint64_t start = c.offset / align * align;
+    uint64_t end = std::min(size_, (c.offset + c.size + align - 1) / align * align);
+
+    if (!ranges.empty() && (start <= (ranges.back().offset + ranges.back().size + min_gap))) {
+      struct kburn_image_range &last = ranges.back();
+
+      last.size = std::max(last.offset + last.size, end) - last.offset;
+    } else {
+      ranges.push_back({start, end - start});
+    }
+  }
+
+  return ranges;
+}
+
+}; // namespace Kendryte_Burning_Tool
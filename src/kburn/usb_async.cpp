@@ -0,0 +1,373 @@
+#include "usb_async.h"
+
+#include <algorithm>
+
+namespace Kendryte_Burning_Tool {
+
+#define BULK_EVENT_POLL_MS (100)
+
+static int bulk_status_to_error(enum libusb_transfer_status status) {
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return LIBUSB_SUCCESS;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return LIBUSB_ERROR_TIMEOUT;
+  case LIBUSB_TRANSFER_STALL:
+    return LIBUSB_ERROR_PIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return LIBUSB_ERROR_NO_DEVICE;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return LIBUSB_ERROR_OVERFLOW;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return LIBUSB_ERROR_INTERRUPTED;
+  default:
+    return LIBUSB_ERROR_IO;
+  }
+}
+
+static void LIBUSB_CALL bulk_xfer_callback(struct libusb_transfer *transfer) {
+  struct kburn_bulk_xfer *xfer = static_cast<struct kburn_bulk_xfer *>(transfer->user_data);
+
+  xfer->actual_length = transfer->actual_length;
+  xfer->result = bulk_status_to_error(transfer->status);
+
+  xfer->completed_flag = 1;
+  xfer->completed.store(true, std::memory_order_release);
+}
+
+KBurnLibusbBulkPipe::KBurnLibusbBulkPipe(struct libusb_device_handle *handle)
+    : handle_(handle) {}
+
+KBurnLibusbBulkPipe::~KBurnLibusbBulkPipe() {
+  for (auto transfer : transfers_) {
+    libusb_free_transfer(transfer);
+  }
+}
+
+int KBurnLibusbBulkPipe::submit(struct kburn_bulk_xfer *xfer) {
+  struct libusb_transfer *transfer = static_cast<struct libusb_transfer *>(xfer->priv);
+
+  if (nullptr == transfer) {
+    if (nullptr == (transfer = libusb_alloc_transfer(0))) {
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    transfers_.push_back(transfer);
+
+    xfer->priv = transfer;
+  }
+
+  xfer->completed_flag = 0;
+
+  libusb_fill_bulk_transfer(/* transfer         */ transfer,
+                            /* dev_handle       */ handle_,
+                            /* endpoint         */ xfer->endpoint,
+                            /* bulk data        */ xfer->buffer,
+                            /* bulk data length */ xfer->length,
+                            /* callback         */ bulk_xfer_callback,
+                            /* user data        */ xfer,
+                            /* timeout          */ xfer->timeout_ms);
+
+  return libusb_submit_transfer(transfer);
+}
+
+int KBurnLibusbBulkPipe::cancel(struct kburn_bulk_xfer *xfer) {
+  struct libusb_transfer *transfer = static_cast<struct libusb_transfer *>(xfer->priv);
+
+  if (nullptr == transfer) {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  return libusb_cancel_transfer(transfer);
+}
+
+int KBurnLibusbBulkPipe::handle_events(int timeout_ms, struct kburn_bulk_xfer *wait) {
+  struct timeval tv;
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+  // another device worker may handle our completion, libusb wakes us up when it does
+  return libusb_handle_events_timeout_completed(KBurn::instance()->context(), &tv,
+                                                wait ? &wait->completed_flag : nullptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBurnBulkOutQueue::KBurnBulkOutQueue(KBurnBulkPipe *pipe, uint8_t endpoint, uint16_t max_packet_size,
+                                     unsigned int depth, unsigned int timeout_ms, bool send_zlp)
+    : pipe_(pipe), endpoint_(endpoint), max_packet_size_(max_packet_size),
+      timeout_ms_(timeout_ms), send_zlp_(send_zlp), slots_(depth ? depth : 1) {
+  for (size_t i = slots_.size(); i > 0; i--) {
+    free_slots_.push_back(i - 1);
+  }
+}
+
+KBurnBulkOutQueue::~KBurnBulkOutQueue() {
+  abort();
+}
+
+bool KBurnBulkOutQueue::queue(uint8_t *data, int length, uint64_t tag, bool is_zlp) {
+  while (free_slots_.empty()) {
+    if (false == reap()) {
+      return false;
+    }
+  }
+
+  size_t idx = free_slots_.back();
+  struct kburn_bulk_xfer &xfer = slots_[idx];
+
+  // libusb starts the timeout at submission, the queue ahead of the transfer is allowed for; reap() keeps the real deadline
+  xfer.endpoint = endpoint_;
+  xfer.buffer = data;
+  xfer.length = length;
+  xfer.timeout_ms = static_cast<unsigned int>(std::min<uint64_t>(static_cast<uint64_t>(timeout_ms_) * slots_.size(), UINT32_MAX));
+  xfer.result = LIBUSB_SUCCESS;
+  xfer.actual_length = 0;
+  xfer.tag = tag;
+  xfer.is_zlp = is_zlp;
+  xfer.completed.store(false, std::memory_order_relaxed);
+
+  int r = pipe_->submit(&xfer);
+  if (LIBUSB_SUCCESS != r) {
+    spdlog::error("usb bulk submit failed, {}({}), chunk @ {}", r, libusb_error_name(r), tag);
+
+    failed_ = true;
+    failed_tag_ = tag;
+    failed_result_ = r;
+
+    abort();
+
+    return false;
+  }
+
+  if (inflight_.empty()) {
+    head_since_ = std::chrono::steady_clock::now();
+    head_timed_out_ = false;
+  }
+
+  free_slots_.pop_back();
+  inflight_.push_back(idx);
+
+  return true;
+}
+
+bool KBurnBulkOutQueue::submit(const void *data, size_t size, uint64_t tag) {
+  uint8_t *buffer = const_cast<uint8_t *>(static_cast<const uint8_t *>(data));
+
+  if (failed_) {
+    return false;
+  }
+
+  if (false == queue(buffer, static_cast<int>(size), tag, false)) {
+    return false;
+  }
+
+  if (send_zlp_ && max_packet_size_ && (0x00 == (size % max_packet_size_))) {
+    if (false == queue(buffer, 0, tag, true)) {
+      return false;
+    }
+  }
+
+  submitted_chunks_++;
+
+  return true;
+}
+
+void KBurnBulkOutQueue::fail(struct kburn_bulk_xfer *xfer) {
+  if (xfer->is_zlp) {
+    spdlog::error("usb bulk write ZLP failed, {}({})", xfer->result, libusb_error_name(xfer->result));
+  } else {
+    spdlog::error("usb bulk write data failed, {}({}), or {} != {}", xfer->result,
+                  libusb_error_name(xfer->result), xfer->actual_length, xfer->length);
+  }
+
+  failed_ = true;
+  failed_tag_ = xfer->tag;
+  failed_result_ = (LIBUSB_SUCCESS != xfer->result) ? xfer->result : LIBUSB_ERROR_IO;
+
+  // everything queued behind the failed chunk is stale now
+  for (auto idx : inflight_) {
+    if (false == slots_[idx].completed.load(std::memory_order_acquire)) {
+      pipe_->cancel(&slots_[idx]);
+    }
+  }
+}
+
+bool KBurnBulkOutQueue::reap(void) {
+  if (inflight_.empty()) {
+    return !failed_;
+  }
+
+  struct kburn_bulk_xfer &head = slots_[inflight_.front()];
+
+  if (false == head.completed.load(std::memory_order_acquire)) {
+    pipe_->handle_events(BULK_EVENT_POLL_MS, &head);
+  }
+
+  // what the synchronous write gave one chunk, counted from when it reached the head
+  if ((0x00 != timeout_ms_) && !head_timed_out_ && (false == head.completed.load(std::memory_order_acquire)) &&
+      ((std::chrono::steady_clock::now() - head_since_) >= std::chrono::milliseconds(timeout_ms_))) {
+    head_timed_out_ = true;
+    pipe_->cancel(&head);
+  }
+
+  while (!inflight_.empty()) {
+    size_t idx = inflight_.front();
+    struct kburn_bulk_xfer &xfer = slots_[idx];
+
+    if (false == xfer.completed.load(std::memory_order_acquire)) {
+      break;
+    }
+    inflight_.pop_front();
+    free_slots_.push_back(idx);
+
+    if (head_timed_out_ && (LIBUSB_ERROR_INTERRUPTED == xfer.result)) {
+      xfer.result = LIBUSB_ERROR_TIMEOUT;
+    }
+    head_since_ = std::chrono::steady_clock::now();
+    head_timed_out_ = false;
+
+    if ((LIBUSB_SUCCESS != xfer.result) || (xfer.actual_length != xfer.length)) {
+      if (!failed_) {
+        fail(&xfer);
+      }
+      continue;
+    }
+
+    if (!xfer.is_zlp && !failed_) {
+      completed_chunks_++;
+      completed_bytes_ += xfer.length;
+    }
+  }
+
+  return !failed_;
+}
+
+bool KBurnBulkOutQueue::wait_completed(uint64_t chunks) {
+  while (!failed_ && (completed_chunks_ < chunks)) {
+    if (false == reap()) {
+      break;
+    }
+  }
+
+  if (failed_) {
+    // let cancelled transfers come back before anyone reuses the buffers
+    abort();
+  }
+
+  return !failed_;
+}
+
+bool KBurnBulkOutQueue::drain(void) {
+  while (!failed_ && !inflight_.empty()) {
+    if (false == reap()) {
+      break;
+    }
+  }
+
+  if (failed_) {
+    abort();
+  }
+
+  return !failed_;
+}
+
+void KBurnBulkOutQueue::abort(void) {
+  for (auto idx : inflight_) {
+    if (false == slots_[idx].completed.load(std::memory_order_acquire)) {
+      pipe_->cancel(&slots_[idx]);
+    }
+  }
+
+  while (!inflight_.empty()) {
+    size_t idx = inflight_.front();
+
+    if (false == slots_[idx].completed.load(std::memory_order_acquire)) {
+      pipe_->handle_events(BULK_EVENT_POLL_MS, &slots_[idx]);
+      continue;
+    }
+    inflight_.pop_front();
+    free_slots_.push_back(idx);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+KBurnBulkInQueue::KBurnBulkInQueue(KBurnBulkPipe *pipe, uint8_t endpoint, unsigned int depth,
+                                   size_t buffer_size, unsigned int timeout_ms)
+    : pipe_(pipe), endpoint_(endpoint), timeout_ms_(timeout_ms),
+      slots_(depth ? depth : 1), buffers_(slots_.size()) {
+  for (size_t i = slots_.size(); i > 0; i--) {
+    buffers_[i - 1].resize(buffer_size);
+    free_slots_.push_back(i - 1);
+  }
+}
+
+KBurnBulkInQueue::~KBurnBulkInQueue() {
+  abort();
+}
+
+bool KBurnBulkInQueue::submit(int length, uint64_t tag) {
+  if (free_slots_.empty() || (static_cast<size_t>(length) > buffers_[0].size())) {
+    return false;
+  }
+
+  size_t idx = free_slots_.back();
+  struct kburn_bulk_xfer &xfer = slots_[idx];
+
+  xfer.endpoint = endpoint_;
+  xfer.buffer = buffers_[idx].data();
+  xfer.length = length;
+  xfer.timeout_ms = timeout_ms_;
+  xfer.result = LIBUSB_SUCCESS;
+  xfer.actual_length = 0;
+  xfer.tag = tag;
+  xfer.is_zlp = false;
+  xfer.completed.store(false, std::memory_order_relaxed);
+
+  int r = pipe_->submit(&xfer);
+  if (LIBUSB_SUCCESS != r) {
+    spdlog::error("usb bulk submit read failed, {}({})", r, libusb_error_name(r));
+    return false;
+  }
+
+  free_slots_.pop_back();
+  inflight_.push_back(idx);
+
+  return true;
+}
+
+struct kburn_bulk_xfer *KBurnBulkInQueue::front(void) {
+  if (inflight_.empty()) {
+    return nullptr;
+  }
+
+  struct kburn_bulk_xfer *xfer = &slots_[inflight_.front()];
+
+  while (false == xfer->completed.load(std::memory_order_acquire)) {
+    pipe_->handle_events(BULK_EVENT_POLL_MS, xfer);
+  }
+
+  return xfer;
+}
+
+void KBurnBulkInQueue::pop(void) {
+  if (inflight_.empty()) {
+    return;
+  }
+
+  free_slots_.push_back(inflight_.front());
+  inflight_.pop_front();
+}
+
+void KBurnBulkInQueue::abort(void) {
+  for (auto idx : inflight_) {
+    if (false == slots_[idx].completed.load(std::memory_order_acquire)) {
+      pipe_->cancel(&slots_[idx]);
+    }
+  }
+
+  while (nullptr != front()) {
+    pop();
+  }
+}
+
+}; // namespace Kendryte_Burning_Tool
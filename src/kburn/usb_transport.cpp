@@ -0,0 +1,142 @@
+#include "usb_transport.h"
+
+#include <cstring>
+#include <mutex>
+
+namespace Kendryte_Burning_Tool {
+
+int kburn_usb_control_transfer(struct kburn_usb_node *node, uint8_t request_type, uint8_t request,
+                               uint16_t value, uint16_t index, uint8_t *data, uint16_t length,
+                               unsigned int timeout_ms) {
+  if (node->transport) {
+    return node->transport->control_transfer(request_type, request, value, index, data, length, timeout_ms);
+  }
+
+  return libusb_control_transfer(node->handle, request_type, request, value, index, data, length, timeout_ms);
+}
+
+int kburn_usb_bulk_transfer(struct kburn_usb_node *node, uint8_t endpoint, uint8_t *data, int length,
+                            int *transferred, unsigned int timeout_ms) {
+  if (node->transport) {
+    return node->transport->bulk_transfer(endpoint, data, length, transferred, timeout_ms);
+  }
+
+  return libusb_bulk_transfer(node->handle, endpoint, data, length, transferred, timeout_ms);
+}
+
+int kburn_usb_clear_halt(struct kburn_usb_node *node, uint8_t endpoint) {
+  if (node->transport) {
+    return node->transport->clear_halt(endpoint);
+  }
+
+  return libusb_clear_halt(node->handle, endpoint);
+}
+
+std::unique_ptr<KBurnBulkPipe> kburn_usb_bulk_pipe(struct kburn_usb_node *node) {
+  if (node->transport) {
+    return node->transport->bulk_pipe();
+  }
+
+  return std::unique_ptr<KBurnBulkPipe>(new KBurnLibusbBulkPipe(node->handle));
+}
+
+bool kburn_usb_bcd_device(struct kburn_usb_node *node, uint16_t &bcd_device) {
+  struct libusb_device_descriptor desc;
+
+  if (node->transport) {
+    bcd_device = node->transport->bcd_device();
+    return true;
+  }
+
+  if (LIBUSB_SUCCESS != libusb_get_device_descriptor(libusb_get_device(node->handle), &desc)) {
+    return false;
+  }
+  bcd_device = desc.bcdDevice;
+
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+namespace {
+
+class emulated_device_table {
+public:
+  static emulated_device_table &get() {
+    static emulated_device_table table;
+    return table;
+  }
+
+  std::mutex lock;
+  std::vector<struct kburn_emulated_device> devices;
+};
+
+}; // namespace
+
+bool kburn_add_emulated_device(const std::string &path, uint16_t vid, uint16_t pid,
+                               std::shared_ptr<KBurnUsbTransport> transport) {
+  emulated_device_table &table = emulated_device_table::get();
+  struct kburn_emulated_device device;
+
+  if (path.empty() || (path.size() >= KBURN_USB_PATH_BUFERR_SIZE) || !transport) {
+    spdlog::error("emulated device '{}', invalid path or transport", path);
+    return false;
+  }
+
+  memset(&device.info, 0, sizeof(device.info));
+  device.info.vid = vid;
+  device.info.pid = pid;
+  strncpy(device.info.path, path.c_str(), KBURN_USB_PATH_BUFERR_SIZE - 1);
+  device.transport = transport;
+
+  std::lock_guard<std::mutex> guard(table.lock);
+
+  for (const auto &other : table.devices) {
+    if (0x00 == strncmp(other.info.path, device.info.path, KBURN_USB_PATH_BUFERR_SIZE)) {
+      spdlog::error("emulated device '{}' exists", path);
+      return false;
+    }
+  }
+  table.devices.push_back(device);
+
+  spdlog::info("emulated device vid 0x{:04x} pid 0x{:04x} path {}", vid, pid, path);
+
+  return true;
+}
+
+void kburn_remove_emulated_devices(void) {
+  emulated_device_table &table = emulated_device_table::get();
+  std::lock_guard<std::mutex> guard(table.lock);
+
+  table.devices.clear();
+}
+
+std::vector<struct kburn_emulated_device> kburn_emulated_devices(uint16_t vid, uint16_t pid, const char *path) {
+  emulated_device_table &table = emulated_device_table::get();
+  std::vector<struct kburn_emulated_device> found;
+  std::lock_guard<std::mutex> guard(table.lock);
+
+  for (const auto &device : table.devices) {
+    if ((vid != device.info.vid) || (pid != device.info.pid)) {
+      continue;
+    }
+
+    if (path && (0x00 != strncmp(path, device.info.path, KBURN_USB_PATH_BUFERR_SIZE))) {
+      continue;
+    }
+
+    if (device.transport->present()) {
+      found.push_back(device);
+    }
+  }
+
+  return found;
+}
+
+bool kburn_has_emulated_devices(void) {
+  emulated_device_table &table = emulated_device_table::get();
+  std::lock_guard<std::mutex> guard(table.lock);
+
+  return !table.devices.empty();
+}
+
+}; // namespace Kendryte_Burning_Tool
@@ -0,0 +1,90 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <kburn.h>
+#include <crc32.h>
+
+using namespace std;
+
+using namespace Kendryte_Burning_Tool;
+
+static bool failed = false;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what.c_str());
+        failed = true;
+    }
+}
+
+int main(int argc, char **argv) {
+    // same data every run, another seed can be given on the command line
+    uint32_t seed = (argc > 1) ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 0)) : 1;
+    mt19937 rng(seed);
+
+    printf("seed %u\n", seed);
+
+    // the reference itself, against the check value of CRC-32/ISO-HDLC
+    check(0xCBF43926 == kburn_crc32_with(KBURN_CRC32_TABLE, 0, "123456789", 9), "crc32/table check value");
+
+    vector<uint8_t> data(1024 * 1024 + 64);
+    for (auto &byte : data) {
+        byte = static_cast<uint8_t>(rng());
+    }
+
+    for (int b = 0; b < KBURN_CRC32_BACKEND_MAX; b++) {
+        enum kburn_crc32_backend backend = static_cast<enum kburn_crc32_backend>(b);
+        string name = string("crc32/") + kburn_crc32_backend_name(backend);
+
+        if (!kburn_crc32_backend_supported(backend)) {
+            printf("%-24s unsupported\n", name.c_str());
+            continue;
+        }
+
+        bool failed_before = failed;
+        failed = false;
+
+        // every length around the block sizes of the fast paths, at every alignment
+        bool same = true;
+        for (size_t length = 0; (length <= 512) && same; length++) {
+            for (size_t offset = 0; (offset < 16) && same; offset++) {
+                same = kburn_crc32_with(KBURN_CRC32_TABLE, 0, data.data() + offset, length) ==
+                       kburn_crc32_with(backend, 0, data.data() + offset, length);
+            }
+        }
+        check(same, name + " short lengths");
+
+        // random lengths, alignments and seeds
+        same = true;
+        for (int i = 0; (i < 10000) && same; i++) {
+            size_t offset = rng() % 64;
+            size_t length = (i % 10) ? (rng() % 4096) : (rng() % (data.size() - offset));
+            uint32_t crc = (i % 2) ? rng() : 0;
+
+            same = kburn_crc32_with(KBURN_CRC32_TABLE, crc, data.data() + offset, length) ==
+                   kburn_crc32_with(backend, crc, data.data() + offset, length);
+        }
+        check(same, name + " random");
+
+        // continuing from a previous result is the same as one call over both pieces
+        size_t split = rng() % data.size();
+        uint32_t whole = kburn_crc32_with(backend, 0, data.data(), data.size());
+        uint32_t parts = kburn_crc32_with(backend, kburn_crc32_with(backend, 0, data.data(), split),
+                                          data.data() + split, data.size() - split);
+        check(whole == parts, name + " continued");
+
+        printf("%-24s %s\n", name.c_str(), failed ? "MISMATCH" : "ok");
+        failed = failed || failed_before;
+    }
+
+    // the dispatched entry point uses one of the above
+    check(kburn_crc32(0, data.data(), data.size()) == kburn_crc32_with(KBURN_CRC32_TABLE, 0, data.data(), data.size()),
+          "crc32 dispatched");
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,466 @@
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <kburn.h>
+#include <image_source.h>
+#include <sparse_image.h>
+#include <flash_plan.h>
+#include <usb_transport.h>
+#include <k230/kburn_k230.h>
+#include <k230/kburn_k230_emulator.h>
+
+using namespace std;
+
+using namespace Kendryte_Burning_Tool;
+
+#define EMULATOR_PATH           "emu-t"
+#define EMULATOR_WAIT_MS        (15 * 1000)
+/* the emulator boots at once, a loader not up by then never comes */
+#define EMULATOR_BOOT_WAIT_MS   (2 * 1000)
+
+#define MIB                     (1024ULL * 1024)
+
+#define TEST_ADDRESS            (1024 * 1024)
+#define TEST_SIZE               (128 * 1024 + 1000)
+
+/* the hole is above the gap the burner writes through anyway */
+#define SPARSE_BLK_SIZE         (4096)
+#define SPARSE_DATA_SIZE        (64 * 1024)
+#define SPARSE_HOLE_SIZE        (2 * 1024 * 1024)
+
+static bool failed = false;
+
+static void check(bool ok, const string &what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what.c_str());
+        failed = true;
+    }
+}
+
+static filesystem::path backing_path(const string &name) {
+    return filesystem::temp_directory_path() / ("kburn_emulator_test_" + name + ".img");
+}
+
+static filesystem::path pages_path(const string &name) {
+    return filesystem::temp_directory_path() / ("kburn_emulator_test_" + name + ".pages");
+}
+
+static bool add_emulator(const string &name, const string &options) {
+    struct K230::k230_emulator_config config = K230::k230_emulator_default_config(KBURN_MEDIUM_EMMC);
+
+    // page sizes learnt by one case neither leak into the next nor into the table real boards use
+    filesystem::remove(backing_path(name));
+    filesystem::remove_all(pages_path(name));
+    K230::K230BROMBurner::set_page_table_dir(pages_path(name).string());
+
+    config.backing_file = backing_path(name).string();
+
+    if (!K230::k230_emulator_parse_options("instant,capacity=16m," + options, config)) {
+        printf("%s: invalid options %s\n", name.c_str(), options.c_str());
+        return false;
+    }
+
+    auto emulator = make_shared<K230::K230Emulator>(config);
+    if (!emulator->is_valid() || !kburn_add_emulated_device(EMULATOR_PATH, 0x29f1, 0x0230, emulator)) {
+        printf("%s: can not set up the emulator\n", name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static void remove_emulator(const string &name) {
+    kburn_remove_emulated_devices();
+    filesystem::remove(backing_path(name));
+    filesystem::remove_all(pages_path(name));
+}
+
+/*
+ * BROM upload and boot, then probe the medium. The loader has to go up in
+ * `page_size` byte pages, larger ones than 1000 only tried with `page_probe`.
+ */
+static unique_ptr<K230::K230UBOOTBurner> boot_loader(const string &name, bool page_probe, size_t page_size) {
+    struct kburn_usb_dev_info dev;
+    struct K230::K230BROMBurner::boot_options boot;
+    struct K230::K230BROMBurner::upload_info upload;
+    string error;
+
+    if (!wait_usb_device_with_vid_pid(dev, EMULATOR_PATH, KBURN_USB_DEV_BROM, EMULATOR_WAIT_MS)) {
+        printf("%s: no BROM device\n", name.c_str());
+        return nullptr;
+    }
+
+    boot.medium_type = KBURN_MEDIUM_EMMC;
+    boot.reenumerate_timeout_ms = EMULATOR_BOOT_WAIT_MS;
+    boot.page_probe = page_probe;
+
+    unique_ptr<K230::K230UBOOTBurner> uboot = K230::K230BROMBurner::boot_loader(dev, boot, error, &upload);
+    if (!uboot) {
+        printf("%s: the loader did not come up, %s\n", name.c_str(), error.c_str());
+        return nullptr;
+    }
+
+    if (upload.page_size != page_size) {
+        printf("%s: loader uploaded in %zu byte pages, not %zu\n", name.c_str(), upload.page_size, page_size);
+        return nullptr;
+    }
+
+    uboot->set_medium_type(KBURN_MEDIUM_EMMC);
+
+    if (!uboot->probe() || (nullptr == uboot->get_medium_info())) {
+        printf("%s: probe failed, %s\n", name.c_str(), uboot->get_error_msg());
+        return nullptr;
+    }
+
+    return uboot;
+}
+
+/* erase, write and read back through the loader */
+static bool flash_and_verify(const string &name, const string &options, bool page_probe, size_t page_size,
+                             const vector<uint8_t> &data) {
+    if (!add_emulator(name, options)) {
+        return false;
+    }
+
+    bool ok = false;
+
+    do {
+        unique_ptr<K230::K230UBOOTBurner> uboot = boot_loader(name, page_probe, page_size);
+        if (!uboot) {
+            break;
+        }
+
+        struct K230::kburn_medium_info *medium = uboot->get_medium_info();
+        KBurnMemoryImageSource source(data.data(), data.size());
+        size_t erase_size = (data.size() + medium->erase_size - 1) / medium->erase_size * medium->erase_size;
+
+        if (!uboot->erase(TEST_ADDRESS, erase_size) ||
+            !uboot->write_stream(source, data.size(), TEST_ADDRESS, data.size(), 0)) {
+            printf("%s: erase or write failed, %s\n", name.c_str(), uboot->get_error_msg());
+            break;
+        }
+
+        vector<uint8_t> back(data.size());
+
+        if (!uboot->read(back.data(), back.size(), TEST_ADDRESS)) {
+            printf("%s: read back failed, %s\n", name.c_str(), uboot->get_error_msg());
+            break;
+        }
+
+        if (0x00 != memcmp(back.data(), data.data(), data.size())) {
+            printf("%s: read back differs from what was written\n", name.c_str());
+            break;
+        }
+
+        ok = true;
+    } while (0);
+
+    remove_emulator(name);
+
+    return ok;
+}
+
+/* an Android sparse image of `chunks`, each a RAW run of `size` bytes from `data` or a DONT_CARE hole of it */
+struct sparse_chunk {
+    bool raw;
+    uint32_t size;
+};
+
+static vector<uint8_t> make_sparse(const vector<struct sparse_chunk> &chunks, const vector<uint8_t> &data) {
+    struct sparse_header_t header = {SPARSE_HEADER_MAGIC, 1, 0, sizeof(struct sparse_header_t),
+                                     sizeof(struct sparse_chunk_header_t), SPARSE_BLK_SIZE, 0,
+                                     static_cast<uint32_t>(chunks.size()), 0};
+    vector<uint8_t> image(sizeof(header));
+    size_t used = 0;
+
+    for (const auto &chunk : chunks) {
+        struct sparse_chunk_header_t chunk_header = {
+            static_cast<uint16_t>(chunk.raw ? SPARSE_CHUNK_TYPE_RAW : SPARSE_CHUNK_TYPE_DONT_CARE), 0,
+            chunk.size / SPARSE_BLK_SIZE,
+            static_cast<uint32_t>(sizeof(chunk_header) + (chunk.raw ? chunk.size : 0))};
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&chunk_header);
+
+        image.insert(image.end(), bytes, bytes + sizeof(chunk_header));
+        if (chunk.raw) {
+            image.insert(image.end(), data.begin() + used, data.begin() + used + chunk.size);
+            used += chunk.size;
+        }
+        header.total_blks += chunk.size / SPARSE_BLK_SIZE;
+    }
+
+    memcpy(image.data(), &header, sizeof(header));
+
+    return image;
+}
+
+static bool covered(const vector<struct kburn_range> &ranges, uint64_t offset, uint64_t size) {
+    for (const auto &range : ranges) {
+        if ((range.offset <= offset) && ((offset + size) <= (range.offset + range.size))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * The erases kburn_plan_part_erases() plans for the remaining space of parts,
+ * where the DONT_CARE holes of two sparse parts lie in the erase range of the
+ * part before them. Nothing writes the holes, so the erase has to, or they
+ * keep whatever the medium held.
+ */
+static bool sparse_erase_plan(const vector<uint8_t> &data) {
+    const string name = "sparse_plan";
+
+    if (!add_emulator(name, "")) {
+        return false;
+    }
+
+    bool ok = false;
+
+    do {
+        unique_ptr<K230::K230UBOOTBurner> uboot = boot_loader(name, false, 1000);
+        if (!uboot) {
+            break;
+        }
+
+        struct K230::kburn_medium_info *medium = uboot->get_medium_info();
+        uint8_t erased = kburn_medium_erased_byte(KBURN_MEDIUM_EMMC);
+
+        // a plain part at 1m erasing up to 5m, a sparse one at 2m erasing up to 9m and a sparse one at 8m
+        vector<uint8_t> first = make_sparse({{true, SPARSE_DATA_SIZE}, {false, SPARSE_HOLE_SIZE}, {true, SPARSE_DATA_SIZE}}, data);
+        vector<uint8_t> second = make_sparse({{false, SPARSE_HOLE_SIZE}, {true, SPARSE_DATA_SIZE}}, data);
+        KBurnMemoryImageSource first_raw(first.data(), first.size()), second_raw(second.data(), second.size());
+        KBurnSparseImage first_sparse(first_raw), second_sparse(second_raw);
+
+        if (!first_sparse.is_valid() || !second_sparse.is_valid()) {
+            printf("%s: invalid sparse image\n", name.c_str());
+            break;
+        }
+
+        KBurnSparseImage *sparse[] = {nullptr, &first_sparse, &second_sparse};
+        vector<struct kburn_plan_item> items = {
+            {1 * MIB, SPARSE_DATA_SIZE, 1 * MIB, 0, true, 4 * MIB},
+            {2 * MIB, first_sparse.size(), 6 * MIB, 0, false, 7 * MIB},
+            {8 * MIB, second_sparse.size(), second_sparse.size(), 0, false, 0},
+        };
+        vector<struct kburn_write_session> sessions = kburn_plan_write_sessions(items, KBURN_MEDIUM_EMMC, 0);
+        vector<struct kburn_range> holes;
+
+        for (size_t i = 0; i < items.size(); i++) {
+            uint64_t done = 0;
+
+            for (const auto &range : sparse[i] ? uboot->sparse_write_ranges(*sparse[i], 0) : vector<struct kburn_image_range>()) {
+                if (range.offset > done) {
+                    holes.push_back({items[i].offset + done, range.offset - done});
+                }
+                done = range.offset + range.size;
+            }
+        }
+
+        if (holes.size() != 2) {
+            printf("%s: %zu holes in the sparse write ranges, not 2\n", name.c_str(), holes.size());
+            break;
+        }
+
+        auto planned = kburn_plan_part_erases(items, sessions, medium->erase_size, true,
+            [&](const struct kburn_write_session &session, vector<struct kburn_image_range> &ranges) {
+                KBurnSparseImage *image = sparse[session.items.front()];
+
+                if (nullptr == image) {
+                    return false;
+                }
+
+                ranges = uboot->sparse_write_ranges(*image, session.flag);
+                return true;
+            });
+
+        // the part of each hole inside an erase range of the part before it
+        struct kburn_range overlaps[] = {
+            {holes[0].offset, holes[0].size},
+            {holes[1].offset, 9 * MIB - holes[1].offset},
+        };
+        bool planned_ok = true;
+
+        for (const auto &overlap : overlaps) {
+            if (!covered(planned, overlap.offset, overlap.size)) {
+                printf("%s: hole 0x%llx, size 0x%llx is not erased\n", name.c_str(),
+                       (unsigned long long)overlap.offset, (unsigned long long)overlap.size);
+                planned_ok = false;
+            }
+        }
+        if (!planned_ok) {
+            break;
+        }
+
+        // old data under all of it, then erase and write the way k230_flash does
+        vector<uint8_t> old(10 * MIB - 1 * MIB, 0xA5);
+        KBurnMemoryImageSource old_source(old.data(), old.size());
+
+        if (!uboot->write_stream(old_source, old.size(), 1 * MIB, old.size(), 0)) {
+            printf("%s: writing old data failed, %s\n", name.c_str(), uboot->get_error_msg());
+            break;
+        }
+
+        bool flashed = true;
+
+        for (const auto &range : planned) {
+            flashed = flashed && uboot->erase(range.offset, range.size);
+        }
+
+        KBurnMemoryImageSource plain(data.data(), SPARSE_DATA_SIZE);
+
+        flashed = flashed && uboot->write_stream(plain, SPARSE_DATA_SIZE, items[0].offset, SPARSE_DATA_SIZE, 0);
+        flashed = flashed && uboot->write_sparse(first_sparse, items[1].offset, first_sparse.size(), 0);
+        flashed = flashed && uboot->write_sparse(second_sparse, items[2].offset, second_sparse.size(), 0);
+
+        if (!flashed) {
+            printf("%s: flashing failed, %s\n", name.c_str(), uboot->get_error_msg());
+            break;
+        }
+
+        bool erased_ok = true;
+
+        for (const auto &overlap : overlaps) {
+            vector<uint8_t> back(overlap.size);
+
+            if (!uboot->read(back.data(), back.size(), overlap.offset)) {
+                printf("%s: read back failed, %s\n", name.c_str(), uboot->get_error_msg());
+                erased_ok = false;
+                break;
+            }
+
+            if (any_of(back.begin(), back.end(), [erased](uint8_t byte) { return byte != erased; })) {
+                printf("%s: hole 0x%llx still holds old data\n", name.c_str(), (unsigned long long)overlap.offset);
+                erased_ok = false;
+            }
+        }
+
+        ok = erased_ok;
+    } while (0);
+
+    remove_emulator(name);
+
+    return ok;
+}
+
+/* bytes in memory that carry a checksum which never matches */
+class corrupt_source : public KBurnMemoryImageSource {
+public:
+    using KBurnMemoryImageSource::KBurnMemoryImageSource;
+
+    bool digests(void) const override { return true; }
+    bool verify(void) override { return false; }
+};
+
+/*
+ * A checksum mismatch through a range of the source, the way incremental
+ * writes see it. The session completes, then the write fails, and the loader
+ * takes the next write as a command again.
+ */
+static bool checksum_mismatch(const vector<uint8_t> &data) {
+    const string name = "checksum_mismatch";
+
+    if (!add_emulator(name, "")) {
+        return false;
+    }
+
+    bool ok = false;
+
+    do {
+        unique_ptr<K230::K230UBOOTBurner> uboot = boot_loader(name, false, 1000);
+        if (!uboot) {
+            break;
+        }
+
+        // more than one chunk, the hash is still running when the last one goes out
+        vector<uint8_t> large(3 * MIB / 2, 0x5A);
+        corrupt_source corrupt(large.data(), large.size());
+        KBurnSubImageSource range(corrupt, 0, large.size());
+
+        if (uboot->write_stream(range, large.size(), TEST_ADDRESS, large.size(), 0)) {
+            printf("%s: write with a bad checksum went through\n", name.c_str());
+            break;
+        }
+
+        KBurnMemoryImageSource source(data.data(), data.size());
+        vector<uint8_t> back(data.size());
+
+        if (!uboot->write_stream(source, data.size(), TEST_ADDRESS, data.size(), 0) ||
+            !uboot->read(back.data(), back.size(), TEST_ADDRESS)) {
+            printf("%s: write after the mismatch failed, %s\n", name.c_str(), uboot->get_error_msg());
+            break;
+        }
+
+        if (0x00 != memcmp(back.data(), data.data(), data.size())) {
+            printf("%s: read back differs from what was written\n", name.c_str());
+            break;
+        }
+
+        ok = true;
+    } while (0);
+
+    remove_emulator(name);
+
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    // same data every run, another seed can be given on the command line
+    uint32_t seed = (argc > 1) ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 0)) : 1;
+    mt19937 rng(seed);
+
+    printf("seed %u\n", seed);
+
+    vector<uint8_t> data(TEST_SIZE);
+    for (auto &byte : data) {
+        byte = static_cast<uint8_t>(rng());
+    }
+
+    kburn_initialize();
+
+    // a chip not seen before gets the page size every revision takes
+    check(flash_and_verify("plain", "", false, 1000, data), "flash and read back");
+
+    check(flash_and_verify("probe", "", true, 63000, data), "flash and read back, probing the page size");
+
+    // read chunks that time out are queued again
+    check(flash_and_verify("in_timeout", "in_timeout_every=3", false, 1000, data), "flash and read back, in_timeout_every=3");
+
+    // the BROM stalls on large pages, the upload goes down to a size it takes
+    check(flash_and_verify("brom_max_page", "brom_max_page=16000", true, 15000, data), "flash and read back, brom_max_page=16000");
+
+    // the BROM takes large pages but stores them wrong, the board is booted again with smaller ones
+    check(flash_and_verify("brom_bad_page", "brom_bad_page=20000", true, 15000, data), "flash and read back, brom_bad_page=20000");
+
+    // a stall longer than one read timeout times out every queued read, the read still goes through
+    check(flash_and_verify("in_stall", "in_stall_every=2,in_stall_ms=7000", false, 1000, data), "flash and read back, in_stall_ms=7000");
+
+    // responses that complete as their read times out are not lost
+    check(flash_and_verify("in_race", "in_race_every=2", false, 1000, data), "flash and read back, in_race_every=2");
+
+    // sparse holes in another part's erase range are erased
+    check(sparse_erase_plan(data), "sparse holes in an erase range");
+
+    // a bad checksum fails the write, the loader is still in step for the next one
+    check(checksum_mismatch(data), "checksum mismatch while writing");
+
+    kburn_deinitialize();
+    K230::K230BROMBurner::set_page_table_dir("");
+
+    if (failed) {
+        return 1;
+    }
+
+    printf("all passed\n");
+
+    return 0;
+}